@@ -63,11 +63,22 @@ KVStatus Blackhole::Put(const string& key, const string& value) {
     return OK;
 }
 
+KVStatus Blackhole::Put(const int32_t keybytes, const int32_t valuebytes, const char* key,
+                        const char* value) {
+    LOG("Put key=" << string(key, keybytes) << ", value.size=" << to_string(valuebytes));
+    return OK;
+}
+
 KVStatus Blackhole::Remove(const string& key) {
     LOG("Remove key=" << key.c_str());
     return OK;
 }
 
+KVStatus Blackhole::Remove(const int32_t keybytes, const char* key) {
+    LOG("Remove key=" << string(key, keybytes));
+    return OK;
+}
+
 void Blackhole::Free() {
   LOG("Free the tree");
   // TODO impl
@@ -84,6 +95,10 @@ PMEMobjpool* Blackhole::GetPool() {
   return nullptr;
 }
 
+static const bool registered = KVEngineRegistry::Register(ENGINE, [](const string& path, const size_t size,
+        const string& layout, const KVConfig& config) -> KVEngine* {
+    return config.empty() ? new Blackhole() : nullptr;
+});
 
 } // namespace blackhole
 } // namespace pmemkv
@@ -54,7 +54,13 @@ class Blackhole : public KVEngine {
                  string* value) final;
     KVStatus Put(const string& key,                        // copy value from std::string
                  const string& value) final;
+    KVStatus Put(int32_t keybytes,                         // copy value from buffer
+                 int32_t valuebytes,
+                 const char* key,
+                 const char* value) final;
     KVStatus Remove(const string& key) final;              // remove value for key
+    KVStatus Remove(int32_t keybytes,                      // remove value for key in buffer
+                    const char* key) final;
 
     void Free() final;
 
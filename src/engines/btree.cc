@@ -30,7 +30,11 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <string_view>
+#include <type_traits>
 #include <unistd.h>
 
 #include <libpmemobj++/transaction.hpp>
@@ -43,13 +47,67 @@
 #define LOG(msg) if (DO_LOG) std::cout << "[btree] " << msg << "\n"
 
 using pmem::obj::make_persistent_atomic;
+using pmem::obj::delete_persistent;
 using pmem::obj::transaction;
-using pmem::detail::conditional_add_to_tx;
 
 namespace pmemkv {
 namespace btree {
 
-BTreeEngine::BTreeEngine(const string& path, const size_t size, const string& layout) {
+// Keys of btree are held in fixed-size strings, keys of btree_u64 must be 8 bytes long
+template <size_t KEY_SIZE>
+static bool ToKey(const std::string_view key, pstring<KEY_SIZE>* result) {
+    if (key.size() > KEY_SIZE) return false;
+    result->assign(key.data(), key.size());
+    return true;
+}
+
+static bool ToKey(const std::string_view key, uint64_t* result) {
+    if (key.size() != sizeof(uint64_t)) return false;
+    memcpy(result, key.data(), sizeof(uint64_t));
+    return true;
+}
+
+template <size_t KEY_SIZE>
+static string FromKey(const pstring<KEY_SIZE>& key) {
+    return string(key.c_str(), key.size());
+}
+
+static string FromKey(const uint64_t& key) {
+    return string((const char*) &key, sizeof(uint64_t));
+}
+
+static string GeometryName(const size_t degree, const size_t key_size, const size_t value_size) {
+    if (degree == DEGREE && key_size == MAX_KEY_SIZE && value_size == MAX_VALUE_SIZE) return ENGINE;
+    return ENGINE + ":degree=" + to_string(degree) + ",key=" + to_string(key_size) +
+           ",value=" + to_string(value_size);
+}
+
+template <size_t KEY_SIZE>
+static size_t KeySize(const pstring<KEY_SIZE>*) {
+    return KEY_SIZE;
+}
+
+static size_t KeySize(const uint64_t*) {
+    return sizeof(uint64_t);
+}
+
+template <size_t KEY_SIZE>
+static string EngineName(const pstring<KEY_SIZE>*, const size_t degree, const size_t value_size) {
+    return GeometryName(degree, KEY_SIZE, value_size);
+}
+
+static string EngineName(const uint64_t*, const size_t degree, const size_t value_size) {
+    return U64_ENGINE;
+}
+
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+string BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::Engine() {
+    return EngineName((const TKey*) nullptr, NODE_DEGREE, VALUE_CAPACITY);
+}
+
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::BTreeEngineBase(const string& path, const size_t size,
+                                                                    const string& layout) {
     if ((access(path.c_str(), F_OK) != 0) && (size > 0)) {
         LOG("Creating filesystem pool, path=" << path << ", size=" << to_string(size));
         pmpool = pool<RootData>::create(path.c_str(), layout, size, S_IRWXU);
@@ -57,76 +115,290 @@ BTreeEngine::BTreeEngine(const string& path, const size_t size, const string& la
         LOG("Opening pool, path=" << path);
         pmpool = pool<RootData>::open(path.c_str(), layout);
     }
+    try {
+        CheckLayout();
+        CheckGeometry();
+    } catch (...) {
+        pmpool.close();
+        throw;
+    }
     Recover();
     LOG("Opened ok");
 }
 
-BTreeEngine::~BTreeEngine() {
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::~BTreeEngineBase() {
     LOG("Closing");
+    if (my_btree != nullptr) my_btree->close();
     pmpool.close();
     LOG("Closed ok");
 }
 
-KVStatus BTreeEngine::Get(const int32_t limit, const int32_t keybytes, int32_t* valuebytes,
-                        const char* key, char* value) {
-    LOG("Get for key=" << key);
-    return NOT_FOUND;
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+KVStatus BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::Get(const int32_t limit, const int32_t keybytes,
+                                                                 int32_t* valuebytes, const char* key,
+                                                                 char* value) {
+    const std::string_view ckey(key, (size_t) keybytes);
+    LOG("Get for key=" << ckey);
+    TKey stored;
+    pstring<VALUE_CAPACITY> found;
+    if ( !ToKey(ckey, &stored) || !my_btree->find( stored, found, mirror.get() ) ) {
+        LOG("Key=" << ckey << " not found");
+        return NOT_FOUND;
+    }
+    *valuebytes = (int32_t) found.size();
+    if (*valuebytes > limit) {
+        LOG("   buffer too small, size=" << to_string(found.size()));
+        return FAILED;
+    }
+    memcpy(value, found.c_str(), found.size());
+    return OK;
 }
 
-KVStatus BTreeEngine::Get(const string& key, string* value) {
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+KVStatus BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::Get(const string& key, string* value) {
     LOG("Get for key=" << key.c_str());
-    btree_type::iterator it = my_btree->find( pstring<20>(key) );
-    if ( it == my_btree->end() ) {
+    TKey stored;
+    pstring<VALUE_CAPACITY> found;
+    if ( !ToKey(key, &stored) || !my_btree->find( stored, found, mirror.get() ) ) {
         LOG("Key=" << key.c_str() << " not found");
         return NOT_FOUND;
     }
-    value->append( it->second.c_str(), it->second.size() );
+    value->append( found.c_str(), found.size() );
     return OK;
 }
 
-KVStatus BTreeEngine::Put(const string& key, const string& value) {
-    LOG("Put key=" << key.c_str() << ", value.size=" << to_string(value.size()));
-    std::pair<typename btree_type::iterator, bool> res = my_btree->insert(std::make_pair(pstring<MAX_KEY_SIZE>(key), pstring<MAX_VALUE_SIZE>(value)));
-    if(!res.second) { // Key already exist.
-        // update value
-        typename btree_type::value_type& entry = *res.first;
-        transaction::manual tx( pmpool );
-        conditional_add_to_tx(&(entry.second));
-        entry.second = value;
-        transaction::commit();
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+KVStatus BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::Put(const string& key,
+                                                                 const string& value) {
+    return Put((int32_t) key.size(), (int32_t) value.size(), key.data(), value.data());
+}
+
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+KVStatus BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::Put(const int32_t keybytes, const int32_t valuebytes,
+                                                                 const char* key, const char* value) {
+    LOG("Put key=" << std::string_view(key, (size_t) keybytes) << ", value.size=" << to_string(valuebytes));
+    TKey stored;
+    if (!ToKey(std::string_view(key, (size_t) keybytes), &stored) || (size_t) valuebytes > VALUE_CAPACITY) {
+        return FAILED;
     }
+    my_btree->insert_or_assign(std::make_pair(stored, pstring<VALUE_CAPACITY>(value, (size_t) valuebytes)));
     return OK;
 }
 
-KVStatus BTreeEngine::Remove(const string& key) {
-    LOG("Remove key=" << key.c_str());
-    return FAILED;
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+KVStatus BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::Remove(const string& key) {
+    return Remove((int32_t) key.size(), key.data());
+}
+
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+KVStatus BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::Remove(const int32_t keybytes, const char* key) {
+    LOG("Remove key=" << std::string_view(key, (size_t) keybytes));
+    return FAILED;                                              // tree does not support erase
+}
+
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+void BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::Free() {
+    LOG("Freeing");
+    auto root_data = pmpool.get_root();
+    transaction::exec_tx(pmpool, [&] {
+        root_data->freeing = 1;
+    });
+    FreeTree();
+    Recover();                                                  // leave an empty tree behind
+    if (mirror) mirror.reset(new typename btree_type::inner_mirror_type(cache_budget));  // drop old copy
+    LOG("Freed ok");
+}
+
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+void BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::CacheInnerNodes(const bool enabled) {
+    LOG("Caching inner nodes " << (enabled ? "enabled" : "disabled"));
+    if (!enabled) {
+        mirror.reset();
+    } else if (!mirror) {
+        mirror.reset(new typename btree_type::inner_mirror_type(cache_budget));  // built by next Get
+    }
+}
+
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+void BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::CacheBudget(const size_t bytes) {
+    LOG("Caching inner nodes within bytes=" << bytes);
+    cache_budget = bytes;
+    if (mirror) mirror.reset(new typename btree_type::inner_mirror_type(cache_budget));
 }
 
-void BTreeEngine::Free() {
-  LOG("Free the tree");
-  // TODO impl
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+KVStatus BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::ReverseScan(const string& before,
+                                                                         const size_t limit,
+                                                                         vector<string>& kv_pairs) {
+    LOG("Reverse scan before key=" << before.c_str() << ", limit=" << to_string(limit));
+    TKey bound;
+    if (!before.empty() && !ToKey(before, &bound)) return FAILED;
+    if (limit == 0) return OK;
+    size_t count = 0;
+    my_btree->reverse_scan(before.empty() ? nullptr : &bound,
+                           [&](const typename btree_type::value_type& entry) {
+        kv_pairs.push_back(FromKey(entry.first));
+        kv_pairs.emplace_back(entry.second.c_str(), entry.second.size());
+        return ++count < limit;
+    });
+    return OK;
 }
 
-PMEMoid BTreeEngine::GetRootOid() {
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+PMEMoid BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::GetRootOid() {
     return pmpool.get_root().raw();
 }
-PMEMobjpool* BTreeEngine::GetPool() {
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+PMEMobjpool* BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::GetPool() {
     return pmpool.get_handle();
 }
 
 
-void BTreeEngine::Recover() {
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+void BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::FreeTree() {
+    auto root_data = pmpool.get_root();
+    if (root_data->btree_ptr) {
+        root_data->btree_ptr->clear(FREE_BATCH);
+        root_data->btree_ptr->close();
+    }
+    transaction::exec_tx(pmpool, [&] {
+        if (root_data->btree_ptr) delete_persistent<btree_type>(root_data->btree_ptr);
+        root_data->btree_ptr = nullptr;
+        root_data->freeing = 0;
+    });
+    my_btree = nullptr;
+}
+
+// Nodes, values and free lists are laid out as LAYOUT_VERSION describes. Roots grown from pools
+// written before the layout was recorded read zero, and are refused once they hold a tree.
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+void BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::CheckLayout() {
+    auto root_data = pmpool.get_root();
+    if (root_data->layout == LAYOUT_VERSION) return;
+    if (root_data->layout != 0 || root_data->btree_ptr) {
+        throw std::invalid_argument("Pool holds btree of another persistent layout");
+    }
+    transaction::exec_tx(pmpool, [&] {
+        root_data->freeing = 0;
+        root_data->layout = LAYOUT_VERSION;
+    });
+}
+
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+void BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::CheckGeometry() {
+    auto root_data = pmpool.get_root();
+    const size_t key_size = KeySize((const TKey*) nullptr);
+    if (root_data->degree == 0) {                               // new pool, or created before geometry
+        // a tree created before geometry was recorded has the default geometry of its engine
+        const bool default_geometry = NODE_DEGREE == DEGREE && VALUE_CAPACITY == MAX_VALUE_SIZE &&
+                                      (std::is_same<TKey, uint64_t>::value || key_size == MAX_KEY_SIZE);
+        if (root_data->btree_ptr && !default_geometry) {
+            throw std::invalid_argument("Pool holds btree of default geometry, recorded before geometries");
+        }
+        transaction::exec_tx(pmpool, [&] {
+            root_data->degree = (uint32_t) NODE_DEGREE;
+            root_data->key_size = (uint32_t) key_size;
+            root_data->value_size = (uint32_t) VALUE_CAPACITY;
+        });
+    } else if (root_data->degree != NODE_DEGREE || root_data->key_size != key_size ||
+               root_data->value_size != VALUE_CAPACITY) {
+        throw std::invalid_argument("Pool holds btree with geometry " +
+                                    GeometryName(root_data->degree, root_data->key_size,
+                                                 root_data->value_size));
+    }
+}
+
+template <typename TKey, size_t NODE_DEGREE, size_t VALUE_CAPACITY>
+void BTreeEngineBase<TKey, NODE_DEGREE, VALUE_CAPACITY>::Recover() {
     auto root_data = pmpool.get_root();
+    if (root_data->freeing) {
+        LOG("Resuming interrupted free");
+        FreeTree();
+    }
 
-    if ( root_data->btree_ptr ) {
-        my_btree = root_data->btree_ptr.get();
-        my_btree->garbage_collection();
-    } 
-    else {
+    if (!root_data->btree_ptr) {
         make_persistent_atomic<btree_type>(pmpool, root_data->btree_ptr);
-        my_btree = root_data->btree_ptr.get();
     }
+    my_btree = root_data->btree_ptr.get();
+    my_btree->garbage_collection();                             // also finds free node slots
+}
+
+template class BTreeEngineBase<pstring<MAX_KEY_SIZE>>;
+template class BTreeEngineBase<uint64_t>;
+
+// ----------------------------------------------------------------------------------------------
+// Registered geometries
+// ----------------------------------------------------------------------------------------------
+
+// A cache budget of zero leaves inner nodes uncached.
+template <typename TEngine>
+static KVEngine* OpenCached(const string& path, const size_t size, const string& layout,
+                            const size_t cache) {
+    auto engine = new TEngine(path, size, layout);
+    if (cache > 0) {
+        engine->CacheBudget(cache);
+        engine->CacheInnerNodes(true);
+    }
+    return engine;
+}
+
+template <size_t D, size_t K, size_t V>
+static KVEngine* OpenGeometry(const string& path, const size_t size, const string& layout,
+                              const size_t cache) {
+    return OpenCached<BTreeEngineBase<pstring<K>, D, V>>(path, size, layout, cache);
+}
+
+struct Geometry {
+    size_t degree;
+    size_t key_size;
+    size_t value_size;
+    KVEngine* (*open)(const string& path, size_t size, const string& layout, size_t cache);
+};
+
+#define GEOMETRY(D, K, V) {D, K, V, OpenGeometry<D, K, V>}
+
+static const Geometry GEOMETRIES[] = {
+    GEOMETRY(DEGREE, MAX_KEY_SIZE, MAX_VALUE_SIZE),             // default, named "btree"
+    GEOMETRY(16, MAX_KEY_SIZE, MAX_VALUE_SIZE),
+    GEOMETRY(32, MAX_KEY_SIZE, MAX_VALUE_SIZE),
+    GEOMETRY(128, MAX_KEY_SIZE, MAX_VALUE_SIZE),
+    GEOMETRY(16, 16, 64),                                       // small values
+    GEOMETRY(32, 16, 64),
+    GEOMETRY(64, 16, 64),
+    GEOMETRY(128, 16, 64),
+    GEOMETRY(32, 32, 1024),                                     // large values
+};
+
+#undef GEOMETRY
+
+static KVEngine* Open(const string& path, const size_t size, const string& layout, const KVConfig& config) {
+    size_t degree = DEGREE, key_size = MAX_KEY_SIZE, value_size = MAX_VALUE_SIZE, cache = 0;
+    if (!ConfigOnly(config, {"degree", "key", "value", "cache"}) || !ConfigSize(config, "degree", &degree) ||
+        !ConfigSize(config, "key", &key_size) || !ConfigSize(config, "value", &value_size) ||
+        !ConfigSize(config, "cache", &cache)) return nullptr;
+    for (auto& g : GEOMETRIES) {
+        if (g.degree == degree && g.key_size == key_size && g.value_size == value_size) {
+            return g.open(path, size, layout, cache);
+        }
+    }
+    LOG("Geometry not registered, degree=" << degree << ", key=" << key_size << ", value=" << value_size);
+    return nullptr;
+}
+
+static KVEngine* OpenU64(const string& path, const size_t size, const string& layout, const KVConfig& config) {
+    size_t cache = 0;
+    if (!ConfigOnly(config, {"cache"}) || !ConfigSize(config, "cache", &cache)) return nullptr;
+    return OpenCached<BTreeU64Engine>(path, size, layout, cache);
+}
+
+static const bool registered = KVEngineRegistry::Register(ENGINE, Open);
+static const bool registered_u64 = KVEngineRegistry::Register(U64_ENGINE, OpenU64);
+
+vector<string> Geometries() {
+    vector<string> names;
+    for (auto& g : GEOMETRIES) names.push_back(GeometryName(g.degree, g.key_size, g.value_size));
+    return names;
 }
 
 } // namespace btree
@@ -43,24 +43,37 @@ namespace pmemkv {
 namespace btree {
 
 const string ENGINE = "btree";                         // engine identifier
-const size_t DEGREE = 64;
+const string U64_ENGINE = "btree_u64";                 // engine identifier for integer keys
+const size_t DEGREE = 64;                              // default geometry
 const size_t MAX_KEY_SIZE = 20;
 const size_t MAX_VALUE_SIZE = 200;
+const size_t FREE_BATCH = 128;                         // node chunks freed per transaction
+const uint64_t LAYOUT_VERSION = 0x6274726565000001ull; // "btree" magic & persistent layout 1
 
-class BTreeEngine : public KVEngine {
+// Get and Put may be called concurrently; readers take no locks and writers are serialized.
+// Keys are stored as TKey: fixed-size strings, or the 8 bytes of a uint64_t in host byte order,
+// which are compared as integers. Node degree and value capacity are fixed at compile time and
+// recorded in the pool, which may only be opened again with the same geometry.
+template <typename TKey, size_t NODE_DEGREE = DEGREE, size_t VALUE_CAPACITY = MAX_VALUE_SIZE>
+class BTreeEngineBase : public KVEngine {
   private:
-    typedef persistent::b_tree<pstring<MAX_KEY_SIZE>, pstring<MAX_VALUE_SIZE> , DEGREE> btree_type;
+    typedef persistent::b_tree<TKey, pstring<VALUE_CAPACITY> , NODE_DEGREE> btree_type;
     struct RootData {
         persistent_ptr<btree_type> btree_ptr;
+        pmem::obj::p<uint8_t> freeing;                          // set while Free is in progress
+        pmem::obj::p<uint32_t> degree;                          // geometry, zero until recorded
+        pmem::obj::p<uint32_t> key_size;
+        pmem::obj::p<uint32_t> value_size;
+        pmem::obj::p<uint64_t> layout;                          // LAYOUT_VERSION, zero in older pools
     };    
 
-    BTreeEngine(const BTreeEngine&);
-    void operator=(const BTreeEngine&);
+    BTreeEngineBase(const BTreeEngineBase&);
+    void operator=(const BTreeEngineBase&);
   public:
-    BTreeEngine(const string& path, size_t size, const string& layout);               // default constructor
-    ~BTreeEngine();                                             // default destructor
+    BTreeEngineBase(const string& path, size_t size, const string& layout);           // default constructor
+    ~BTreeEngineBase();                                         // default destructor
 
-    string Engine() final { return ENGINE; }                    // engine identifier
+    string Engine() final;                                      // engine identifier
     KVStatus Get(int32_t limit,                                 // copy value to fixed-size buffer
                  int32_t keybytes,
                  int32_t* valuebytes,
@@ -70,9 +83,20 @@ class BTreeEngine : public KVEngine {
                  string* value) final;
     KVStatus Put(const string& key,                             // copy value from std::string
                  const string& value) final;
+    KVStatus Put(int32_t keybytes,                              // copy value from buffer
+                 int32_t valuebytes,
+                 const char* key,
+                 const char* value) final;
     KVStatus Remove(const string& key) final;                   // remove value for key
+    KVStatus Remove(int32_t keybytes,                           // remove value for key in buffer
+                    const char* key) final;
 
     void Free() final;
+    void CacheInnerNodes(bool enabled) final;
+    void CacheBudget(size_t bytes);                             // DRAM for cached inner nodes
+    KVStatus ReverseScan(const string& before,                  // list pairs in descending order
+                         size_t limit,
+                         vector<string>& kv_pairs) final;
 
     PMEMoid GetRootOid() final;
     PMEMobjpool* GetPool() final;
@@ -82,11 +106,24 @@ class BTreeEngine : public KVEngine {
     size_t TotalNumKeys() final {return 0;}
 
   private:
+    void CheckLayout();                                         // record or verify layout
+    void CheckGeometry();                                       // record or verify geometry
     void Recover();
+    void FreeTree();                                            // free nodes & tree in batches
 
     pool<RootData> pmpool;                                      // pool for persistent root
-    btree_type* my_btree;
+    btree_type* my_btree = nullptr;
+    std::unique_ptr<typename btree_type::inner_mirror_type> mirror;  // DRAM copy of inner nodes
+    size_t cache_budget = SIZE_MAX;                             // bytes the copy may take
 };
 
+typedef BTreeEngineBase<pstring<MAX_KEY_SIZE>> BTreeEngine;
+typedef BTreeEngineBase<uint64_t> BTreeU64Engine;
+
+// Engine names are "btree", "btree_u64", or "btree:degree=D,key=K,value=V" where omitted
+// parameters take their default. Only geometries compiled into the library can be opened.
+// Both engines also take "cache=B", caching inner nodes in up to B bytes of DRAM.
+vector<string> Geometries();                                    // names of registered geometries
+
 } // namespace btree
 } // namespace pmemkv
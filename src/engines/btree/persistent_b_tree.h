@@ -39,8 +39,17 @@
 #include <memory>
 #include <utility>
 #include <functional>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <cassert>
+#include <cstdint>
 
 #include <libpmemobj++/persistent_ptr.hpp>
 #include <libpmemobj++/make_persistent.hpp>
@@ -48,6 +57,7 @@
 #include <libpmemobj++/make_persistent_atomic.hpp>
 #include <libpmemobj++/transaction.hpp>
 #include <libpmemobj++/pool.hpp>
+#include <libpmemobj++/detail/common.hpp>
 
 
 namespace persistent {
@@ -55,6 +65,237 @@ namespace persistent {
 namespace internal {
 	using namespace pmem::obj;
 
+    /**
+    * Order-preserving 8-byte head of a key: key_head(a) < key_head(b) implies a < b, and
+    * a < b implies key_head(a) <= key_head(b). Key types that have no cheap head use this
+    * fallback, so leaf search falls back to comparing full keys.
+    */
+    template <typename TKey>
+    inline uint64_t key_head( const TKey& ) {
+        return 0;
+    }
+
+    inline uint64_t key_head( const uint64_t& key ) {
+        return key;
+    }
+
+    /**
+    * Head of a key in a tree ordered by 'TCompare'. Heads follow the natural order of keys,
+    * so trees ordered by another comparator compare full keys only.
+    */
+    template <typename TCompare, typename TKey>
+    inline uint64_t key_head_of( const TKey& key ) {
+        return std::is_same<TCompare, std::less<TKey>>::value ? key_head( key ) : 0;
+    }
+
+    /**
+    * Prefetch the cache lines spanned by 'bytes' from 'start', so they are read in parallel
+    * rather than one miss at a time.
+    */
+    inline void prefetch_range( const void* start, size_t bytes ) {
+        uintptr_t line = reinterpret_cast<uintptr_t>( start ) & ~(uintptr_t) 63;
+        const uintptr_t end = reinterpret_cast<uintptr_t>( start ) + bytes;
+        for (; line < end; line += 64) {
+            __builtin_prefetch( reinterpret_cast<const void*>( line ) );
+        }
+    }
+
+    /**
+    * Version latch of a node. Persistent nodes cannot hold live synchronization state, so
+    * latches are kept in a volatile side table. A writer holds the latch while it changes
+    * the node, which leaves the version odd. Readers never block writers: they remember
+    * the version before reading a node and read again if it has moved since.
+    */
+    class node_latch_t {
+        std::atomic<uint64_t> version;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    public:
+        node_latch_t() : version( 0 ) {}
+
+        uint64_t read_begin() const {
+            uint64_t v = version.load( std::memory_order_acquire );
+            while (v & 1) {
+                v = version.load( std::memory_order_acquire );
+            }
+            return v;
+        }
+
+        bool read_validate( uint64_t v ) const {
+            std::atomic_thread_fence( std::memory_order_acquire );
+            return version.load( std::memory_order_relaxed ) == v;
+        }
+
+        void lock() {
+            uint64_t v = version.load( std::memory_order_relaxed );
+            while ((v & 1) || !version.compare_exchange_weak( v, v + 1, std::memory_order_acquire )) {
+                v = version.load( std::memory_order_relaxed );
+            }
+            std::atomic_thread_fence( std::memory_order_release );
+        }
+
+        void unlock() {
+            version.fetch_add( 1, std::memory_order_release );
+        }
+    };
+
+    /**
+    * Latch of the node at 'node'. Nodes share latches by address hash, which only costs
+    * readers a retry when a writer changes another node with the same latch.
+    */
+    inline node_latch_t& latch_of( const void* node ) {
+        static node_latch_t latches[4096];
+        uint64_t h = (reinterpret_cast<uintptr_t>( node ) >> 6) * 0x9E3779B97F4A7C15ull;
+        return latches[h >> 52];
+    }
+
+    /**
+    * Volatile allocation state of a tree: the pool handle and the free node slots of its
+    * chunks. Which slots are in use is not persisted, it is rebuilt from the tree at open.
+    * Freed slots are reused before a new chunk is taken, so chunks only grow with the peak
+    * number of nodes, and chunks left without any node are released at the next open.
+    */
+    struct node_slots_t {
+        PMEMobjpool* pop = nullptr;
+        std::vector<PMEMoid> leaves;
+        std::vector<PMEMoid> inners;
+    };
+
+    struct node_slots_registry_t {
+        std::mutex mutex;
+        std::unordered_map<const void*, node_slots_t> slots;
+    };
+
+    inline node_slots_registry_t& node_slots_registry() {
+        static node_slots_registry_t registry;
+        return registry;
+    }
+
+    inline node_slots_t& node_slots_of( const void* tree ) {
+        node_slots_registry_t& registry = node_slots_registry();
+        std::lock_guard<std::mutex> lock( registry.mutex );
+        return registry.slots[tree];
+    }
+
+    inline void release_node_slots( const void* tree ) {
+        node_slots_registry_t& registry = node_slots_registry();
+        std::lock_guard<std::mutex> lock( registry.mutex );
+        registry.slots.erase( tree );
+    }
+
+    /**
+    * Volatile state of a tree, chosen by the tree address: the mutex serializing writers,
+    * the structure version, bumped whenever inner nodes or the root are replaced, and the
+    * node slots of the last tree that wrote through this state.
+    */
+    struct tree_state_t {
+        std::mutex writer;
+        std::atomic<uint64_t> structure;
+        const void* owner;
+        node_slots_t* slots;
+
+        tree_state_t() : structure( 0 ), owner( nullptr ), slots( nullptr ) {}
+    };
+
+    inline tree_state_t& tree_state_of( const void* tree ) {
+        static tree_state_t states[64];
+        uint64_t h = (reinterpret_cast<uintptr_t>( tree ) >> 6) * 0x9E3779B97F4A7C15ull;
+        return states[h >> 58];
+    }
+
+    /**
+    * Registry of active readers, used by writers to wait until no reader can still reach
+    * a node before the node is freed. Readers count themselves in the current phase, and
+    * synchronize() flips the phase and waits for readers of the previous one to leave.
+    */
+    class reader_registry_t {
+        static const size_t SLOTS = 64;
+        struct alignas(64) slot_t {
+            std::atomic<uint64_t> count[2];
+        };
+
+        slot_t slots[SLOTS];
+        std::atomic<uint32_t> phase;
+        std::mutex sync_mutex;
+
+        static slot_t& slot( slot_t* slots ) {
+            static std::atomic<size_t> next( 0 );
+            thread_local size_t index = next++ % SLOTS;
+            return slots[index];
+        }
+    public:
+        reader_registry_t() : phase( 0 ) {
+            for (auto& s : slots) {
+                s.count[0] = 0;
+                s.count[1] = 0;
+            }
+        }
+
+        uint32_t enter() {
+            slot_t& s = slot( slots );
+            for (;;) {
+                uint32_t p = phase.load();
+                s.count[p].fetch_add( 1 );
+                if (phase.load() == p) {
+                    return p;
+                }
+                s.count[p].fetch_sub( 1 );
+            }
+        }
+
+        void leave( uint32_t p ) {
+            slot( slots ).count[p].fetch_sub( 1, std::memory_order_release );
+        }
+
+        void synchronize() {
+            std::lock_guard<std::mutex> lock( sync_mutex );
+            uint32_t p = phase.load();
+            phase.store( 1 - p );
+            for (auto& s : slots) {
+                while (s.count[p].load() != 0) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    };
+
+    inline reader_registry_t& readers() {
+        static reader_registry_t registry;
+        return registry;
+    }
+
+    class read_guard_t {
+        uint32_t phase;
+    public:
+        read_guard_t() : phase( readers().enter() ) {}
+
+        ~read_guard_t() {
+            readers().leave( phase );
+        }
+
+        read_guard_t( const read_guard_t& ) = delete;
+        read_guard_t& operator=( const read_guard_t& ) = delete;
+    };
+
+    /**
+    * Chunk of node slots, allocated at once and linked into a persistent list of the tree.
+    * Nodes are constructed in free slots, so splits do not go to the pool allocator.
+    */
+    template <typename TNode, size_t slots_count>
+    struct node_chunk_t {
+        static const size_t count = slots_count;
+
+        persistent_ptr<node_chunk_t> next;
+        typename std::aligned_storage<sizeof( TNode ), alignof( TNode )>::type slots[slots_count];
+
+        node_chunk_t( const persistent_ptr<node_chunk_t>& _next ) : next( _next ) {}
+
+        static PMEMoid slot_oid( const persistent_ptr<node_chunk_t>& chunk, size_t i ) {
+            PMEMoid oid = chunk.raw();
+            oid.off += reinterpret_cast<const char*>( &chunk->slots[i] ) - reinterpret_cast<const char*>( chunk.get() );
+            return oid;
+        }
+    };
+
     class node_t {
         uint64_t _level;
     public:
@@ -170,20 +411,21 @@ namespace internal {
         size_t position;
     };
 
-    template <typename TKey, typename TValue, uint64_t number_entrys_slots>
+    template <typename TKey, typename TValue, uint64_t number_entrys_slots, typename TCompare>
     class leaf_node_t : public node_t {
         /**
-        * Array of indexes.
+        * Array of indexes, with the heads of the indexed keys kept in the same order so
+        * that search only touches entries whose head is equal to the head of the key.
+        * The number of valid indexes is kept in the state word of the node.
         */
         struct leaf_entries_t {
-            leaf_entries_t() : _size(0) {}
-
             uint64_t idxs[number_entrys_slots];
-            size_t _size;
+            uint64_t heads[number_entrys_slots];
         };
     public:
         typedef TKey                key_type;
         typedef TValue              mapped_type;
+        typedef TCompare            key_compare;
         typedef std::pair<key_type, mapped_type>  value_type;
         typedef value_type&         reference;
         typedef const value_type&   const_reference;
@@ -193,28 +435,33 @@ namespace internal {
         typedef leaf_node_iterator<leaf_node_t, value_type> iterator;
         typedef leaf_node_iterator<const leaf_node_t, const value_type> const_iterator;
 
-        leaf_node_t() : node_t(), consistent_id( 0 ) {
-			assert(std::is_sorted(begin(), end(), [](const_reference a, const_reference b) { return a.first < b.first; }));
+        static bool entry_less( const_reference a, const_reference b ) {
+            return key_compare()( a.first, b.first );
+        }
+
+        leaf_node_t() : node_t(), state( 0 ) {
+			assert(std::is_sorted(begin(), end(), entry_less));
 		}
 
-        leaf_node_t( const_reference entry ) : node_t(), consistent_id( 0 ) {
+        leaf_node_t( const_reference entry ) : node_t(), state( 0 ) {
             entries[0] = entry;
             consistent()->idxs[0] = 0;
-            consistent()->_size = 1;
-            assert( std::is_sorted( begin(), end(), []( const_reference a, const_reference b ) { return a.first < b.first; } ) );
+            consistent()->heads[0] = key_head_of<TCompare>( entry.first );
+            state = 1 << 1;
+            assert( std::is_sorted( begin(), end(), entry_less ) );
         }
 
-        leaf_node_t( const_iterator first, const_iterator last, const persistent_ptr<leaf_node_t>& _prev, const persistent_ptr<leaf_node_t>& _next ) : node_t(), consistent_id( 0 ), prev(_prev), next(_next) {
+        leaf_node_t( const_iterator first, const_iterator last, const persistent_ptr<leaf_node_t>& _prev, const persistent_ptr<leaf_node_t>& _next ) : node_t(), state( 0 ), prev(_prev), next(_next) {
             copy(first, last);
             assert( size() == std::distance(first, last ) );
-			assert(std::is_sorted(begin(), end(), [](const_reference a, const_reference b) { return a.first < b.first; }));
+			assert(std::is_sorted(begin(), end(), entry_less));
         }
 
-        leaf_node_t( const_reference entry, const_iterator first, const_iterator last, const persistent_ptr<leaf_node_t>& _prev, const persistent_ptr<leaf_node_t>& _next ) : node_t(), consistent_id( 0 ), prev( _prev ), next( _next ) {
+        leaf_node_t( const_reference entry, const_iterator first, const_iterator last, const persistent_ptr<leaf_node_t>& _prev, const persistent_ptr<leaf_node_t>& _next ) : node_t(), state( 0 ), prev( _prev ), next( _next ) {
             copy_insert( entry, first, last );
             assert( size() == std::distance( first, last ) + 1 );
-            assert( std::binary_search( begin(), end(), entry, []( const_reference a, const_reference b ) { return a.first < b.first; }) );
-			assert(std::is_sorted(begin(), end(), [](const_reference a, const_reference b) { return a.first < b.first; }));
+            assert( std::binary_search( begin(), end(), entry, entry_less) );
+			assert(std::is_sorted(begin(), end(), entry_less));
         }
 
         std::pair<iterator, bool> insert( pool_base& pop, const_reference entry ) {
@@ -222,27 +469,46 @@ namespace internal {
         }
 
         iterator find( const key_type& key ) {
-			assert(std::is_sorted(begin(), end(), [](const_reference a, const_reference b) { return a.first < b.first; }));
-            iterator it = std::lower_bound( begin(), end(), key, [] ( const_reference entry, const TKey& key ) {
-                return entry.first < key;
-            } );
-            if ( it == end() || it->first == key )
+			assert(std::is_sorted(begin(), end(), entry_less));
+            iterator it = begin() + lower_bound_pos( key );
+            if ( it == end() || !key_compare()( key, it->first ) )
                 return it;
             else
                 return end();
         }
 
         const_iterator find( const key_type& key ) const {
-			assert(std::is_sorted(begin(), end(), [](const_reference a, const_reference b) { return a.first < b.first; }));
-            const_iterator it = std::lower_bound( begin(), end(), key, [] ( const_reference entry, const TKey& key ) {
-                return entry.first < key;
-            } );
-            if ( it == end() || it->first == key )
+			assert(std::is_sorted(begin(), end(), entry_less));
+            const_iterator it = begin() + lower_bound_pos( key );
+            if ( it == end() || !key_compare()( key, it->first ) )
                 return it;
             else
                 return end();
         }
 
+        /**
+        * Return iterator on the first entry with key not less than 'key'.
+        */
+        iterator lower_bound( const key_type& key ) {
+            return begin() + lower_bound_pos( key );
+        }
+
+        const_iterator lower_bound( const key_type& key ) const {
+            return begin() + lower_bound_pos( key );
+        }
+
+        /**
+        * Return the entry with 'key' or nullptr. Used by readers that validate the version
+        * of the node afterwards, so nothing is asserted about the entries.
+        */
+        const_pointer find_entry( const key_type& key ) const {
+            size_t pos = lower_bound_pos( key );
+            if (pos < size() && !key_compare()( key, (*this)[pos].first ))
+                return &(*this)[pos];
+            else
+                return nullptr;
+        }
+
         /**
         * Return begin iterator on an array of correct indexs.
         */
@@ -261,21 +527,49 @@ namespace internal {
         * Return end iterator on an array of indexs.
         */
         iterator end() {
-            return iterator( this, consistent()->_size );
+            return iterator( this, size() );
         }
 
         /**
         * Return const_iterator to the end.
         */
         const_iterator end() const {
-            return const_iterator( this, consistent()->_size );
+            return const_iterator( this, size() );
+        }
+
+        /**
+        * Return iterator on the last entry, the node must not be empty.
+        */
+        iterator last() {
+            assert( size() > 0 );
+            return iterator( this, size() - 1 );
+        }
+
+        const_iterator last() const {
+            assert( size() > 0 );
+            return const_iterator( this, size() - 1 );
         }
 
         /**
         * Return the size of the array of entries (key/value).
         */
         size_t size() const {
-            return consistent()->_size;
+            return state >> 1;
+        }
+
+        /**
+        * Prefetch what a search of this node reads: its level, the state word at the end of
+        * the node, and the heads & indexes of the consistent copy the state selects. Only
+        * the state is read here, and it may be torn by a writer, as prefetches cannot fault.
+        */
+        void prefetch() const {
+            prefetch_range( this, sizeof( node_t ) );
+            prefetch_range( &state, sizeof( state ) );
+            const uint64_t s = state;
+            const leaf_entries_t* c = v + (s & 1);
+            const size_t n = std::min( (size_t) (s >> 1), (size_t) number_entrys_slots );
+            prefetch_range( c->heads, n * sizeof( c->heads[0] ) );
+            prefetch_range( c->idxs, n * sizeof( c->idxs[0] ) );
         }
 
         bool full() const {
@@ -283,7 +577,7 @@ namespace internal {
         }
 
         const_reference back() const {
-            return entries[consistent()->idxs[consistent()->_size - 1]];
+            return entries[consistent()->idxs[size() - 1]];
         }
 
         reference at( size_t pos ) {
@@ -327,30 +621,53 @@ namespace internal {
     private:
         value_type entries[number_entrys_slots];
         leaf_entries_t v[2];
-        uint32_t consistent_id;
+        uint64_t state;                 // size << 1 | id of the consistent copy, published at once
         persistent_ptr<leaf_node_t> prev;
         persistent_ptr<leaf_node_t> next;
         
 
         leaf_entries_t* consistent() {
-            assert( consistent_id < 2 );
-            return v + consistent_id;
+            return v + (state & 1);
         }
 
         const leaf_entries_t* consistent() const {
-            assert( consistent_id < 2 );
-            return v + consistent_id;
+            return v + (state & 1);
         }
 
         leaf_entries_t* working_copy() {
-            assert( consistent_id < 2 );
-            uint32_t working_id = 1 - consistent_id;
-            return v + working_id;
+            return v + (1 - (state & 1));
         }
 
-        void switch_consistent( pool_base &pop ) {
-            consistent_id = 1 - consistent_id;
-            pop.persist( &consistent_id, sizeof( consistent_id ) );
+        /**
+        * Make the working copy consistent with 'size' entries, in a single 8-byte store.
+        */
+        void publish( pool_base &pop, size_t size ) {
+            state = (size << 1) | (1 - (state & 1));
+            pop.persist( &state, sizeof( state ) );
+        }
+
+        /**
+        * Position of the first entry not less than 'key'. The heads are ranked with a
+        * branch-free scan the compiler can vectorize; full keys are compared only within
+        * the run of entries whose head is equal to the head of 'key'.
+        */
+        size_t lower_bound_pos( const key_type& key ) const {
+            const leaf_entries_t* c = consistent();
+            const uint64_t head = key_head_of<TCompare>( key );
+            const size_t size = this->size();
+            size_t less = 0;
+            size_t not_greater = 0;
+            for (size_t i = 0; i < size; ++i) {
+                less += c->heads[i] < head;
+                not_greater += c->heads[i] <= head;
+            }
+            if (less == not_greater) {
+                return less;
+            }
+            const_iterator it = std::lower_bound( const_iterator( this, less ), const_iterator( this, not_greater ), key, [] ( const_reference entry, const TKey& key ) {
+                return key_compare()( entry.first, key );
+            } );
+            return std::distance( this->begin(), it );
         }
 
         /**
@@ -358,48 +675,56 @@ namespace internal {
         */
         std::pair<iterator, bool> insert( pool_base& pop, const_reference entry, iterator begin, iterator end ) {
             assert( !full() );
+            assert( begin == this->begin() && end == this->end() );
 
-            iterator result = std::lower_bound( begin, end, entry.first, [&] ( const_reference entry, const key_type& key ) {
-                return entry.first < key;
-            } );
+            iterator result = begin + lower_bound_pos( entry.first );
 
-            if (result != end && result->first == entry.first) {
+            if (result != end && !key_compare()( entry.first, result->first )) {
                 return std::pair<iterator, bool>( result, false );
             }
-            
+
+            std::lock_guard<node_latch_t> guard( latch_of( this ) );
             size_t size = this->size();
             // insert an entry to the end
             entries[size] = entry;
             pop.flush( &(entries[size]), sizeof( entries[size] ) );
             // update tmp idxs
             size_t position = insert_idx( pop, size, result );
-            // update consistent
-            switch_consistent( pop );
+            // a single fence orders the entry and idxs before the state that publishes them
+            pop.drain();
+            publish( pop, size + 1 );
 
-			assert(std::is_sorted(this->begin(), this->end(), [](const_reference a, const_reference b) { return a.first < b.first; }));
+			assert(std::is_sorted(this->begin(), this->end(), entry_less));
 
             return std::pair<iterator, bool>( iterator( this, position ), true );
         }
 
+        /**
+        * Write idxs and heads of the working copy with the new entry at the position of
+        * 'hint', and flush them without draining. The working copy is only one insert
+        * behind, so its leading slots that already hold the right values are neither
+        * written nor flushed; all bytes of a node are durable outside of an insert.
+        */
         size_t insert_idx( pool_base& pop, uint64_t new_entry_idx, iterator hint ) {
             size_t size = this->size();
             leaf_entries_t* tmp = working_copy();
-            auto in_begin = consistent()->idxs;
-            auto in_end = in_begin + size;
-            auto partition_point = in_begin + std::distance( this->begin(), hint );
-            auto out_begin = tmp->idxs;
-            auto insert_pos = std::copy( in_begin, partition_point, out_begin );
-            *insert_pos = new_entry_idx;
-            std::copy( partition_point, in_end, insert_pos + 1 );
-            tmp->_size = size + 1;
-#if 0
-            pop.flush( tmp->idxs, sizeof(tmp->idxs[0])*tmp->_size );
-            pop.persist( &(tmp->_size), sizeof(tmp->_size) );
-#else
-            pop.persist( tmp, sizeof(leaf_entries_t) );
-#endif
-
-            return std::distance( out_begin, insert_pos );
+            const leaf_entries_t* c = consistent();
+            size_t position = std::distance( this->begin(), hint );
+            size_t first = 0;
+            while (first < position && tmp->idxs[first] == c->idxs[first] && tmp->heads[first] == c->heads[first]) {
+                ++first;
+            }
+            std::copy( c->idxs + first, c->idxs + position, tmp->idxs + first );
+            tmp->idxs[position] = new_entry_idx;
+            std::copy( c->idxs + position, c->idxs + size, tmp->idxs + position + 1 );
+            std::copy( c->heads + first, c->heads + position, tmp->heads + first );
+            tmp->heads[position] = key_head_of<TCompare>( entries[new_entry_idx].first );
+            std::copy( c->heads + position, c->heads + size, tmp->heads + position + 1 );
+
+            pop.flush( tmp->idxs + first, sizeof(tmp->idxs[0]) * (size + 1 - first) );
+            pop.flush( tmp->heads + first, sizeof(tmp->heads[0]) * (size + 1 - first) );
+
+            return position;
         }
 
         /**
@@ -408,9 +733,10 @@ namespace internal {
         void copy_insert( const_reference entry, const_iterator first, const_iterator last ) {
             assert( std::distance( first, last ) < number_entrys_slots );
 
-            auto d_last = std::merge( first, last, &entry, &entry + 1, entries, []( const_reference a, const_reference b ) { return a.first < b.first; } );
-            consistent()->_size = std::distance( entries, d_last );
-            std::iota( consistent()->idxs, consistent()->idxs + consistent()->_size, 0 );
+            auto d_last = std::merge( first, last, &entry, &entry + 1, entries, entry_less );
+            state = std::distance( entries, d_last ) << 1;
+            std::iota( consistent()->idxs, consistent()->idxs + size(), 0 );
+            fill_heads();
         }
 
         /**
@@ -420,15 +746,26 @@ namespace internal {
             assert( std::distance( first, last ) <= number_entrys_slots );
 
             auto d_last = std::copy(first, last, entries);
-            consistent()->_size = std::distance( entries, d_last );
-            std::iota( consistent()->idxs, consistent()->idxs + consistent()->_size, 0 );
+            state = std::distance( entries, d_last ) << 1;
+            std::iota( consistent()->idxs, consistent()->idxs + size(), 0 );
+            fill_heads();
+        }
+
+        /**
+        * Compute heads of the consistent entries, which are stored in key order.
+        */
+        void fill_heads() {
+            for (size_t i = 0; i < size(); ++i) {
+                consistent()->heads[i] = key_head_of<TCompare>( entries[i].first );
+            }
         }
     }; // class leaf_node_t
 
-    template <typename TKey, uint64_t number_entrys_slots>
+    template <typename TKey, uint64_t number_entrys_slots, typename TCompare>
     class inner_node_t : public node_t {
     public:
         typedef TKey key_type;
+        typedef TCompare key_compare;
         typedef key_type& reference;
         typedef const key_type& const_reference;
         // TODO: implemenmt STL-like iterator
@@ -492,7 +829,8 @@ namespace internal {
          */
         void update_splitted_child( pool_base& pop, const_reference entry, persistent_ptr<node_t>& lnode, persistent_ptr<node_t>& rnode, const persistent_ptr<node_t>& splitted_node ) {
             assert( !full() );
-            iterator partition_point = std::lower_bound( this->begin(), this->end(), entry );
+            std::lock_guard<node_latch_t> guard( latch_of( this ) );
+            iterator partition_point = std::lower_bound( this->begin(), this->end(), entry, key_compare() );
 
             // Insert new key
             auto in_entries_begin = consistent()->entries;
@@ -523,16 +861,52 @@ namespace internal {
             pop.persist( &(working_copy()->_children_size), sizeof( working_copy()->_children_size ) );
 
             switch_consistent( pop );
-            assert( std::is_sorted( this->begin(), this->end() ) );
+            assert( std::is_sorted( this->begin(), this->end(), key_compare() ) );
+        }
+
+        /**
+        * Prefetch what a search of this node reads: its level, the id of the consistent copy
+        * at the end of the node, and the keys of that copy.
+        */
+        void prefetch() const {
+            prefetch_range( this, sizeof( node_t ) );
+            prefetch_range( &consistent_id, sizeof( consistent_id ) );
+            const inner_entries_t* c = v + (consistent_id & 1);
+            prefetch_range( c->entries, sizeof( c->entries ) );
+            prefetch_range( &c->_size, sizeof( c->_size ) );
         }
 
         const persistent_ptr<node_t>& get_child( const_reference key ) const {
             assert( this->size() + 1 == this->csize() );
-            auto it = std::lower_bound( this->begin(), this->end(), key );
+            auto it = std::lower_bound( this->begin(), this->end(), key, key_compare() );
             size_t child_pos = std::distance( this->begin(), it );
             return this->consistent()->children[child_pos];;
         }
 
+        /**
+        * Return the child to descend to for 'key'. Used by readers that validate the version
+        * of the node afterwards, so entries are read through a single copy and nothing is
+        * asserted about them.
+        */
+        const node_t* find_child( const_reference key ) const {
+            const inner_entries_t* c = this->consistent();
+            auto it = std::lower_bound( c->entries, c->entries + c->_size, key, key_compare() );
+            return c->children[std::distance( c->entries, it )].get();
+        }
+
+        /**
+        * Copy keys and children through a single copy, for readers that validate the version
+        * of the node afterwards.
+        */
+        void copy_to( std::vector<key_type>& keys, std::vector<const node_t*>& children ) const {
+            const inner_entries_t* c = this->consistent();
+            keys.assign( c->entries, c->entries + c->_size );
+            children.resize( c->_size + 1 );
+            for (size_t i = 0; i < children.size(); ++i) {
+                children[i] = c->children[i].get();
+            }
+        }
+
         bool full() const {
             assert( this->size() + 1 == this->csize() );
             return this->size() == number_entrys_slots;
@@ -611,6 +985,7 @@ namespace internal {
                 if ( tmp ) {
                     current_node = tmp;
                     leaf_it = current_node->begin();
+                    if (current_node->get_next() != nullptr) current_node->get_next()->prefetch();
                 }
             }
             return *this;
@@ -628,6 +1003,7 @@ namespace internal {
                 if ( tmp ) {
                     current_node = tmp;
                     leaf_it = current_node->last();
+                    if (current_node->get_prev() != nullptr) current_node->get_prev()->prefetch();
                 }
             }
             else {
@@ -654,23 +1030,185 @@ namespace internal {
             return &**this;
         }
 
+        leaf_node_ptr get_node() const {
+            return current_node;
+        }
+
 	private:
 		leaf_node_ptr current_node;
 		leaf_iterator leaf_it;
     }; // class b_tree_iterator
 
-    template<typename TKey, typename TValue, size_t degree>
+    /**
+    * Volatile copy of the inner levels of a tree, so that find() descends to a leaf without
+    * reading persistent inner nodes. A snapshot is valid while the structure version of
+    * the tree is the one it was built at; the first find() that sees a stale snapshot
+    * rebuilds it, and other readers meanwhile descend through the persistent nodes.
+    * A budget bounds the DRAM used, counted as the size of the persistent inner nodes copied;
+    * when the inner levels outgrow it, no snapshot is built until the structure changes again.
+    * Rebuilds are rate-limited, so that while splits keep bumping the structure, the thread
+    * rebuilding spends at most a tenth of its time copying nodes and waiting for readers.
+    */
+    template <typename TKey, typename TInnerNode>
+    class inner_mirror_t {
+        typedef typename TInnerNode::key_compare key_compare;
+
+        struct mirror_node_t {
+            std::vector<uint64_t> heads;
+            std::vector<TKey> keys;
+            std::vector<const node_t*> children;
+            std::vector<size_t> mirrored;               // indexes of inner children
+        };
+
+        struct snapshot_t {
+            uint64_t structure;
+            const node_t* root;
+            std::vector<mirror_node_t> nodes;
+        };
+
+        std::atomic<snapshot_t*> current;
+        std::atomic<uint64_t> skipped;                  // structure found to exceed the budget
+        std::atomic<int64_t> next_build;                // steady clock nanos of next rebuild
+        std::mutex build_mutex;
+        const size_t max_nodes;
+
+        constexpr static int64_t BUILD_MIN_INTERVAL = 1000000;  // nanos between rebuilds, at least
+        constexpr static int64_t BUILD_COST_RATIO = 10;         // interval over rebuild time, at least
+
+        static int64_t now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch() ).count();
+        }
+
+        bool fill( snapshot_t* snap, size_t index, const node_t* node ) const {
+            uint64_t version = latch_of( node ).read_begin();
+            mirror_node_t copy;
+            static_cast<const TInnerNode*>( node )->copy_to( copy.keys, copy.children );
+            if (!latch_of( node ).read_validate( version )) return false;
+
+            copy.heads.resize( copy.keys.size() );
+            for (size_t i = 0; i < copy.keys.size(); ++i) {
+                copy.heads[i] = key_head_of<key_compare>( copy.keys[i] );
+            }
+            bool leaves = node->level() == 1;
+            snap->nodes[index] = std::move( copy );
+            if (leaves) return true;
+
+            for (size_t i = 0; i < snap->nodes[index].children.size(); ++i) {
+                if (snap->nodes.size() >= max_nodes) return false;
+                size_t child = snap->nodes.size();
+                snap->nodes.emplace_back();
+                snap->nodes[index].mirrored.push_back( child );
+                if (!fill( snap, child, snap->nodes[index].children[i] )) return false;
+            }
+            return true;
+        }
+
+    public:
+        explicit inner_mirror_t( size_t budget = SIZE_MAX )
+            : current( nullptr ), skipped( UINT64_MAX ), next_build( 0 ),
+              max_nodes( budget / sizeof( TInnerNode ) ) {}
+
+        ~inner_mirror_t() {
+            delete current.load();
+        }
+
+        inner_mirror_t( const inner_mirror_t& ) = delete;
+        inner_mirror_t& operator=( const inner_mirror_t& ) = delete;
+
+        /**
+        * Rebuild the snapshot from 'root' unless it is valid for 'structure', another
+        * thread is rebuilding it, or the last rebuild was too recent. Must be called outside
+        * of a read_guard_t.
+        */
+        void refresh( const std::atomic<uint64_t>& structure, const persistent_ptr<node_t>& root ) {
+            snapshot_t* snap = current.load( std::memory_order_acquire );
+            const uint64_t wanted = structure.load( std::memory_order_acquire );
+            if (snap != nullptr && snap->structure == wanted) return;
+            if (skipped.load( std::memory_order_relaxed ) == wanted) return;
+            const int64_t start = now();
+            if (start < next_build.load( std::memory_order_relaxed )) return;
+
+            std::unique_lock<std::mutex> lock( build_mutex, std::try_to_lock );
+            if (!lock.owns_lock()) return;
+            struct schedule_t {                         // schedule next rebuild on every exit
+                std::atomic<int64_t>& next;
+                int64_t start;
+                ~schedule_t() {
+                    next.store( start + std::max( BUILD_MIN_INTERVAL, (now() - start) * BUILD_COST_RATIO ),
+                                std::memory_order_relaxed );
+                }
+            } schedule{ next_build, start };
+
+            snapshot_t* built = new snapshot_t;
+            {
+                read_guard_t guard;
+                built->structure = structure.load( std::memory_order_acquire );
+                built->root = root.get();
+                bool valid = built->root != nullptr;
+                if (valid && !built->root->leaf()) {
+                    valid = max_nodes > 0;
+                    if (valid) {
+                        built->nodes.emplace_back();
+                        valid = fill( built, 0, built->root );
+                    }
+                    if (!valid && built->nodes.size() >= max_nodes) {
+                        skipped.store( built->structure, std::memory_order_relaxed );
+                    }
+                }
+                if (!valid || built->structure != structure.load( std::memory_order_acquire )) {
+                    delete built;
+                    return;
+                }
+            }
+            snapshot_t* old = current.exchange( built, std::memory_order_acq_rel );
+            readers().synchronize();
+            delete old;
+        }
+
+        /**
+        * Return the leaf for 'key' if the snapshot is valid for 'structure', or nullptr.
+        * Must be called within a read_guard_t, and the structure version checked again once
+        * the version of the leaf was read.
+        */
+        const node_t* find_leaf( const TKey& key, uint64_t structure ) const {
+            const snapshot_t* snap = current.load( std::memory_order_acquire );
+            if (snap == nullptr || snap->structure != structure) return nullptr;
+            if (snap->root->leaf()) return snap->root;
+
+            const uint64_t head = key_head_of<key_compare>( key );
+            const mirror_node_t* node = &snap->nodes[0];
+            for (;;) {
+                size_t less = 0;
+                size_t not_greater = 0;
+                for (size_t i = 0; i < node->heads.size(); ++i) {
+                    less += node->heads[i] < head;
+                    not_greater += node->heads[i] <= head;
+                }
+                size_t pos = std::distance( node->keys.data(), std::lower_bound( node->keys.data() + less, node->keys.data() + not_greater, key, key_compare() ) );
+                if (node->mirrored.empty()) return node->children[pos];
+                node = &snap->nodes[node->mirrored[pos]];
+            }
+        }
+    };
+
+    template<typename TKey, typename TValue, size_t degree, typename TCompare>
     class b_tree_base {
         const static size_t number_entrys_slots = degree - 1;
         const static size_t number_children_slots = degree;
-        typedef leaf_node_t<TKey, TValue, number_entrys_slots> leaf_node_type;
-        typedef inner_node_t<TKey, number_entrys_slots> inner_node_type;
+        typedef leaf_node_t<TKey, TValue, number_entrys_slots, TCompare> leaf_node_type;
+        typedef inner_node_t<TKey, number_entrys_slots, TCompare> inner_node_type;
         typedef persistent_ptr<node_t> node_persistent_ptr;
         typedef persistent_ptr<leaf_node_type> leaf_node_persistent_ptr;
         typedef persistent_ptr<inner_node_type> inner_node_persistent_ptr;
+        const static size_t node_chunk_slots = 8;
+        const static size_t reverse_scan_batch = 64;
+        typedef node_chunk_t<leaf_node_type, node_chunk_slots> leaf_chunk_type;
+        typedef node_chunk_t<inner_node_type, node_chunk_slots> inner_chunk_type;
 
     public:
-        typedef b_tree_base<TKey, TValue, degree> self_type;
+        typedef b_tree_base<TKey, TValue, degree, TCompare> self_type;
+        typedef inner_mirror_t<TKey, inner_node_type> inner_mirror_type;
         typedef typename leaf_node_type::value_type value_type;
 		typedef typename leaf_node_type::key_type key_type;
 		typedef typename leaf_node_type::mapped_type mapped_type;
@@ -720,6 +1258,13 @@ namespace internal {
         */
         persistent_ptr<leaf_node_type> tail;
 
+        /**
+        * Chunks holding all leaf and inner nodes of the tree.
+        */
+        persistent_ptr<leaf_chunk_type> leaf_chunks;
+
+        persistent_ptr<inner_chunk_type> inner_chunks;
+
         void create_new_root(pool_base&, const key_type&, node_persistent_ptr&, node_persistent_ptr& );
 
         std::pair<iterator, bool> insert_descend( pool_base&, const_reference );
@@ -741,17 +1286,27 @@ namespace internal {
 
         void split_inner_node( pool_base &pop, const node_persistent_ptr &src_node, inner_node_type* parent_node, node_persistent_ptr &left, node_persistent_ptr &right ) {
             assert( split_node == nullptr );
-            assignment( pop, split_node, src_node );
+            begin_split( pop, src_node );
             typename inner_node_type::const_iterator partition_point = split_half( pop, split_node, left, right );
             assert( partition_point != cast_inner( split_node )->end() );
+            replace_split_node( pop, parent_node, *partition_point, left, right );
+            deallocate( split_node );
+        }
+
+        /**
+        * Replace split_node by 'left' and 'right' in its parent, or under a new root. The
+        * structure version is bumped before split_node can be freed, which invalidates
+        * inner mirrors that may still lead to it.
+        */
+        void replace_split_node( pool_base& pop, inner_node_type* parent_node, const key_type& key, node_persistent_ptr& left, node_persistent_ptr& right ) {
             if (parent_node) {
-                parent_node->update_splitted_child( pop, *partition_point, left, right, split_node );
+                parent_node->update_splitted_child( pop, key, left, right, split_node );
             }
             else { // Root node is split
                 assert( root == split_node );
-                create_new_root( pop, *partition_point, left, right );
+                create_new_root( pop, key, left, right );
             }
-            deallocate( split_node );
+            tree_state_of( this ).structure.fetch_add( 1, std::memory_order_release );
         }
 
         iterator split_leaf_node(pool_base&, inner_node_type*, persistent_ptr<node_t>&, const_reference, persistent_ptr<node_t>&, persistent_ptr<node_t>&);
@@ -761,7 +1316,7 @@ namespace internal {
             assert( lnode );
             typename leaf_node_type::const_iterator middle = src_node->begin() + src_node->size() / 2;
 
-            return std::includes( lnode->begin(), lnode->end(), src_node->begin(), middle );
+            return std::includes( lnode->begin(), lnode->end(), src_node->begin(), middle, leaf_node_type::entry_less );
         }
 
         static bool is_right_node( const leaf_node_type* src_node, const leaf_node_type* rnode ) {
@@ -769,7 +1324,7 @@ namespace internal {
             assert( rnode );
             typename leaf_node_type::const_iterator middle = src_node->begin() + src_node->size() / 2;
             
-            return std::includes( rnode->begin(), rnode->end(), middle, src_node->end() );
+            return std::includes( rnode->begin(), rnode->end(), middle, src_node->end(), leaf_node_type::entry_less );
         }
 
         void repair_leaf_split( pool_base& pop ) {
@@ -798,12 +1353,7 @@ namespace internal {
 
                         correct_leaf_node_links( pop, split_node, left_child, right_child );
 
-                        if (parent_node) {
-                            parent_node->update_splitted_child( pop, lnode->back().first, left_child, right_child, split_node );
-                        }
-                        else {
-                            create_new_root( pop, lnode->back().first, left_child, right_child );
-                        }
+                        replace_split_node( pop, parent_node, lnode->back().first, left_child, right_child );
                     }
                     else { // Only left child was allocated during split before crash
                         deallocate( left_child );
@@ -856,14 +1406,27 @@ namespace internal {
             pop.persist( lhs );
         }
 
+        /**
+        * Record 'node' as the splitting node. Children of an earlier split are cleared first:
+        * their slots may have been reused, and recovery must not take them for new children.
+        */
+        void begin_split( pool_base& pop, const persistent_ptr<node_t>& node ) {
+            left_child = nullptr;
+            right_child = nullptr;
+            pop.flush( left_child );
+            pop.persist( right_child );
+            assignment( pop, split_node, node );
+        }
+
         leaf_node_type* find_leaf_node( const key_type& key ) const {
             if (root == nullptr)
                 return nullptr;
 
             node_persistent_ptr node = root;
             while (!node->leaf()) {
-
+                const bool leaves = node->level() == 1;
                 node = cast_inner( node )->get_child( key );
+                prefetch_node( node.get(), leaves );
             }
             return cast_leaf( node ).get();
         }
@@ -875,8 +1438,9 @@ namespace internal {
             node_persistent_ptr node = root;
             while (!node->leaf()) {
                 path.push_back( cast_inner(node) );
-
+                const bool leaves = node->level() == 1;
                 node = cast_inner( node )->get_child( key );
+                prefetch_node( node.get(), leaves );
             }
             return cast_leaf( node );
         }
@@ -890,6 +1454,19 @@ namespace internal {
             return i;
         }
 
+        /**
+        * Prefetch what a search reads in 'node', which the level of its parent tells to be a
+        * leaf or an inner node, so the node is not read before it is prefetched.
+        */
+        static void prefetch_node( const node_t* node, bool leaf ) {
+            if (node == nullptr) return;
+            if (leaf) {
+                static_cast<const leaf_node_type*>( node )->prefetch();
+            } else {
+                static_cast<const inner_node_type*>( node )->prefetch();
+            }
+        }
+
         static persistent_ptr<inner_node_type>& cast_inner(persistent_ptr<node_t>& node) {
             return reinterpret_cast<persistent_ptr<inner_node_type>&>(node);
         }
@@ -908,56 +1485,182 @@ namespace internal {
 
         template<typename... Args>
         inline persistent_ptr<inner_node_type> allocate_inner(pool_base& pop, persistent_ptr<node_t>& node, Args&& ...args) {
-            make_persistent_atomic<inner_node_type>(pop, cast_inner(node), args...);
-            return cast_inner(node);
+            return allocate_node( pop, inner_chunks, node_slots().inners, cast_inner(node), args... );
         }
 
         template<typename... Args>
         inline persistent_ptr<leaf_node_type> allocate_leaf(pool_base& pop, persistent_ptr<node_t>& node, Args&& ...args) {
-            make_persistent_atomic<leaf_node_type>(pop, cast_leaf(node), args...);
-            return cast_leaf(node);
+            return allocate_node( pop, leaf_chunks, node_slots().leaves, cast_leaf(node), args... );
         }
 
+        /**
+        * Construct a node in a free slot, taking a new chunk when there is none, and then
+        * publish it in 'node'. A crash before 'node' is persisted leaves the slot unused.
+        */
+        template<typename TNode, typename TChunk, typename... Args>
+        static persistent_ptr<TNode>& allocate_node( pool_base& pop, persistent_ptr<TChunk>& chunks, std::vector<PMEMoid>& free, persistent_ptr<TNode>& node, Args&& ...args ) {
+            if (free.empty()) {
+                persistent_ptr<TChunk> next = chunks;
+                make_persistent_atomic<TChunk>( pop, chunks, next );
+                for (size_t i = TChunk::count; i-- > 0;) {
+                    free.push_back( TChunk::slot_oid( chunks, i ) );
+                }
+            }
+            PMEMoid oid = free.back();
+            free.pop_back();
+            TNode* constructed = new (pmemobj_direct( oid )) TNode( args... );
+            pop.persist( constructed, sizeof( TNode ) );
+            node = persistent_ptr<TNode>( oid );
+            pop.persist( node );
+            return node;
+        }
+
+        /**
+        * Return the slot of 'node' to the free slots once no reader can reach it. Only the
+        * pointer is persisted, the slot is found free again when the tree is opened.
+        */
         inline void deallocate(persistent_ptr<node_t>& node) {
             if (node == nullptr)
                 return;
 
-            pool_base pop = get_pool_base();
-            transaction::manual tx( pop );
+            readers().synchronize();
+            node_slots_t& slots = node_slots();
             if (node->leaf()) {
-                deallocate_leaf( cast_leaf( node ) );
+                slots.leaves.push_back( node.raw() );
             } else {
-                deallocate_inner( cast_inner( node ) );
+                slots.inners.push_back( node.raw() );
             }
             node = nullptr;
-            transaction::commit();
+            pool_base( slots.pop ).persist( node );
         }
 
-        inline void deallocate_inner( inner_node_persistent_ptr& node) {
-            delete_persistent<inner_node_type>( node );
+        /**
+        * Node slots of this tree. Called by writers only, so the owner of the tree state
+        * is stable under the writer mutex.
+        */
+        node_slots_t& node_slots( bool rebuild = false ) {
+            tree_state_t& state = tree_state_of( this );
+            if (state.owner != this) {
+                state.slots = &node_slots_of( this );
+                state.owner = this;
+            }
+            if (rebuild || state.slots->pop == nullptr) {
+                rebuild_node_slots( *state.slots );
+            }
+            return *state.slots;
         }
 
-        inline void deallocate_leaf(leaf_node_persistent_ptr& node) {
-            delete_persistent<leaf_node_type>( node );
+        /**
+        * Find the slots in use from the nodes reachable from the root, plus the nodes of an
+        * unfinished split, and take all other slots of the chunks as free.
+        */
+        void rebuild_node_slots( node_slots_t& slots ) const {
+            slots.pop = get_objpool();
+            std::unordered_set<const void*> used;
+            std::vector<const node_t*> stack;
+            std::vector<key_type> keys;
+            std::vector<const node_t*> children;
+            stack.push_back( root.get() );
+            if (split_node != nullptr) {
+                stack.push_back( split_node.get() );
+                stack.push_back( left_child.get() );
+                stack.push_back( right_child.get() );
+            }
+            while (!stack.empty()) {
+                const node_t* node = stack.back();
+                stack.pop_back();
+                if (node == nullptr || !used.insert( node ).second)
+                    continue;
+                if (!node->leaf()) {
+                    static_cast<const inner_node_type*>( node )->copy_to( keys, children );
+                    stack.insert( stack.end(), children.begin(), children.end() );
+                }
+            }
+            collect_free_slots( leaf_chunks, used, slots.leaves );
+            collect_free_slots( inner_chunks, used, slots.inners );
         }
-        
-        PMEMobjpool *get_objpool() {
+
+        /**
+        * Free the chunks none of whose slots holds a node, unlinking each in a transaction,
+        * and return whether any was freed. Only runs at open, before any reader.
+        */
+        template<typename TChunk>
+        static bool release_free_chunks( pool_base& pop, persistent_ptr<TChunk>& chunks, const std::vector<PMEMoid>& free ) {
+            std::unordered_set<uint64_t> free_offsets;
+            for (const PMEMoid& oid : free) {
+                free_offsets.insert( oid.off );
+            }
+            bool released = false;
+            persistent_ptr<TChunk>* link = &chunks;
+            while (*link != nullptr) {
+                persistent_ptr<TChunk> chunk = *link;
+                size_t unused = 0;
+                for (size_t i = 0; i < TChunk::count; ++i) {
+                    unused += free_offsets.count( TChunk::slot_oid( chunk, i ).off );
+                }
+                if (unused < TChunk::count) {
+                    link = &chunk->next;
+                    continue;
+                }
+                transaction::manual tx( pop );
+                pmem::detail::conditional_add_to_tx( link );
+                *link = chunk->next;
+                delete_persistent<TChunk>( chunk );
+                transaction::commit();
+                released = true;
+            }
+            return released;
+        }
+
+        template<typename TChunk>
+        static void collect_free_slots( const persistent_ptr<TChunk>& chunks, const std::unordered_set<const void*>& used, std::vector<PMEMoid>& free ) {
+            free.clear();
+            for (persistent_ptr<TChunk> chunk = chunks; chunk != nullptr; chunk = chunk->next) {
+                for (size_t i = TChunk::count; i-- > 0;) {
+                    if (used.count( &chunk->slots[i] ) == 0) {
+                        free.push_back( TChunk::slot_oid( chunk, i ) );
+                    }
+                }
+            }
+        }
+
+        /**
+        * Free chunks from the head of the list, 'batch' chunks per transaction.
+        */
+        template<typename TChunk>
+        static void free_chunks( pool_base& pop, persistent_ptr<TChunk>& chunks, size_t batch ) {
+            while (chunks != nullptr) {
+                transaction::manual tx( pop );
+                persistent_ptr<TChunk> chunk = chunks;
+                for (size_t count = 0; count < batch && chunk != nullptr; ++count) {
+                    persistent_ptr<TChunk> next = chunk->next;
+                    delete_persistent<TChunk>( chunk );
+                    chunk = next;
+                }
+                pmem::detail::conditional_add_to_tx( &chunks );
+                chunks = chunk;
+                transaction::commit();
+            }
+        }
+
+        PMEMobjpool *get_objpool() const {
             PMEMoid oid = pmemobj_oid( this );
             return pmemobj_pool_by_oid( oid );
         }
 
+        /**
+        * Pool of the tree, resolved once when the node slots are built.
+        */
         pool_base get_pool_base() {
-            return pool_base( get_objpool() );
+            return pool_base( node_slots().pop );
         }
 
-    public:  
-        std::pair<iterator, bool> insert( const_reference entry) {
-            auto pop = get_pool_base();
-
+        std::pair<iterator, bool> insert_entry( pool_base& pop, const_reference entry ) {
             if ( root == nullptr ) {
                 head = tail = allocate_leaf( pop, root );
                 pop.persist( head );
                 pop.persist( tail );
+                tree_state_of( this ).structure.fetch_add( 1, std::memory_order_release );
             }
             assert( root != nullptr );
 
@@ -966,6 +1669,92 @@ namespace internal {
             return ret;
         }
 
+    public:
+        /**
+        * Insert and find may be called from several threads. Writers are serialized per tree.
+        * Readers take no locks: they validate node versions and start over from the root
+        * when a node changed under them. Nodes are freed only after readers that could still
+        * reach them are done. The returned iterators are only safe without other writers.
+        */
+        std::pair<iterator, bool> insert( const_reference entry ) {
+            std::lock_guard<std::mutex> lock( tree_state_of( this ).writer );
+            auto pop = get_pool_base();
+            return insert_entry( pop, entry );
+        }
+
+        /**
+        * Insert 'entry', or overwrite the value of the entry with the same key in a transaction.
+        */
+        std::pair<iterator, bool> insert_or_assign( const_reference entry ) {
+            std::lock_guard<std::mutex> lock( tree_state_of( this ).writer );
+            auto pop = get_pool_base();
+            std::pair<iterator, bool> ret = insert_entry( pop, entry );
+            if (!ret.second) {
+                std::lock_guard<node_latch_t> guard( latch_of( ret.first.get_node() ) );
+                transaction::manual tx( pop );
+                pmem::detail::conditional_add_to_tx( &(ret.first->second) );
+                ret.first->second = entry.second;
+                transaction::commit();
+            }
+            return ret;
+        }
+
+        /**
+        * Copy the value mapped to 'key' into 'value'. With a 'mirror', the descent to the leaf
+        * runs over its volatile copy of the inner levels whenever that copy is up to date.
+        */
+        bool find( const key_type& key, mapped_type& value, inner_mirror_type* mirror = nullptr ) const {
+            const std::atomic<uint64_t>& structure = tree_state_of( this ).structure;
+            if (mirror != nullptr) {
+                mirror->refresh( structure, root );
+            }
+
+            read_guard_t guard;
+            for (;;) {
+                if (mirror != nullptr) {
+                    uint64_t current = structure.load( std::memory_order_acquire );
+                    const node_t* leaf = mirror->find_leaf( key, current );
+                    prefetch_node( leaf, true );                 // overlaps with latch & version check
+                    if (leaf != nullptr) {
+                        uint64_t version = latch_of( leaf ).read_begin();
+                        if (structure.load( std::memory_order_acquire ) == current) {
+                            const_pointer entry = static_cast<const leaf_node_type*>( leaf )->find_entry( key );
+                            if (entry != nullptr) {
+                                value = entry->second;
+                            }
+                            if (latch_of( leaf ).read_validate( version )) {
+                                return entry != nullptr;
+                            }
+                            continue;
+                        }
+                    }
+                }
+
+                const node_t* node = root.get();
+                if (node == nullptr) return false;
+
+                uint64_t version = latch_of( node ).read_begin();
+                bool valid = true;
+                while (valid && !node->leaf()) {
+                    const node_t* child = static_cast<const inner_node_type*>( node )->find_child( key );
+                    prefetch_node( child, node->level() == 1 );
+                    uint64_t child_version = latch_of( child ).read_begin();
+                    valid = latch_of( node ).read_validate( version );
+                    node = child;
+                    version = child_version;
+                }
+                if (!valid) continue;
+
+                const_pointer entry = static_cast<const leaf_node_type*>( node )->find_entry( key );
+                if (entry != nullptr) {
+                    value = entry->second;
+                }
+                if (latch_of( node ).read_validate( version )) {
+                    return entry != nullptr;
+                }
+            }
+        }
+
         iterator find( const key_type& key ) {
             leaf_node_type* leaf = find_leaf_node( key );
             if (leaf == nullptr) return end();
@@ -985,8 +1774,113 @@ namespace internal {
 
             return const_iterator( leaf, leaf_it );
         }
+
+        /**
+        * Return iterator on the first entry with key not less than 'key', found with a single
+        * descent. Like other iterators, only safe without concurrent writers.
+        */
+        iterator lower_bound( const key_type& key ) {
+            leaf_node_type* leaf = find_leaf_node( key );
+            if (leaf == nullptr) return end();
+
+            typename leaf_node_type::iterator leaf_it = leaf->lower_bound( key );
+            if (leaf_it == leaf->end() && leaf->get_next() != nullptr) {
+                return iterator( leaf->get_next().get() );
+            }
+            return iterator( leaf, leaf_it );
+        }
+
+        const_iterator lower_bound( const key_type& key ) const {
+            const leaf_node_type* leaf = find_leaf_node( key );
+            if (leaf == nullptr) return end();
+
+            typename leaf_node_type::const_iterator leaf_it = leaf->lower_bound( key );
+            if (leaf_it == leaf->end() && leaf->get_next() != nullptr) {
+                return const_iterator( leaf->get_next().get() );
+            }
+            return const_iterator( leaf, leaf_it );
+        }
+
+        /**
+        * Return iterator on the first entry with key greater than 'key'.
+        */
+        iterator upper_bound( const key_type& key ) {
+            iterator it = lower_bound( key );
+            if (it != end() && !TCompare()( key, it->first )) {
+                ++it;
+            }
+            return it;
+        }
+
+        const_iterator upper_bound( const key_type& key ) const {
+            const_iterator it = lower_bound( key );
+            if (it != end() && !TCompare()( key, it->first )) {
+                ++it;
+            }
+            return it;
+        }
+
+        /**
+        * Return the range of entries with key equivalent to 'key', at most one entry.
+        */
+        std::pair<iterator, iterator> equal_range( const key_type& key ) {
+            iterator first = lower_bound( key );
+            iterator last = first;
+            if (last != end() && !TCompare()( key, last->first )) {
+                ++last;
+            }
+            return std::pair<iterator, iterator>( first, last );
+        }
+
+        std::pair<const_iterator, const_iterator> equal_range( const key_type& key ) const {
+            const_iterator first = lower_bound( key );
+            const_iterator last = first;
+            if (last != end() && !TCompare()( key, last->first )) {
+                ++last;
+            }
+            return std::pair<const_iterator, const_iterator>( first, last );
+        }
+
+        /**
+        * Call 'visit' on entries in descending key order, starting from the greatest key
+        * less than '*before', or from the greatest key when 'before' is null, until 'visit'
+        * returns false. Entries are copied in batches while writers are held off, and
+        * visited once writers may run again, so 'visit' may itself write to the tree.
+        * Each batch is consistent, and the next one resumes below the last key visited.
+        */
+        template<typename F>
+        void reverse_scan( const key_type* before, F visit ) const {
+            std::vector<value_type> entries;
+            entries.reserve( reverse_scan_batch );
+            key_type bound;
+            bool bounded = before != nullptr;
+            if (bounded) bound = *before;
+            for (;;) {
+                entries.clear();
+                {
+                    std::lock_guard<std::mutex> lock( tree_state_of( this ).writer );
+                    if (root == nullptr) return;
+                    const_iterator first = begin();
+                    const_iterator it = bounded ? lower_bound( bound ) : end();
+                    while (it != first && entries.size() < reverse_scan_batch) {
+                        --it;
+                        entries.push_back( *it );
+                    }
+                }
+                for (const value_type& entry : entries) {
+                    if (!visit( entry )) return;
+                }
+                if (entries.size() < reverse_scan_batch) return;
+                bound = entries.back().first;
+                bounded = true;
+            }
+        }
         
         void garbage_collection();
+
+        void clear( size_t batch );
+
+        void close();
         
         iterator begin() {
 			leaf_node_type* leaf = head.get();
@@ -1005,7 +1899,7 @@ namespace internal {
 
         const_iterator end() const {
             const leaf_node_type* leaf = tail.get();
-            return const_iterator( leaf, leaf ? leaf->end() : typename leaf_node_type::iterator() );
+            return const_iterator( leaf, leaf ? leaf->end() : typename leaf_node_type::const_iterator() );
         }
 
         const_iterator cbegin() const {
@@ -1025,9 +1919,10 @@ namespace internal {
         }
     }; // class b_tree_base
     
-    template<typename TKey, typename TValue, size_t degree>
-    void b_tree_base<TKey, TValue, degree>::garbage_collection() {
-        pool_base pop = get_pool_base();
+    template<typename TKey, typename TValue, size_t degree, typename TCompare>
+    void b_tree_base<TKey, TValue, degree, TCompare>::garbage_collection() {
+        std::lock_guard<std::mutex> lock( tree_state_of( this ).writer );
+        pool_base pop( node_slots( true ).pop );
 
         if (split_node != nullptr) {
             if ( split_node->leaf() ) {
@@ -1037,19 +1932,69 @@ namespace internal {
                 repair_inner_split( pop );
             }
         }
+
+        node_slots_t& slots = node_slots();
+        bool released = release_free_chunks( pop, leaf_chunks, slots.leaves );
+        released = release_free_chunks( pop, inner_chunks, slots.inners ) || released;
+        if (released) {
+            node_slots( true );
+        }
+    }
+
+    /**
+     * Drop the volatile allocation state of the tree, once it is closed or about to be
+     * freed, so that a tree opened later at the same address starts from its own chunks.
+     */
+    template<typename TKey, typename TValue, size_t degree, typename TCompare>
+    void b_tree_base<TKey, TValue, degree, TCompare>::close() {
+        tree_state_t& state = tree_state_of( this );
+        std::lock_guard<std::mutex> lock( state.writer );
+        if (state.owner == this) {
+            state.owner = nullptr;
+            state.slots = nullptr;
+        }
+        release_node_slots( this );
     }
 
-    template<typename TKey, typename TValue, size_t degree>
-    typename b_tree_base<TKey, TValue, degree>::iterator b_tree_base<TKey, TValue, degree>::split_leaf_node(pool_base& pop, inner_node_type* parent_node, persistent_ptr<node_t>& src_node, const_reference entry, persistent_ptr<node_t>& left, persistent_ptr<node_t>& right) {
+    /**
+     * Detach all nodes from the tree in one transaction, then free their chunks in
+     * transactions of at most 'batch' chunks. Every step leaves a state that clear() can
+     * resume from. Must not run concurrently with readers.
+     */
+    template<typename TKey, typename TValue, size_t degree, typename TCompare>
+    void b_tree_base<TKey, TValue, degree, TCompare>::clear( size_t batch ) {
+        std::lock_guard<std::mutex> lock( tree_state_of( this ).writer );
+        tree_state_of( this ).structure.fetch_add( 1, std::memory_order_release );
+        pool_base pop = get_pool_base();
+
+        if (root != nullptr || head != nullptr || tail != nullptr || split_node != nullptr) {
+            transaction::manual tx( pop );
+            pmem::detail::conditional_add_to_tx( this );
+            root = nullptr;
+            head = nullptr;
+            tail = nullptr;
+            split_node = nullptr;
+            left_child = nullptr;
+            right_child = nullptr;
+            transaction::commit();
+        }
+
+        free_chunks( pop, leaf_chunks, batch );
+        free_chunks( pop, inner_chunks, batch );
+        node_slots( true );
+    }
+
+    template<typename TKey, typename TValue, size_t degree, typename TCompare>
+    typename b_tree_base<TKey, TValue, degree, TCompare>::iterator b_tree_base<TKey, TValue, degree, TCompare>::split_leaf_node(pool_base& pop, inner_node_type* parent_node, persistent_ptr<node_t>& src_node, const_reference entry, persistent_ptr<node_t>& left, persistent_ptr<node_t>& right) {
         const leaf_node_type* split_leaf = cast_leaf(src_node).get();
         assert( split_leaf->full() );
-        assignment( pop, split_node, src_node );
+        begin_split( pop, src_node );
 
         typename leaf_node_type::const_iterator middle = split_leaf->begin() + split_leaf->size() / 2;
         
         leaf_node_type* insert_node = nullptr;
         leaf_node_type* lnode = nullptr;
-        if ( entry.first < middle->first ) {
+        if ( TCompare()( entry.first, middle->first ) ) {
             lnode = insert_node = allocate_leaf( pop, left, entry, split_leaf->begin(), middle, split_leaf->get_prev(), nullptr ).get();
             allocate_leaf( pop, right, middle, split_leaf->end(), cast_leaf(left), split_leaf->get_next() ).get();
         }
@@ -1063,12 +2008,7 @@ namespace internal {
         
         correct_leaf_node_links(pop, src_node, left, right);
 
-        if (parent_node) {
-            parent_node->update_splitted_child( pop, lnode->back().first, left, right, split_node );
-        }
-        else {
-            create_new_root( pop, lnode->back().first, left, right );
-        }
+        replace_split_node( pop, parent_node, lnode->back().first, left, right );
 
         deallocate( split_node );
 
@@ -1079,8 +2019,8 @@ namespace internal {
         return iterator(insert_node, leaf_it);
     }
     
-    template<typename TKey, typename TValue, size_t degree>
-    void b_tree_base<TKey, TValue, degree>::correct_leaf_node_links(pool_base& pop, persistent_ptr<node_t>& src_node, persistent_ptr<node_t>& left, persistent_ptr<node_t>& right) {
+    template<typename TKey, typename TValue, size_t degree, typename TCompare>
+    void b_tree_base<TKey, TValue, degree, TCompare>::correct_leaf_node_links(pool_base& pop, persistent_ptr<node_t>& src_node, persistent_ptr<node_t>& left, persistent_ptr<node_t>& right) {
         persistent_ptr<leaf_node_type> lnode = cast_leaf(left);
         persistent_ptr<leaf_node_type> rnode = cast_leaf(right);
         leaf_node_type* current_node = cast_leaf(src_node).get();
@@ -1102,8 +2042,8 @@ namespace internal {
         }
     }
 
-    template<typename TKey, typename TValue, size_t degree>
-    void b_tree_base<TKey, TValue, degree>::create_new_root(pool_base& pop, const key_type& key, node_persistent_ptr& l_child, node_persistent_ptr& r_child ) {
+    template<typename TKey, typename TValue, size_t degree, typename TCompare>
+    void b_tree_base<TKey, TValue, degree, TCompare>::create_new_root(pool_base& pop, const key_type& key, node_persistent_ptr& l_child, node_persistent_ptr& r_child ) {
         assert( l_child != nullptr );
         assert( r_child != nullptr );
         assert( split_node == root );
@@ -1111,8 +2051,8 @@ namespace internal {
         persistent_ptr<inner_node_type> inner_root = allocate_inner( pop, root, root->level() + 1, key, l_child, r_child );
     }
     
-    template<typename TKey, typename TValue, size_t degree>
-    std::pair<typename b_tree_base<TKey, TValue, degree>::iterator, bool> b_tree_base<TKey, TValue, degree>::insert_descend( pool_base& pop, const_reference entry ) {
+    template<typename TKey, typename TValue, size_t degree, typename TCompare>
+    std::pair<typename b_tree_base<TKey, TValue, degree, TCompare>::iterator, bool> b_tree_base<TKey, TValue, degree, TCompare>::insert_descend( pool_base& pop, const_reference entry ) {
         path_type path;
         const key_type& key = entry.first;
 
@@ -1166,25 +2106,27 @@ namespace internal {
 
 } // namespace internal
 
-// TODO: add key comparator as a template argument; std::less should be default
-template<typename Key, typename Value, size_t degree>
-class b_tree : public internal::b_tree_base<Key, Value, degree> {
+template<typename Key, typename Value, size_t degree, typename Compare = std::less<Key>>
+class b_tree : public internal::b_tree_base<Key, Value, degree, Compare> {
     // Base type definitions
-    typedef b_tree<Key, Value, degree> self_type;
-    typedef internal::b_tree_base<Key, Value, degree> base_type;
+    typedef b_tree<Key, Value, degree, Compare> self_type;
+    typedef internal::b_tree_base<Key, Value, degree, Compare> base_type;
 public:
     using base_type::begin;
     using base_type::end;
     using base_type::find;
     using base_type::insert;
+    using base_type::insert_or_assign;
 
     // Type definitions
     typedef Key key_type;
     typedef Value mapped_type;
+    typedef Compare key_compare;
     typedef typename base_type::value_type value_type;
     typedef typename base_type::iterator iterator;
     typedef typename base_type::const_iterator const_iterator;
     typedef typename base_type::reverse_iterator reverse_iterator;
+    typedef typename base_type::inner_mirror_type inner_mirror_type;
 
     explicit b_tree() : base_type() {}
     ~b_tree() {}
@@ -34,14 +34,30 @@
 #define PERSISTENT_PSTRING_H
 
 #include <string.h>
+#include <stdint.h>
 #include <stdexcept>
+#include <type_traits>
 
+/**
+ * String of at most CAPACITY bytes stored in place, with a 1-byte length for capacities up
+ * to 255 and a 2-byte length otherwise. Strings are ordered like memcmp, by unsigned bytes.
+ */
 template<size_t CAPACITY>
 class pstring {
+    static_assert(CAPACITY <= UINT16_MAX, "pstring capacity exceeds 2-byte length");
     static const size_t BUFFER_SIZE = CAPACITY + 1;
+    typedef typename std::conditional<CAPACITY <= UINT8_MAX, uint8_t, uint16_t>::type size_type;
 public:
-    pstring(const std::string& s = "\0") {
-        init(s.c_str(), s.size());
+    pstring() : _size(0) {
+        str[0] = '\0';
+    }
+
+    pstring(const char* src, size_t size) {
+        init(src, size);
+    }
+
+    pstring(const std::string& s) {
+        init(s.data(), s.size());
     }
 
     pstring(const pstring& other) {
@@ -54,10 +70,14 @@ public:
     }
 
     pstring& operator=(const std::string& s) {
-        init(s.c_str(), s.size());
+        init(s.data(), s.size());
         return *this;
     }
 
+    void assign(const char* src, size_t size) {
+        init(src, size);
+    }
+
     const char* c_str() const {
         return str;
     }
@@ -87,26 +107,50 @@ private:
         if(size > CAPACITY) throw std::length_error("size exceed pstring capacity");
         memcpy(str, src, size);
         str[size] = '\0';
-        _size = size;
+        _size = (size_type) size;
     }
 
+    size_type _size;
     char str[BUFFER_SIZE];
-    size_t _size;
 };
 
+template<size_t size>
+inline int compare(const pstring<size>& lhs, const pstring<size>& rhs) {
+    const size_t common = lhs.size() < rhs.size() ? lhs.size() : rhs.size();
+    const int result = memcmp(lhs.c_str(), rhs.c_str(), common);
+    if (result != 0) return result;
+    return lhs.size() < rhs.size() ? -1 : (lhs.size() > rhs.size() ? 1 : 0);
+}
+
 template<size_t size>
 inline bool operator<(const pstring<size>& lhs, const pstring<size>& rhs) {
-    return std::lexicographical_compare(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+    return compare(lhs, rhs) < 0;
 }
 
 template<size_t size>
 inline bool operator>(const pstring<size>& lhs, const pstring<size>& rhs) {
-    return std::lexicographical_compare(rhs.begin(), rhs.end(), lhs.begin(), lhs.end());
+    return compare(lhs, rhs) > 0;
 }
 
 template<size_t size>
 inline bool operator==(const pstring<size>& lhs, const pstring<size>& rhs) {
-    return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+    return lhs.size() == rhs.size() && memcmp(lhs.c_str(), rhs.c_str(), lhs.size()) == 0;
+}
+
+/**
+ * First 8 bytes of the string as a big-endian integer, zero padded, so that integer order
+ * agrees with operator<.
+ */
+template<size_t size>
+inline uint64_t key_head(const pstring<size>& s) {
+    unsigned char bytes[8] = {0};
+    memcpy(bytes, s.c_str(), s.size() < 8 ? s.size() : 8);
+    uint64_t head;
+    memcpy(&head, bytes, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    head = __builtin_bswap64(head);
+#endif
+    return head;
 }
 
 template<size_t size>
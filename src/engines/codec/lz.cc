@@ -0,0 +1,188 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include "lz.h"
+
+#ifdef PMEMKV_USE_LZ4
+#include <lz4.h>
+#endif
+
+namespace pmemkv {
+namespace codec {
+
+#ifdef PMEMKV_USE_LZ4
+
+size_t LZBound(const size_t size) {
+    return (size_t) LZ4_compressBound((int) size);
+}
+
+size_t LZCompress(const char* src, const size_t size, char* dst, const size_t capacity) {
+    int result = LZ4_compress_default(src, dst, (int) size, (int) capacity);
+    return result > 0 ? (size_t) result : 0;
+}
+
+bool LZDecompress(const char* src, const size_t size, char* dst, const size_t rawsize) {
+    return LZ4_decompress_safe(src, dst, (int) size, (int) rawsize) == (int) rawsize;
+}
+
+#else
+
+#define LZ_HASH_BITS 12                                    // size of match finder table
+#define LZ_MIN_MATCH 4                                     // shortest match encoded
+#define LZ_LAST_LITERALS 5                                 // block always ends with literals
+#define LZ_MATCH_LIMIT 12                                  // no match starts in last bytes
+#define LZ_MAX_OFFSET 65535                                // farthest match distance
+
+static inline uint32_t Read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t Hash(const uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t* WriteLength(uint8_t* out, size_t length) {
+    for (; length >= 255; length -= 255) *out++ = 255;
+    *out++ = (uint8_t) length;
+    return out;
+}
+
+// write one sequence of literals, followed by a match unless this is the last sequence
+static uint8_t* WriteSequence(uint8_t* out, const uint8_t* out_end, const uint8_t* literals,
+                              const size_t literal_length, const size_t offset, const size_t match_length) {
+    const size_t needed = 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1;
+    if ((size_t) (out_end - out) < needed) return nullptr;
+    uint8_t* token = out++;
+    *token = (uint8_t) ((literal_length >= 15 ? 15 : literal_length) << 4);
+    if (literal_length >= 15) out = WriteLength(out, literal_length - 15);
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+    if (match_length == 0) return out;                     // last sequence
+    *out++ = (uint8_t) (offset & 0xff);
+    *out++ = (uint8_t) (offset >> 8);
+    const size_t length = match_length - LZ_MIN_MATCH;
+    *token |= (uint8_t) (length >= 15 ? 15 : length);
+    if (length >= 15) out = WriteLength(out, length - 15);
+    return out;
+}
+
+size_t LZBound(const size_t size) {
+    return size + size / 255 + 16;
+}
+
+size_t LZCompress(const char* src, const size_t size, char* dst, const size_t capacity) {
+    auto in = (const uint8_t*) src;
+    auto out = (uint8_t*) dst;
+    const uint8_t* out_end = out + capacity;
+    size_t anchor = 0;
+    if (size > LZ_MATCH_LIMIT) {
+        uint32_t table[1 << LZ_HASH_BITS] = {};            // last position of each hashed sequence
+        const size_t match_end = size - LZ_LAST_LITERALS;
+        const size_t search_end = size - LZ_MATCH_LIMIT;
+        size_t pos = 0;
+        while (pos < search_end) {
+            const uint32_t sequence = Read32(in + pos);
+            const uint32_t h = Hash(sequence);
+            const size_t candidate = table[h];
+            table[h] = (uint32_t) pos;
+            if (candidate >= pos || pos - candidate > LZ_MAX_OFFSET || Read32(in + candidate) != sequence) {
+                pos++;
+                continue;
+            }
+            size_t length = LZ_MIN_MATCH;
+            while (pos + length < match_end && in[candidate + length] == in[pos + length]) length++;
+            out = WriteSequence(out, out_end, in + anchor, pos - anchor, pos - candidate, length);
+            if (out == nullptr) return 0;
+            pos += length;
+            anchor = pos;
+        }
+    }
+    out = WriteSequence(out, out_end, in + anchor, size - anchor, 0, 0);
+    return out == nullptr ? 0 : (size_t) (out - (uint8_t*) dst);
+}
+
+bool LZDecompress(const char* src, const size_t size, char* dst, const size_t rawsize) {
+    auto in = (const uint8_t*) src;
+    const uint8_t* in_end = in + size;
+    auto out = (uint8_t*) dst;
+    const uint8_t* out_end = out + rawsize;
+    while (in < in_end) {
+        const uint8_t token = *in++;
+        size_t literal_length = token >> 4;
+        if (literal_length == 15) {
+            uint8_t b;
+            do {
+                if (in >= in_end) return false;
+                b = *in++;
+                literal_length += b;
+            } while (b == 255);
+        }
+        if (literal_length > (size_t) (in_end - in) || literal_length > (size_t) (out_end - out)) return false;
+        memcpy(out, in, literal_length);
+        out += literal_length;
+        in += literal_length;
+        if (in == in_end) break;                           // last sequence has no match
+
+        if (in_end - in < 2) return false;
+        const size_t offset = in[0] | ((size_t) in[1] << 8);
+        in += 2;
+        if (offset == 0 || offset > (size_t) (out - (uint8_t*) dst)) return false;
+        size_t match_length = token & 15;
+        if (match_length == 15) {
+            uint8_t b;
+            do {
+                if (in >= in_end) return false;
+                b = *in++;
+                match_length += b;
+            } while (b == 255);
+        }
+        match_length += LZ_MIN_MATCH;
+        if (match_length > (size_t) (out_end - out)) return false;
+        const uint8_t* match = out - offset;
+        if (offset >= match_length) {
+            memcpy(out, match, match_length);
+        } else {
+            for (size_t i = 0; i < match_length; i++) out[i] = match[i];  // overlapping copy
+        }
+        out += match_length;
+    }
+    return out == out_end;
+}
+
+#endif
+
+} // namespace codec
+} // namespace pmemkv
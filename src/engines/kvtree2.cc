@@ -32,11 +32,14 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <list>
+#include <thread>
 #include <unistd.h>
 #include "kvtree2.h"
+#include "codec/lz.h"
 
 #define DO_LOG 0
 #define LOG(msg) if (DO_LOG) std::cout << "[kvtree2] " << msg << "\n"
@@ -44,7 +47,39 @@
 namespace pmemkv {
 namespace kvtree2 {
 
-KVTree::KVTree(const string& path, const size_t size, const string layout) : pmpath(path) {
+// prefetch every cache line of the given range, without waiting for any of them
+static inline void Prefetch(const void* addr, const size_t bytes) {
+    uintptr_t line = (uintptr_t) addr & ~((uintptr_t) CACHE_LINE_SIZE - 1);
+    const uintptr_t end = (uintptr_t) addr + bytes;
+    for (; line < end; line += CACHE_LINE_SIZE) __builtin_prefetch((const void*) line);
+}
+
+// Scans prefetch the next leaf while the current one is read, and the buffers of all slots of
+// the current leaf before the first of them is read, so their misses overlap.
+static void LeafPrefetch(const persistent_ptr<KVLeaf>& leaf, const bool buffers) {
+    if (leaf->next) Prefetch(leaf->next.get(), sizeof(KVLeaf));
+    if (buffers) for (int slot = LEAF_KEYS; slot--;) leaf->slots[slot].get_ro().prefetch();
+}
+
+// Registers a headerless class of units of the given size, which is either a whole number of
+// media lines aligned to a line, or a power of two dividing a line and aligned to its size, so
+// that no unit straddles more lines than it must. Returns the class allocation flags, or 0 for
+// the default classes if it is not available.
+static uint64_t LineClass(PMEMobjpool* pop, const size_t unit) {
+    struct pobj_alloc_class_desc desc = {};
+    desc.unit_size = unit;
+    desc.alignment = std::min(unit, (size_t) LINE_SIZE);
+    desc.units_per_block = (unsigned) ((LINE_SIZE * 1024) / unit);
+    desc.header_type = POBJ_HEADER_NONE;
+    if (pmemobj_ctl_set(pop, "heap.alloc_class.new.desc", &desc) != 0) {
+        LOG("Line-aligned allocation class not available, unit=" << unit);
+        return 0;
+    }
+    return POBJ_CLASS_ID(desc.class_id);
+}
+
+KVTree::KVTree(const string& path, const size_t size, const string layout, const KVTreeOptions& options)
+        : pmpath(path), options(options) {
     if ((access(path.c_str(), F_OK) != 0) && (size > 0)) {
         LOG("Creating filesystem pool, path=" << path << ", size=" << to_string(size));
         pmpool = pool<KVRoot>::create(path.c_str(), layout, size, S_IRWXU);
@@ -52,6 +87,34 @@ KVTree::KVTree(const string& path, const size_t size, const string layout) : pmp
         LOG("Opening pool, path=" << path);
         pmpool = pool<KVRoot>::open(path.c_str(), layout);
     }
+
+    // stamp new roots with the layout, and refuse pools written with any other layout, as
+    // roots grown from older pools read zero past their former end
+    auto root = pmpool.get_root();
+    if (root->layout != KVTREE_LAYOUT) {
+        if (root->layout != 0 || root->head) {
+            pmpool.close();
+            throw std::invalid_argument("pool has an incompatible kvtree2 layout");
+        }
+        transaction::run(pmpool, [&] {
+            root->freeing = 0;
+            root->layout = KVTREE_LAYOUT;
+        });
+    }
+
+    // leaves & slot buffers take headerless classes aligned to media lines, so that a record and
+    // its hash & sizes share one line. Buffers of up to half a line take 64 or 128 byte units
+    // rather than a whole line, to not multiply the space of small records. A headerless class
+    // only allocates single units, so there is one class per unit size.
+    for (size_t part = 0; part < LINE_PARTS; part++) {
+        line_classes.parts[part] = LineClass(pmpool.get_handle(), LINE_PART_MIN << part);
+    }
+    for (size_t lines = 1; lines <= LINE_RECORD_LINES; lines++) {
+        line_classes.records[lines - 1] = LineClass(pmpool.get_handle(), LINE_SIZE * lines);
+    }
+    const size_t leaf_lines = (sizeof(KVLeaf) + LINE_SIZE - 1) / LINE_SIZE;
+    line_classes.leaf = leaf_lines <= LINE_RECORD_LINES ? line_classes.records[leaf_lines - 1]
+                                                        : LineClass(pmpool.get_handle(), LINE_SIZE * leaf_lines);
     Recover();
     LOG("Opened ok");
 }
@@ -75,6 +138,8 @@ void KVTree::Analyze(KVTreeAnalysis& analysis) {
     analysis.leaf_empty = 0;
     analysis.leaf_prealloc = leaves_prealloc.size();
     analysis.leaf_total = 0;
+    analysis.prefix_bytes = 0;
+    analysis.slot_lines = 0;
     analysis.path = pmpath;
 
     // iterate persistent leaves for stats
@@ -82,9 +147,11 @@ void KVTree::Analyze(KVTreeAnalysis& analysis) {
     while (leaf) {
         bool empty = true;
         for (int slot = LEAF_KEYS; slot--;) {
-            if (!leaf->slots[slot].get_rw().empty()) {
+            auto kvslot = leaf->slots[slot].get_ro();
+            if (!kvslot.empty()) {
                 empty = false;
-                break;
+                analysis.prefix_bytes += kvslot.prefixsize();
+                analysis.slot_lines += kvslot.lines();
             }
         }
         if (empty) analysis.leaf_empty++;
@@ -93,16 +160,25 @@ void KVTree::Analyze(KVTreeAnalysis& analysis) {
     }
     LOG("Analyzed ok");
 }
+
+void KVTree::Stats(KVTreeStats& stats) {
+    stats = counters;
+}
 void KVTree::ListAllKeyValuePairs(vector<string>& kv_pairs) {
     LOG("Listing");
     // iterate persistent leaves for stats
     auto leaf = pmpool.get_root()->head;
     while (leaf) {
+        LeafPrefetch(leaf, true);
         for (int slot = LEAF_KEYS; slot--;) {
             auto kvslot = leaf->slots[slot].get_rw();
             if (!kvslot.empty()) {
-              kv_pairs.push_back(string(kvslot.key(), kvslot.keysize()));
-              kv_pairs.push_back(string(kvslot.val(), kvslot.valsize()));
+              string key;
+              kvslot.append_key(leaf->prefix.get(), &key);
+              kv_pairs.push_back(std::move(key));
+              string value;
+              kvslot.append_value(&value);
+              kv_pairs.push_back(std::move(value));
             }
         }
         leaf = leaf->next;  // advance to next linked leaf
@@ -115,10 +191,13 @@ void KVTree::ListAllKeys(vector<string>& keys) {
     // iterate persistent leaves for stats
     auto leaf = pmpool.get_root()->head;
     while (leaf) {
+        LeafPrefetch(leaf, true);
         for (int slot = LEAF_KEYS; slot--;) {
             auto kvslot = leaf->slots[slot].get_rw();
             if (!kvslot.empty()) {
-              keys.push_back(string(kvslot.key(), kvslot.keysize()));
+              string key;
+              kvslot.append_key(leaf->prefix.get(), &key);
+              keys.push_back(std::move(key));
             }
         }
         leaf = leaf->next;  // advance to next linked leaf
@@ -132,6 +211,7 @@ size_t KVTree::TotalNumKeys() {
     // iterate persistent leaves for stats
     auto leaf = pmpool.get_root()->head;
     while (leaf) {
+        LeafPrefetch(leaf, false);                                       // buffers are not read
         for (int slot = LEAF_KEYS; slot--;) {
             auto kvslot = leaf->slots[slot].get_rw();
             if (!kvslot.empty()) {
@@ -146,57 +226,122 @@ size_t KVTree::TotalNumKeys() {
 
 KVStatus KVTree::Get(const int32_t limit, const int32_t keybytes, int32_t* valuebytes,
                      const char* key, char* value) {
-    auto ckey = std::string(key, keybytes);
+    const string_view ckey(key, (size_t) keybytes);
     LOG("Get for key=" << ckey);
+    if (options.stats) counters.gets++;
     auto leafnode = LeafSearch(ckey);
-    if (leafnode) {
-        const uint8_t hash = PearsonHash(key, (size_t) keybytes);
-        for (int slot = LEAF_KEYS; slot--;) {
-            if (leafnode->hashes[slot] == hash) {
-                if (leafnode->keys[slot].compare(ckey) == 0) {
-                    auto kv = leafnode->leaf->slots[slot].get_ro();
-                    auto vs = kv.valsize();
-                    *valuebytes = vs;
-                    if (vs <= limit) {
-                        LOG("   found value, slot=" << slot << ", size=" << to_string(vs));
-                        memcpy(value, kv.val(), vs);
-                        return OK;
-                    } else {
-                        LOG("   buffer too small, slot=" << slot << ", size=" << to_string(vs));
-                        return FAILED;
-                    }
+    if (leafnode && leafnode->has_prefix(ckey)) {
+        const int slot = LeafFindSlot(leafnode, PearsonHash(key, (size_t) keybytes), ckey);
+        if (slot >= 0) {
+            auto kv = leafnode->leaf->slots[slot].get_ro();
+            auto vs = kv.valsize();
+            *valuebytes = vs;
+            if (vs <= limit) {
+                LOG("   found value, slot=" << slot << ", size=" << to_string(vs));
+                if (!kv.copy_value(value)) {
+                    LOG("   could not decompress value, slot=" << slot);
+                    return FAILED;
                 }
+                return OK;
+            } else {
+                LOG("   buffer too small, slot=" << slot << ", size=" << to_string(vs));
+                return FAILED;
             }
         }
     }
     LOG("   could not find key");
+    if (options.stats) counters.get_misses++;
     return NOT_FOUND;
 }
 
 KVStatus KVTree::Get(const string& key, string* value) {
     LOG("Get for key=" << key.c_str());
+    if (options.stats) counters.gets++;
     auto leafnode = LeafSearch(key);
-    if (leafnode) {
-        const uint8_t hash = PearsonHash(key.c_str(), key.size());
-        for (int slot = LEAF_KEYS; slot--;) {
-            if (leafnode->hashes[slot] == hash) {
-                if (leafnode->keys[slot].compare(key) == 0) {
-                    auto kv = leafnode->leaf->slots[slot].get_ro();
-                    LOG("   found value, slot=" << slot << ", size=" << to_string(kv.valsize()));
-                    value->append(kv.val(), kv.valsize());
-                    return OK;
-                }
-            }
+    if (leafnode && leafnode->has_prefix(key)) {
+        const int slot = LeafFindSlot(leafnode, PearsonHash(key.c_str(), key.size()), key);
+        if (slot >= 0) {
+            auto kv = leafnode->leaf->slots[slot].get_ro();
+            LOG("   found value, slot=" << slot << ", size=" << to_string(kv.valsize()));
+            return kv.append_value(value) ? OK : FAILED;
         }
     }
     LOG("   could not find key");
+    if (options.stats) counters.get_misses++;
     return NOT_FOUND;
 }
 
+// Lookups run in groups whose stages are interleaved: the slots of every key in the group are
+// found (prefetching their persistent slot pointers) before any slot pointer is read, and every
+// slot buffer is prefetched before any value is copied, so that persistent memory reads overlap.
+template <typename KeyAt, typename Found>
+void KVTree::MultiGetGroups(const size_t count, KeyAt keyat, Found found) {
+    for (size_t first = 0; first < count; first += MULTIGET_GROUP) {
+        const size_t group = std::min(count - first, (size_t) MULTIGET_GROUP);
+        KVLeafNode* leafnodes[MULTIGET_GROUP];
+        int slots[MULTIGET_GROUP];
+        for (size_t i = 0; i < group; i++) {
+            const string_view key = keyat(first + i);
+            leafnodes[i] = LeafSearch(key);
+            slots[i] = -1;
+            if (leafnodes[i] && leafnodes[i]->has_prefix(key)) {
+                slots[i] = LeafFindSlot(leafnodes[i], PearsonHash(key.data(), key.size()), key);
+            }
+        }
+        for (size_t i = 0; i < group; i++) {
+            if (slots[i] >= 0) leafnodes[i]->leaf->slots[slots[i]].get_ro().prefetch();
+        }
+        for (size_t i = 0; i < group; i++) {
+            if (slots[i] >= 0) found(first + i, leafnodes[i]->leaf->slots[slots[i]].get_ro());
+        }
+        if (options.stats) {
+            counters.gets += group;
+            for (size_t i = 0; i < group; i++) counters.get_misses += slots[i] < 0;
+        }
+    }
+}
+
+void KVTree::MultiGet(const vector<string>& keys, vector<string>* values,
+                      vector<KVStatus>* statuses) {
+    LOG("MultiGet for keys=" << keys.size());
+    values->assign(keys.size(), string());
+    statuses->assign(keys.size(), NOT_FOUND);
+    MultiGetGroups(keys.size(),
+                   [&](size_t i) { return string_view(keys[i]); },
+                   [&](size_t i, const KVSlot& kv) {
+                       (*statuses)[i] = kv.append_value(&(*values)[i]) ? OK : FAILED;
+                   });
+    LOG("MultiGet ok");
+}
+
+void KVTree::MultiGet(const int32_t count, const int32_t* limits, const int32_t* keybytes,
+                      int32_t* valuebytes, const char* const* keys, char* const* values,
+                      KVStatus* statuses) {
+    LOG("MultiGet for keys=" << count);
+    std::fill(statuses, statuses + std::max(count, 0), NOT_FOUND);
+    MultiGetGroups((size_t) std::max(count, 0),
+                   [&](size_t i) { return string_view(keys[i], (size_t) keybytes[i]); },
+                   [&](size_t i, const KVSlot& kv) {
+                       valuebytes[i] = kv.valsize();
+                       statuses[i] = valuebytes[i] <= limits[i] && kv.copy_value(values[i])
+                                     ? OK : FAILED;            // buffer too small or corrupt
+                   });
+    LOG("MultiGet ok");
+}
+
 KVStatus KVTree::Put(const string& key, const string& value) {
-    LOG("Put key=" << key.c_str() << ", value.size=" << to_string(value.size()));
+    return Put((int32_t) key.size(), (int32_t) value.size(), key.data(), value.data());
+}
+
+// Key and value are only read in place, so the value is copied once, into its slot buffer.
+KVStatus KVTree::Put(const int32_t keybytes, const int32_t valuebytes, const char* keydata,
+                     const char* valuedata) {
+    const string_view key(keydata, (size_t) keybytes);
+    const string_view value(valuedata, (size_t) valuebytes);
+    LOG("Put key=" << key << ", value.size=" << to_string(value.size()));
+    if (options.stats) counters.puts++;
     try {
-        const uint8_t hash = PearsonHash(key.c_str(), key.size());
+        const uint8_t hash = PearsonHash(key.data(), key.size());
         auto leafnode = LeafSearch(key);
         if (!leafnode) {
             LOG("   adding head leaf");
@@ -209,15 +354,27 @@ KVStatus KVTree::Put(const string& key, const string& value) {
                 } else {
                     auto root = pmpool.get_root();
                     auto old_head = root->head;
-                    auto new_leaf = make_persistent<KVLeaf>();
+                    auto new_leaf = LeafAllocate();
                     root->head = new_leaf;
                     new_leaf->next = old_head;
                     new_node->leaf = new_leaf;
                 }
+                LeafSetPrefix(new_node.get(), nullptr);
                 LeafFillSpecificSlot(new_node.get(), hash, key, value, 0);
             });
             tree_top = move(new_node);
-        } else if (LeafFillSlotForKey(leafnode, hash, key, value)) {
+            return OK;
+        }
+        if (!leafnode->has_prefix(key)) {
+            size_t common = 0;
+            while (common < leafnode->prefix.size() && common < key.size() &&
+                   leafnode->prefix[common] == key[common]) common++;
+            LOG("   trimming leaf prefix to size=" << common);
+            transaction::exec_tx(pmpool, [&] {
+                LeafTrimPrefix(leafnode, common);
+            });
+        }
+        if (LeafFillSlotForKey(leafnode, hash, key, value)) {
             // nothing else to do
         } else {
             LeafSplitFull(leafnode, hash, key, value);
@@ -231,23 +388,33 @@ KVStatus KVTree::Put(const string& key, const string& value) {
 }
 
 KVStatus KVTree::Remove(const string& key) {
-    LOG("Remove key=" << key.c_str());
+    return Remove((int32_t) key.size(), key.data());
+}
+
+KVStatus KVTree::Remove(const int32_t keybytes, const char* keydata) {
+    const string_view key(keydata, (size_t) keybytes);
+    LOG("Remove key=" << key);
+    if (options.stats) counters.removes++;
     auto leafnode = LeafSearch(key);
     if (!leafnode) {
         LOG("   head not present");
         return OK;
+    } else if (!leafnode->has_prefix(key)) {
+        LOG("   key outside leaf prefix");
+        return OK;
     }
-    const uint8_t hash = PearsonHash(key.c_str(), key.size());
+    const uint8_t hash = PearsonHash(key.data(), key.size());
     for (int slot = LEAF_KEYS; slot--;) {
         if (leafnode->hashes[slot] == hash) {
-            if (leafnode->keys[slot].compare(key) == 0) {
+            if (leafnode->matches(slot, key)) {
                 LOG("   freeing slot=" << slot);
+                try {
+                    leafnode->leaf->slots[slot].get_rw().unpublish(pmpool.get_handle());
+                } catch (pmem::transaction_error) {
+                    return FAILED;
+                }
                 leafnode->hashes[slot] = 0;
                 leafnode->keys[slot].clear();
-                auto leaf = leafnode->leaf;
-                transaction::exec_tx(pmpool, [&] {
-                    leaf->slots[slot].get_rw().clear();
-                });
                 break;  // no duplicate keys allowed
             }
         }
@@ -257,8 +424,20 @@ KVStatus KVTree::Remove(const string& key) {
 
 
 void KVTree::Free() {
-  LOG("Free the tree"); 
-  // TODO impl
+    LOG("Freeing");
+    auto root = pmpool.get_root();
+    transaction::exec_tx(pmpool, [&] {
+        root->freeing = 1;
+    });
+    FreeLeaves();
+    tree_top.reset(nullptr);
+    leaves_prealloc.clear();
+    compaction = {};
+    compact_leaf = nullptr;
+    compact_prev = nullptr;
+    compact_free.clear();
+    compact_sweeping = false;
+    LOG("Freed ok");
 }
 
 
@@ -269,11 +448,16 @@ PMEMobjpool* KVTree::GetPool() {
     return pmpool.get_handle();
 }
 
+bool KVTree::CompressValues(const size_t threshold) {
+    compress_threshold = threshold;
+    return true;
+}
+
 // ===============================================================================================
 // PROTECTED LEAF METHODS
 // ===============================================================================================
 
-KVLeafNode* KVTree::LeafSearch(const string& key) {
+KVLeafNode* KVTree::LeafSearch(const string_view key) {
     KVNode* node = tree_top.get();
     if (node == nullptr) return nullptr;
     bool matched;
@@ -296,8 +480,20 @@ KVLeafNode* KVTree::LeafSearch(const string& key) {
     return (KVLeafNode*) node;
 }
 
+// Returns the slot holding key, or -1 if the leaf has none. The persistent slot is prefetched as
+// soon as its fingerprint matches, so reading the slot pointer overlaps the key compare in DRAM.
+int KVTree::LeafFindSlot(KVLeafNode* leafnode, const uint8_t hash, const string_view key) {
+    for (int slot = LEAF_KEYS; slot--;) {
+        if (leafnode->hashes[slot] == hash) {
+            __builtin_prefetch(&leafnode->leaf->slots[slot]);
+            if (leafnode->matches(slot, key)) return slot;
+        }
+    }
+    return -1;
+}
+
 void KVTree::LeafFillEmptySlot(KVLeafNode* leafnode, const uint8_t hash,
-                               const string& key, const string& value) {
+                               const string_view key, const string_view value) {
     for (int slot = LEAF_KEYS; slot--;) {
         if (leafnode->hashes[slot] == 0) {
             LeafFillSpecificSlot(leafnode, hash, key, value, slot);
@@ -307,7 +503,7 @@ void KVTree::LeafFillEmptySlot(KVLeafNode* leafnode, const uint8_t hash,
 }
 
 bool KVTree::LeafFillSlotForKey(KVLeafNode* leafnode, const uint8_t hash,
-                                const string& key, const string& value) {
+                                const string_view key, const string_view value) {
     // scan for empty/matching slots
     int last_empty_slot = -1;
     int key_match_slot = -1;
@@ -316,7 +512,7 @@ bool KVTree::LeafFillSlotForKey(KVLeafNode* leafnode, const uint8_t hash,
         if (slot_hash == 0) {
             last_empty_slot = slot;
         } else if (slot_hash == hash) {
-            if (leafnode->keys[slot].compare(key) == 0) {
+            if (leafnode->matches(slot, key)) {
                 key_match_slot = slot;
                 break;  // no duplicate keys allowed
             }
@@ -326,38 +522,110 @@ bool KVTree::LeafFillSlotForKey(KVLeafNode* leafnode, const uint8_t hash,
     // update suitable slot if found
     int slot = key_match_slot >= 0 ? key_match_slot : last_empty_slot;
     if (slot >= 0) {
-        LOG("   filling slot=" << slot);
-        transaction::exec_tx(pmpool, [&] {
-            LeafFillSpecificSlot(leafnode, hash, key, value, slot);
-        });
+        LOG("   publishing slot=" << slot);
+        leafnode->leaf->slots[slot].get_rw().publish(pmpool.get_handle(), hash, (uint32_t) leafnode->prefix.size(),
+                                                     key, value, compress_threshold, line_classes);
+        if (leafnode->hashes[slot] == 0) {
+            leafnode->hashes[slot] = hash;
+            leafnode->keys[slot].assign(key, leafnode->prefix.size(), string::npos);
+        }
     }
     return slot >= 0;
 }
 
 void KVTree::LeafFillSpecificSlot(KVLeafNode* leafnode, const uint8_t hash,
-                                  const string& key, const string& value, const int slot) {
+                                  const string_view key, const string_view value, const int slot) {
     if (leafnode->hashes[slot] == 0) {
         leafnode->hashes[slot] = hash;
-        leafnode->keys[slot] = key;
+        leafnode->keys[slot].assign(key, leafnode->prefix.size(), string::npos);
+    }
+    leafnode->leaf->slots[slot].get_rw().set(hash, (uint32_t) leafnode->prefix.size(), key, value,
+                                             compress_threshold, line_classes);
+}
+
+// Leaves elide the prefix common to all of their keys, storing it once in the persistent leaf
+// rather than in every slot buffer. Slots record how many prefix bytes they elide, so the prefix
+// can grow when a split leaves only keys sharing a longer prefix, without rewriting any slots.
+void KVTree::LeafSetPrefix(KVLeafNode* leafnode, const string_view* key) {
+    const char* first = nullptr;                           // suffix other keys are compared to
+    size_t common = 0;                                     // bytes shared beyond current prefix
+    if (key != nullptr) {
+        first = key->data() + leafnode->prefix.size();
+        common = key->size() - leafnode->prefix.size();
+    }
+    for (int slot = LEAF_KEYS; slot--;) {
+        if (leafnode->hashes[slot] == 0) continue;
+        const string& suffix = leafnode->keys[slot];
+        if (first == nullptr) {
+            first = suffix.data();
+            common = suffix.size();
+        } else {
+            size_t idx = 0;
+            while (idx < common && idx < suffix.size() && suffix[idx] == first[idx]) idx++;
+            common = idx;
+        }
+    }
+    string prefix = leafnode->prefix;
+    if (common > 0) prefix.append(first, common);
+
+    auto leaf = leafnode->leaf;
+    if (common == 0 && leaf->prefixsize == prefix.size() &&
+        (prefix.empty() || memcmp(leaf->prefix.get(), prefix.data(), prefix.size()) == 0)) {
+        return;                                            // persistent prefix is unchanged
+    }
+    if (leaf->prefix) delete_persistent<char[]>(leaf->prefix, leaf->prefixsize);
+    leaf->prefix = nullptr;
+    if (!prefix.empty()) {
+        leaf->prefix = make_persistent<char[]>(prefix.size());
+        memcpy(leaf->prefix.get(), prefix.data(), prefix.size());
+    }
+    leaf->prefixsize = (uint32_t) prefix.size();
+    for (int slot = LEAF_KEYS; slot--;) {
+        if (leafnode->hashes[slot] != 0) leafnode->keys[slot].erase(0, common);
+    }
+    leafnode->prefix = move(prefix);
+}
+
+void KVTree::LeafTrimPrefix(KVLeafNode* leafnode, const size_t prefixsize) {
+    auto leaf = leafnode->leaf;
+    for (int slot = LEAF_KEYS; slot--;) {
+        if (leafnode->hashes[slot] == 0) continue;
+        if (leaf->slots[slot].get_ro().prefixsize() > prefixsize) {
+            leaf->slots[slot].get_rw().relocate(leafnode->prefix, (uint32_t) prefixsize, line_classes);
+        }
+    }
+    if (leaf->prefix) delete_persistent<char[]>(leaf->prefix, leaf->prefixsize);
+    leaf->prefix = nullptr;
+    if (prefixsize > 0) {
+        leaf->prefix = make_persistent<char[]>(prefixsize);
+        memcpy(leaf->prefix.get(), leafnode->prefix.data(), prefixsize);
+    }
+    leaf->prefixsize = (uint32_t) prefixsize;
+    for (int slot = LEAF_KEYS; slot--;) {
+        if (leafnode->hashes[slot] != 0) leafnode->keys[slot].insert(0, leafnode->prefix, prefixsize, string::npos);
     }
-    leafnode->leaf->slots[slot].get_rw().set(hash, key, value);
+    leafnode->prefix.resize(prefixsize);
 }
 
 void KVTree::LeafSplitFull(KVLeafNode* leafnode, const uint8_t hash,
-                           const string& key, const string& value) {
-    string keys[LEAF_KEYS + 1];
-    keys[LEAF_KEYS] = key;
+                           const string_view key, const string_view value) {
+    string keys[LEAF_KEYS + 1];                            // keys without leaf prefix
+    keys[LEAF_KEYS].assign(key, leafnode->prefix.size(), string::npos);
     for (int slot = LEAF_KEYS; slot--;) keys[slot] = leafnode->keys[slot];
     std::sort(std::begin(keys), std::end(keys), [](const string& lhs, const string& rhs) {
         return lhs.compare(rhs) < 0;
     });
-    string split_key = keys[LEAF_KEYS_MIDPOINT];
+    const size_t split = std::min(LEAF_KEYS * options.fill / 100, (size_t) LEAF_KEYS - 1);
+    const string& split_suffix = keys[split];                // fill of 50 splits at the midpoint
+    string split_key = leafnode->prefix + split_suffix;
+    if (options.stats) counters.splits++;
     LOG("   splitting leaf at key=" << split_key);
 
     // split leaf into two leaves, moving slots that sort above split key to new leaf
     unique_ptr<KVLeafNode> new_leafnode(new KVLeafNode());
     new_leafnode->parent = leafnode->parent;
     new_leafnode->is_leaf = true;
+    new_leafnode->prefix = leafnode->prefix;               // moved slots keep their prefix
     transaction::exec_tx(pmpool, [&] {
         persistent_ptr<KVLeaf> new_leaf;
         if (!leaves_prealloc.empty()) {
@@ -367,13 +635,13 @@ void KVTree::LeafSplitFull(KVLeafNode* leafnode, const uint8_t hash,
         } else {
             auto root = pmpool.get_root();
             auto old_head = root->head;
-            new_leaf = make_persistent<KVLeaf>();
+            new_leaf = LeafAllocate();
             root->head = new_leaf;
             new_leaf->next = old_head;
             new_leafnode->leaf = new_leaf;
         }
         for (int slot = LEAF_KEYS; slot--;) {
-            if (leafnode->keys[slot].compare(split_key) > 0) {
+            if (leafnode->hashes[slot] != 0 && leafnode->keys[slot].compare(split_suffix) > 0) {
                 new_leaf->slots[slot].swap(leafnode->leaf->slots[slot]);
                 new_leafnode->hashes[slot] = leafnode->hashes[slot];
                 new_leafnode->keys[slot] = leafnode->keys[slot];
@@ -382,6 +650,8 @@ void KVTree::LeafSplitFull(KVLeafNode* leafnode, const uint8_t hash,
             }
         }
         auto target = key.compare(split_key) > 0 ? new_leafnode.get() : leafnode;
+        LeafSetPrefix(leafnode, target == leafnode ? &key : nullptr);
+        LeafSetPrefix(new_leafnode.get(), target == leafnode ? nullptr : &key);
         LeafFillEmptySlot(target, hash, key, value);
     });
 
@@ -389,6 +659,15 @@ void KVTree::LeafSplitFull(KVLeafNode* leafnode, const uint8_t hash,
     InnerUpdateAfterSplit(leafnode, move(new_leafnode), &split_key);
 }
 
+// Leaves are zeroed like make_persistent would, but start on a media line boundary so the slots
+// of a leaf fill whole lines that are shared with no other allocation.
+persistent_ptr<KVLeaf> KVTree::LeafAllocate() {
+    PMEMoid oid = pmemobj_tx_xalloc(sizeof(KVLeaf), pmem::detail::type_num<KVLeaf>(),
+                                    POBJ_XALLOC_ZERO | line_classes.leaf);
+    if (OID_IS_NULL(oid)) throw pmem::transaction_alloc_error("failed to allocate leaf");
+    return persistent_ptr<KVLeaf>(oid);
+}
+
 void KVTree::InnerUpdateAfterSplit(KVNode* node, unique_ptr<KVNode> new_node, string* split_key) {
     if (!node->parent) {
         assert(node == tree_top.get());
@@ -450,6 +729,196 @@ void KVTree::InnerUpdateAfterSplit(KVNode* node, unique_ptr<KVNode> new_node, st
     InnerUpdateAfterSplit(inner, move(ni), &new_split_key);              // recursive update
 }
 
+// ===============================================================================================
+// COMPACTION METHODS
+// ===============================================================================================
+
+bool KVTree::CompactStep() {
+    try {
+        if (compact_leaf == nullptr && !compact_sweeping) {
+            LOG("Starting compaction pass");
+            compaction = {};
+            compact_leaf = LeafFirst();
+        }
+        compaction.steps++;
+        if (compact_leaf != nullptr) {
+            CompactLeaf(compact_leaf);
+            if (compact_leaf == nullptr) {                               // start sweeping leaves
+                compact_sweeping = true;
+                compact_prev = nullptr;
+                for (auto& leaf : leaves_prealloc) compact_free.insert(leaf.raw().off);
+                leaves_prealloc.clear();
+            }
+        } else {
+            CompactSweep();
+            if (!compact_sweeping) {
+                LOG("Compaction pass complete, steps=" << compaction.steps);
+                compaction.complete = true;
+                return false;
+            }
+        }
+        return true;
+    } catch (pmem::transaction_alloc_error) {
+        LOG("Compaction step failed to allocate");
+        return false;
+    } catch (pmem::transaction_error) {
+        LOG("Compaction step failed");
+        return false;
+    }
+}
+
+void KVTree::Compact(const size_t steps_per_second) {
+    LOG("Compacting, steps_per_second=" << steps_per_second);
+    auto interval = std::chrono::microseconds(steps_per_second > 0 ? 1000000 / steps_per_second : 0);
+    auto next_step = std::chrono::steady_clock::now();
+    while (CompactStep()) {
+        if (steps_per_second > 0) {
+            next_step += interval;
+            std::this_thread::sleep_until(next_step);
+        }
+    }
+}
+
+void KVTree::Compaction(KVCompaction& compaction) {
+    compaction = this->compaction;
+}
+
+KVLeafNode* KVTree::LeafFirst() {
+    KVNode* node = tree_top.get();
+    if (node == nullptr) return nullptr;
+    while (!node->is_leaf) node = ((KVInnerNode*) node)->children[0].get();
+    return (KVLeafNode*) node;
+}
+
+KVLeafNode* KVTree::LeafNext(KVNode* node) {
+    while (node->parent) {
+        KVInnerNode* inner = node->parent;
+        int idx = 0;
+        while (inner->children[idx].get() != node) idx++;
+        if (idx < inner->keycount) {
+            node = inner->children[idx + 1].get();
+            while (!node->is_leaf) node = ((KVInnerNode*) node)->children[0].get();
+            return (KVLeafNode*) node;
+        }
+        node = inner;
+    }
+    return nullptr;
+}
+
+void KVTree::CompactLeaf(KVLeafNode* leafnode) {
+    int slots[LEAF_KEYS];                                  // occupied slots in key order
+    int count = 0;
+    for (int slot = 0; slot < LEAF_KEYS; slot++) {
+        if (leafnode->hashes[slot] != 0) slots[count++] = slot;
+    }
+
+    // merge right sibling into this leaf if both are sparse, staying on this leaf afterwards
+    KVInnerNode* inner = leafnode->parent;
+    if (inner != nullptr && inner->keycount > 1) {
+        int idx = 0;
+        while (inner->children[idx].get() != leafnode) idx++;
+        if (idx < inner->keycount && inner->children[idx + 1]->is_leaf) {
+            auto sibling = (KVLeafNode*) inner->children[idx + 1].get();
+            int targets[LEAF_KEYS];                        // destination slot for sibling slots
+            int merged = count;
+            for (int slot = 0, target = 0; slot < LEAF_KEYS; slot++) {
+                if (sibling->hashes[slot] == 0) continue;
+                while (target < LEAF_KEYS && leafnode->hashes[target] != 0) target++;
+                targets[slot] = target++;
+                merged++;
+            }
+            if (merged <= LEAF_KEYS_MERGE) {
+                LOG("   merging leaf with sibling, keys=" << merged);
+                size_t common = 0;                         // prefix shared by both leaves
+                while (common < leafnode->prefix.size() && common < sibling->prefix.size() &&
+                       leafnode->prefix[common] == sibling->prefix[common]) common++;
+                transaction::exec_tx(pmpool, [&] {
+                    if (leafnode->prefix.size() > common) LeafTrimPrefix(leafnode, common);
+                    if (sibling->prefix.size() > common) LeafTrimPrefix(sibling, common);
+                    for (int slot = LEAF_KEYS; slot--;) {
+                        if (sibling->hashes[slot] == 0) continue;
+                        leafnode->leaf->slots[targets[slot]].swap(sibling->leaf->slots[slot]);
+                    }
+                });
+                for (int slot = LEAF_KEYS; slot--;) {
+                    if (sibling->hashes[slot] == 0) continue;
+                    leafnode->hashes[targets[slot]] = sibling->hashes[slot];
+                    leafnode->keys[targets[slot]] = move(sibling->keys[slot]);
+                }
+                leaves_prealloc.push_back(sibling->leaf);  // swept & freed after merging
+                const uint8_t keycount = inner->keycount;
+                for (int i = idx + 1; i < keycount; i++) inner->keys[i - 1] = move(inner->keys[i]);
+                for (int i = idx + 2; i <= keycount; i++) inner->children[i - 1] = move(inner->children[i]);
+                inner->keys[keycount - 1].clear();
+                inner->children[keycount].reset();         // deletes sibling if still present
+                inner->keycount = (uint8_t) (keycount - 1);
+#ifndef NDEBUG
+                inner->assert_invariants();
+#endif
+                compaction.leaves_merged++;
+                return;
+            }
+        }
+    }
+
+    // move leaf and its slot buffers to fresh allocations, with buffers allocated in key order
+    if (count > 0) {
+        std::sort(slots, slots + count, [&](const int lhs, const int rhs) {
+            return leafnode->keys[lhs].compare(leafnode->keys[rhs]) < 0;
+        });
+        auto old_leaf = leafnode->leaf;
+        persistent_ptr<KVLeaf> new_leaf;
+        size_t bytes = 0;
+        transaction::exec_tx(pmpool, [&] {
+            auto root = pmpool.get_root();
+            new_leaf = LeafAllocate();
+            new_leaf->next = root->head;
+            root->head = new_leaf;
+            for (int i = 0; i < count; i++) {
+                new_leaf->slots[slots[i]].swap(old_leaf->slots[slots[i]]);
+                bytes += new_leaf->slots[slots[i]].get_rw().relocate(leafnode->prefix,
+                                                                     (uint32_t) leafnode->prefix.size(),
+                                                                     line_classes);
+            }
+            new_leaf->prefix = old_leaf->prefix;                         // slots now elide all of it
+            new_leaf->prefixsize = old_leaf->prefixsize;
+            old_leaf->prefix = nullptr;
+            old_leaf->prefixsize = 0;
+        });
+        leafnode->leaf = new_leaf;
+        leaves_prealloc.push_back(old_leaf);               // swept & freed after relocating
+        compaction.leaves_relocated++;
+        compaction.slots_relocated += count;
+        compaction.bytes_relocated += bytes;
+    }
+    compact_leaf = LeafNext(leafnode);
+}
+
+void KVTree::CompactSweep() {
+    auto root = pmpool.get_root();
+    auto leaf = compact_prev ? compact_prev->next : root->head;
+    if (!leaf) {
+        compact_sweeping = false;                          // reached end of persistent list
+        compact_free.clear();
+        return;
+    }
+    if (compact_free.erase(leaf.raw().off) == 0) {
+        compact_prev = leaf;                               // keep leaf that is still in use
+        return;
+    }
+    LOG("   freeing empty leaf");
+    transaction::exec_tx(pmpool, [&] {
+        if (compact_prev) {
+            compact_prev->next = leaf->next;
+        } else {
+            root->head = leaf->next;
+        }
+        if (leaf->prefix) delete_persistent<char[]>(leaf->prefix, leaf->prefixsize);
+        delete_persistent<KVLeaf>(leaf);
+    });
+    compaction.leaves_freed++;
+}
+
 // ===============================================================================================
 // PROTECTED LIFECYCLE METHODS
 // ===============================================================================================
@@ -457,40 +926,36 @@ void KVTree::InnerUpdateAfterSplit(KVNode* node, unique_ptr<KVNode> new_node, st
 void KVTree::Recover() {
     LOG("Recovering");
 
-    // traverse persistent leaves to build list of leaves to recover
-    std::list<KVRecoveredLeaf> leaves;
-    auto leaf = pmpool.get_root()->head;
-    while (leaf) {
-        unique_ptr<KVLeafNode> leafnode(new KVLeafNode());
-        leafnode->leaf = leaf;
-        leafnode->is_leaf = true;
+    // finish freeing leaves if interrupted by a crash
+    if (pmpool.get_root()->freeing) FreeLeaves();
 
-        // find highest sorting key in leaf, while recovering all hashes
-        bool empty_leaf = true;
-        string max_key;
-        for (int slot = LEAF_KEYS; slot--;) {
-            auto kvslot = leaf->slots[slot].get_ro();
-            if (kvslot.empty()) continue;
-            leafnode->hashes[slot] = kvslot.hash();
-            if (leafnode->hashes[slot] == 0) continue;
-            const char* key = kvslot.key();
-            if (empty_leaf) {
-                max_key = string(kvslot.key(), kvslot.get_ks());
-                empty_leaf = false;
-            } else if (max_key.compare(0, string::npos, kvslot.key(), kvslot.get_ks()) < 0) {
-                max_key = string(kvslot.key(), kvslot.get_ks());
-            }
-            leafnode->keys[slot] = string(key, kvslot.get_ks());
+    // traverse persistent leaves, then read their slots from several threads if configured
+    vector<persistent_ptr<KVLeaf>> persistent;
+    for (auto leaf = pmpool.get_root()->head; leaf; leaf = leaf->next) persistent.push_back(leaf);
+    vector<KVRecoveredLeaf> recovered(persistent.size());
+    const size_t threads = std::max(std::min(options.recovery_threads, persistent.size()), (size_t) 1);
+    const size_t chunk = (persistent.size() + threads - 1) / threads;
+    auto recover = [&](const size_t begin, const size_t end) {
+        for (size_t i = begin; i < end; i++) recovered[i] = RecoverLeaf(persistent[i]);
+    };
+    if (threads == 1) {
+        recover(0, persistent.size());
+    } else {
+        vector<std::thread> workers;
+        for (size_t begin = 0; begin < persistent.size(); begin += chunk) {
+            workers.emplace_back(recover, begin, std::min(begin + chunk, persistent.size()));
         }
+        for (auto& worker : workers) worker.join();
+    }
 
-        // use highest sorting key to decide how to recover the leaf
-        if (empty_leaf) {
-            leaves_prealloc.push_back(leaf);
+    // use highest sorting key to decide how to recover each leaf
+    std::list<KVRecoveredLeaf> leaves;
+    for (size_t i = 0; i < recovered.size(); i++) {
+        if (recovered[i].leafnode) {
+            leaves.push_back(move(recovered[i]));
         } else {
-            leaves.push_back({move(leafnode), max_key});
+            leaves_prealloc.push_back(persistent[i]);
         }
-
-        leaf = leaf->next;  // advance to next linked leaf
     }
 
     // sort recovered leaves in ascending key order
@@ -521,6 +986,59 @@ void KVTree::Recover() {
     LOG("Recovered ok");
 }
 
+// Rebuilds the volatile node of a persistent leaf along with its highest sorting key, leaving
+// the node empty when the leaf holds no keys. Only reads the pool, so leaves may be recovered
+// from several threads at once.
+KVRecoveredLeaf KVTree::RecoverLeaf(persistent_ptr<KVLeaf> leaf) {
+    unique_ptr<KVLeafNode> leafnode(new KVLeafNode());
+    leafnode->leaf = leaf;
+    leafnode->is_leaf = true;
+    if (leaf->prefixsize > 0) leafnode->prefix.assign(leaf->prefix.get(), leaf->prefixsize);
+
+    // find highest sorting key in leaf, while recovering all hashes
+    bool empty_leaf = true;
+    string max_key;
+    for (int slot = LEAF_KEYS; slot--;) {
+        auto kvslot = leaf->slots[slot].get_ro();
+        if (kvslot.empty()) continue;
+        leafnode->hashes[slot] = kvslot.hash();
+        if (leafnode->hashes[slot] == 0) continue;
+        const size_t elided = leafnode->prefix.size() - kvslot.prefixsize();  // stored by slot
+        leafnode->keys[slot] = string(kvslot.key() + elided, kvslot.get_ks() - elided);
+        if (empty_leaf) {
+            max_key = leafnode->keys[slot];
+            empty_leaf = false;
+        } else if (max_key.compare(leafnode->keys[slot]) < 0) {
+            max_key = leafnode->keys[slot];
+        }
+    }
+    if (empty_leaf) return {nullptr, string()};
+    max_key.insert(0, leafnode->prefix);
+    return {move(leafnode), max_key};
+}
+
+void KVTree::FreeLeaves() {
+    LOG("Freeing leaves");
+    auto root = pmpool.get_root();
+    while (root->head) {
+        transaction::exec_tx(pmpool, [&] {                               // unlink & free batch
+            auto leaf = root->head;
+            for (int count = FREE_BATCH_LEAVES; leaf && count--;) {
+                for (int slot = LEAF_KEYS; slot--;) leaf->slots[slot].get_ro().release();
+                if (leaf->prefix) delete_persistent<char[]>(leaf->prefix, leaf->prefixsize);
+                auto next = leaf->next;
+                delete_persistent<KVLeaf>(leaf);
+                leaf = next;
+            }
+            root->head = leaf;
+        });
+    }
+    transaction::exec_tx(pmpool, [&] {
+        root->freeing = 0;
+    });
+    LOG("Freed leaves ok");
+}
+
 // ===============================================================================================
 // PEARSON HASH METHODS
 // ===============================================================================================
@@ -561,6 +1079,42 @@ uint8_t KVTree::PearsonHash(const char* data, const size_t size) {
 // SLOT CLASS METHODS
 // ===============================================================================================
 
+// Compressed values are stored as their raw size followed by an LZ block, and are flagged in the
+// value size. Values are left uncompressed when below the threshold or when compression would not
+// save at least 1/VALUE_MIN_SAVING of their size, so incompressible values are never penalized.
+static string_view EncodeValue(const string_view value, const size_t threshold, uint32_t* vs) {
+    *vs = (uint32_t) value.size();
+    if (threshold == 0 || value.size() < threshold || value.size() < VALUE_MIN_SAVING * sizeof(uint32_t)) {
+        return value;
+    }
+    static thread_local string scratch;                                     // reused between puts
+    const size_t capacity = value.size() - value.size() / VALUE_MIN_SAVING - sizeof(uint32_t);
+    scratch.resize(sizeof(uint32_t) + capacity);
+    size_t compressed = codec::LZCompress(value.data(), value.size(), &scratch[sizeof(uint32_t)], capacity);
+    if (compressed == 0) return value;                                      // not worth compressing
+    *((uint32_t*) &scratch[0]) = (uint32_t) value.size();
+    scratch.resize(sizeof(uint32_t) + compressed);
+    *vs = (uint32_t) scratch.size() | VALUE_COMPRESSED;
+    return scratch;
+}
+
+bool KVSlot::copy_value(char* dest) const {
+    if (!compressed()) {
+        memcpy(dest, val(), get_vs());
+        return true;
+    }
+    const size_t stored = (get_vs() & ~VALUE_COMPRESSED) - sizeof(uint32_t);
+    return codec::LZDecompress(val() + sizeof(uint32_t), stored, dest, valsize());
+}
+
+bool KVSlot::append_value(string* value) const {
+    const size_t start = value->size();
+    value->resize(start + valsize());
+    if (copy_value(&(*value)[start])) return true;
+    value->resize(start);                                                   // drop partial value
+    return false;
+}
+
 bool KVSlot::empty() {
     if (kv)
         return false;
@@ -568,38 +1122,158 @@ bool KVSlot::empty() {
         return true;
 }
 
+// Buffers that fit a few media lines take whole, aligned lines of their own; larger buffers span
+// many lines anyway and are left to the default allocation classes.
+static persistent_ptr<char[]> SlotAllocate(const size_t size, const KVLineClasses& classes) {
+    PMEMoid oid = pmemobj_tx_xalloc(size, 0, classes.record(size));
+    if (OID_IS_NULL(oid)) throw pmem::transaction_alloc_error("failed to allocate slot");
+    return persistent_ptr<char[]>(oid);
+}
+
+size_t KVSlot::lines() const {
+    if (!kv) return 0;
+    char* p = kv.get();
+    const uintptr_t first = (uintptr_t) p / LINE_SIZE;
+    const uintptr_t last = ((uintptr_t) p + bufsize_direct(p) - 1) / LINE_SIZE;
+    return last - first + 1;
+}
+
+// Slot buffers start on a media line, which holds the hash, sizes and key of the slot, and the
+// whole record when it is small.
+void KVSlot::prefetch() const {
+    if (kv) Prefetch(kv.get(), LINE_SIZE);
+}
+
+void KVSlot::append_key(const char* prefix, string* key) const {
+    if (get_pl() > 0) key->append(prefix, get_pl());
+    key->append(this->key(), get_ks());
+}
+
+// Moves the buffer to a new allocation that elides prefixsize bytes of the key, where prefix is
+// the current prefix of the leaf. Bytes no longer elided are copied back from the leaf prefix.
+size_t KVSlot::relocate(const string& prefix, const uint32_t prefixsize, const KVLineClasses& classes) {
+    if (!kv) return 0;
+    char* p = kv.get();
+    const uint32_t pl = get_pl_direct(p);
+    const uint32_t ks = get_ks_direct(p);
+    const uint32_t moved_ks = ks + pl - prefixsize;
+    size_t size = bufsize_direct(p) - ks + moved_ks;
+    auto moved = SlotAllocate(size, classes);
+    char* m = moved.get();
+    const size_t header = key_direct(p) - p;
+    memcpy(m, p, header);                                                   // copy hash & sizes
+    set_ks_direct(m, moved_ks);
+    set_pl_direct(m, prefixsize);
+    char* kvptr = m + header;
+    if (prefixsize < pl) {
+        memcpy(kvptr, prefix.data() + prefixsize, pl - prefixsize);         // restore prefix bytes
+        memcpy(kvptr + pl - prefixsize, key_direct(p), ks);
+    } else {
+        memcpy(kvptr, key_direct(p) + prefixsize - pl, moved_ks);           // drop prefix bytes
+    }
+    memcpy(kvptr + moved_ks, key_direct(p) + ks, size - (kvptr + moved_ks - m));  // copy value
+    delete_persistent<char[]>(kv, bufsize_direct(p));
+    kv = moved;
+    return size;
+}
+
+void KVSlot::release() const {
+    if (kv) {
+        char* p = kv.get();
+        delete_persistent<char[]>(kv, bufsize_direct(p));
+    }
+}
+
 void KVSlot::clear() {
     if (kv) {
         char* p = kv.get();
+        size_t size = bufsize_direct(p);
         set_ph_direct(p, 0);
         set_ks_direct(p, 0);
         set_vs_direct(p, 0);
-        delete_persistent<char[]>(kv, sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks_direct(p) +
-                                      get_vs_direct(p) + 2);
+        delete_persistent<char[]>(kv, size);
         kv = nullptr;
     }
 }
 
-void KVSlot::set(const uint8_t hash, const string& key, const string& value) {
+void KVSlot::set(const uint8_t hash, const uint32_t prefixsize, const string_view key,
+                 const string_view value, const size_t compress_threshold, const KVLineClasses& classes) {
     if (kv) {
         char* p = kv.get();
-        delete_persistent<char[]>(kv, sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks_direct(p) +
-                                      get_vs_direct(p) + 2);
+        delete_persistent<char[]>(kv, bufsize_direct(p));
     }
+    uint32_t vs;
+    const string_view stored = EncodeValue(value, compress_threshold, &vs);
     size_t ksize;
     size_t vsize;
-    ksize = key.size();
-    vsize = value.size();
-    size_t size = ksize + vsize + 2 + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
-    kv = make_persistent<char[]>(size);
+    ksize = key.size() - prefixsize;
+    vsize = stored.size();
+    size_t size = ksize + vsize + 2 + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
+    kv = SlotAllocate(size, classes);
     char* p = kv.get();
     set_ph_direct(p, hash);
     set_ks_direct(p, (uint32_t) ksize);
-    set_vs_direct(p, (uint32_t) vsize);
-    char* kvptr = p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
-    memcpy(kvptr, key.data(), ksize);                                       // copy key into buffer
+    set_vs_direct(p, vs);
+    set_pl_direct(p, prefixsize);
+    char* kvptr = p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
+    memcpy(kvptr, key.data() + prefixsize, ksize);                          // copy key into buffer
     kvptr += ksize + 1;                                                     // advance ptr past key
-    memcpy(kvptr, value.data(), vsize);                                     // copy value into buffer
+    memcpy(kvptr, stored.data(), vsize);                                    // copy value into buffer
+}
+
+// Writes the new buffer into a reservation that is not yet part of the heap, persists it, and
+// then swaps the slot pointer and frees the old buffer in a single redo-logged publish. This
+// avoids the undo log snapshot and the extra commit fences of a transaction, while a crash before
+// the publish still leaves the old buffer in place and the reservation unallocated.
+void KVSlot::publish(PMEMobjpool* pop, const uint8_t hash, const uint32_t prefixsize, const string_view key,
+                     const string_view value, const size_t compress_threshold, const KVLineClasses& classes) {
+    struct pobj_action actions[PUBLISH_ACTIONS];
+    size_t count = 0;
+    uint32_t vs;
+    const string_view stored = EncodeValue(value, compress_threshold, &vs);
+    size_t ksize = key.size() - prefixsize;
+    size_t vsize = stored.size();
+    size_t size = ksize + vsize + 2 + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
+    PMEMoid reserved = pmemobj_xreserve(pop, &actions[count++], size, 0, classes.record(size));
+    if (OID_IS_NULL(reserved)) throw pmem::transaction_alloc_error("failed to reserve slot");
+    char* p = (char*) pmemobj_direct(reserved);
+    set_ph_direct(p, hash);
+    set_ks_direct(p, (uint32_t) ksize);
+    set_vs_direct(p, vs);
+    set_pl_direct(p, prefixsize);
+    char* kvptr = p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
+    memcpy(kvptr, key.data() + prefixsize, ksize);                          // copy key into buffer
+    kvptr[ksize] = 0;                                                       // terminate key
+    kvptr += ksize + 1;                                                     // advance ptr past key
+    memcpy(kvptr, stored.data(), vsize);                                    // copy value into buffer
+    kvptr[vsize] = 0;                                                       // terminate value
+    pmemobj_persist(pop, p, size);                                          // only fence before publish
+
+    PMEMoid* oid = kv.raw_ptr();
+    if (kv) pmemobj_defer_free(pop, *oid, &actions[count++]);              // old buffer freed on publish
+    if (oid->pool_uuid_lo != reserved.pool_uuid_lo) {
+        pmemobj_set_value(pop, &actions[count++], &oid->pool_uuid_lo, reserved.pool_uuid_lo);
+    }
+    pmemobj_set_value(pop, &actions[count++], &oid->off, reserved.off);
+    assert(count <= PUBLISH_ACTIONS);
+    if (pmemobj_publish(pop, actions, count) != 0) {
+        pmemobj_cancel(pop, actions, count);
+        throw pmem::transaction_alloc_error("failed to publish slot");
+    }
+}
+
+void KVSlot::unpublish(PMEMobjpool* pop) {
+    if (kv) {
+        struct pobj_action actions[PUBLISH_ACTIONS];
+        size_t count = 0;
+        PMEMoid* oid = kv.raw_ptr();
+        pmemobj_defer_free(pop, *oid, &actions[count++]);
+        pmemobj_set_value(pop, &actions[count++], &oid->off, 0);            // slot becomes empty
+        if (pmemobj_publish(pop, actions, count) != 0) {
+            pmemobj_cancel(pop, actions, count);
+            throw pmem::transaction_error("failed to unpublish slot");
+        }
+    }
 }
 
 // ===============================================================================================
@@ -617,5 +1291,20 @@ void KVInnerNode::assert_invariants() {
         assert(children[i] == nullptr);
 }
 
+static KVEngine* Open(const string& path, const size_t size, const string& layout, const KVConfig& config) {
+    KVTreeOptions options;
+    if (!ConfigOnly(config, {"recovery_threads", "fill", "stats"}) ||
+        !ConfigSize(config, "recovery_threads", &options.recovery_threads) ||
+        !ConfigSize(config, "fill", &options.fill) || !ConfigFlag(config, "stats", &options.stats)) {
+        return nullptr;
+    }
+    if (options.fill < 1 || options.fill > 100) return nullptr;
+    options.recovery_threads = std::min(options.recovery_threads,   // no more than cores
+                                        (size_t) std::max(std::thread::hardware_concurrency(), 1u));
+    return new KVTree(path, size, layout, options);
+}
+
+static const bool registered = KVEngineRegistry::Register(ENGINE, Open);
+
 } // namespace kvtree
 } // namespace pmemkv
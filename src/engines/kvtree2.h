@@ -32,10 +32,13 @@
 
 #pragma once
 
+#include <cstring>
+#include <unordered_set>
 #include <vector>
 #include "../pmemkv.h"
 
 using std::move;
+using std::string_view;
 using std::unique_ptr;
 using std::vector;
 using pmem::obj::p;
@@ -56,45 +59,98 @@ const string ENGINE = "kvtree2";                           // engine identifier
 #define INNER_KEYS_UPPER ((INNER_KEYS / 2) + 1)            // index where upper half of keys begins
 #define LEAF_KEYS 48                                       // maximum keys in tree nodes
 #define LEAF_KEYS_MIDPOINT (LEAF_KEYS / 2)                 // halfway point within the node
+#define LEAF_KEYS_MERGE ((LEAF_KEYS * 3) / 4)              // max keys after merging sibling leaves
+#define FREE_BATCH_LEAVES 64                               // leaves freed per transaction
+#define VALUE_COMPRESSED 0x80000000u                       // value size flag for compressed values
+#define VALUE_MIN_SAVING 8                                 // compress only when saving 1/8 or more
+#define PUBLISH_ACTIONS (1 + 1 + 2)                        // reserve, defer free & set uuid/offset
+#define LINE_SIZE 256                                      // media line size of persistent memory
+#define LINE_RECORD_LINES 4                                // most lines of a line-aligned buffer
+#define LINE_RECORD_MAX (LINE_SIZE * LINE_RECORD_LINES)    // largest slot buffer kept line-aligned
+#define LINE_PART_MIN 64                                   // smallest unit for buffers within a line
+#define LINE_PARTS 2                                       // sub-line units of 64 & 128 bytes
+#define CACHE_LINE_SIZE 64                                 // granularity of prefetches
+#define MULTIGET_GROUP 8                                   // lookups interleaved by MultiGet
+#define KVTREE_LAYOUT 0x6b76747265653201ull                // "kvtree2" magic & persistent layout 1
+
+struct KVLineClasses {                                     // allocation classes aligned to lines
+    uint64_t leaf = 0;                                     // flags for leaf allocations
+    uint64_t parts[LINE_PARTS] = {};                       // flags for buffers of 64 & 128 bytes
+    uint64_t records[LINE_RECORD_LINES] = {};              // flags for buffers of 1, 2.. lines
+    uint64_t record(size_t size) const {                   // flags for buffer of size bytes
+        if (size == 0 || size > LINE_RECORD_MAX) return 0;
+        if (size <= LINE_PART_MIN) return parts[0];
+        if (size <= LINE_PART_MIN * 2) return parts[1];
+        return records[(size - 1) / LINE_SIZE];
+    }
+};
 
 class KVSlot {
   public:
     uint8_t hash() const { return get_ph(); }
-    uint8_t hash_direct(char *p) const { return *((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))); }
-    const char* key() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
-    const char* key_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
+    uint8_t hash_direct(char *p) const { return *((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t))); }
+    const char* key() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
+    const char* key_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
     const uint32_t keysize() const { return get_ks(); }
     const uint32_t keysize_direct(char *p) const { return *((uint32_t *)(p)); }
-    const char* val() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks() + 1); }
-    const char* val_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + *((uint32_t *)(p)) + 1); }
-    const uint32_t valsize() const { return get_vs(); }
+    const uint32_t prefixsize() const { return get_pl(); }
+    const char* val() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks() + 1); }
+    const char* val_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + *((uint32_t *)(p)) + 1); }
+    const uint32_t valsize() const { uint32_t vs = get_vs(); if (compressed()) memcpy(&vs, val(), sizeof(vs)); return vs; }
     const uint32_t valsize_direct(char *p) const { return *((uint32_t *)(p + sizeof(uint32_t))); }
     void clear();
-    void set(const uint8_t hash, const string& key, const string& value);
-    void set_ph(uint8_t v) {*((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
-    void set_ph_direct(char *p, uint8_t v) {*((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
+    void set(const uint8_t hash, uint32_t prefixsize,      // key bytes before prefixsize are
+             string_view key, string_view value,           // stored by leaf and not in slot
+             size_t compress_threshold, const KVLineClasses& classes);
+    void publish(PMEMobjpool* pop, const uint8_t hash,     // set without transaction
+                 uint32_t prefixsize, string_view key,
+                 string_view value, size_t compress_threshold,
+                 const KVLineClasses& classes);
+    void unpublish(PMEMobjpool* pop);                      // clear without transaction
+    void set_ph(uint8_t v) {*((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
+    void set_ph_direct(char *p, uint8_t v) {*((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
     void set_ks(uint32_t v) {*((uint32_t *)(kv.get())) = v;}
     void set_ks_direct(char * p, uint32_t v) {*((uint32_t *)(p)) = v;}
     void set_vs(uint32_t v) {*((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t))) = v;}
     void set_vs_direct(char *p, uint32_t v) {*((uint32_t *)((char *)(p) + sizeof(uint32_t))) = v;}
-    uint8_t get_ph() const {return *((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t)));}
-    uint8_t get_ph_direct(char *p) const {return *((uint8_t *)((char *)(p) + sizeof(uint32_t) + sizeof(uint32_t)));}
+    void set_pl_direct(char *p, uint32_t v) {*((uint32_t *)((char *)(p) + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
+    uint8_t get_ph() const {return *((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t)));}
+    uint8_t get_ph_direct(char *p) const {return *((uint8_t *)((char *)(p) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t)));}
     uint32_t get_ks() const {return *((uint32_t *)(kv.get()));}
     uint32_t get_ks_direct(char *p) const {return *((uint32_t *)(p));}
     uint32_t get_vs() const {return *((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t)));}
     uint32_t get_vs_direct(char *p) const {return *((uint32_t *)((char *)(p) + sizeof(uint32_t)));}
+    uint32_t get_pl() const {return *((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t)));}
+    uint32_t get_pl_direct(char *p) const {return *((uint32_t *)((char *)(p) + sizeof(uint32_t) + sizeof(uint32_t)));}
+    size_t bufsize_direct(char *p) const { return sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks_direct(p) + (get_vs_direct(p) & ~VALUE_COMPRESSED) + 2; }
+    bool compressed() const { return (get_vs() & VALUE_COMPRESSED) != 0; }
+    bool copy_value(char* dest) const;                     // copy or decompress value to buffer
+    bool append_value(string* value) const;                // append decompressed value to string
+    void append_key(const char* prefix,                    // append full key, using stored
+                    string* key) const;                    // prefix of leaf
     bool empty();
+    size_t relocate(const string& prefix,                  // move buffer to new allocation,
+                    uint32_t prefixsize,                   // eliding prefixsize bytes of key
+                    const KVLineClasses& classes);
+    size_t lines() const;                                  // media lines spanned by buffer
+    void prefetch() const;                                 // prefetch first line of buffer
+    void release() const;                                  // free buffer of leaf being freed
   private:
     persistent_ptr<char[]> kv;                             // buffer for key & value
 };
 
-struct KVLeaf {
-    p<KVSlot> slots[LEAF_KEYS];                            // array of slot containers
+struct KVLeaf {                                            // allocated on media line boundary
+    p<KVSlot> slots[LEAF_KEYS];                            // array of slot containers, first so
+                                                           // that no slot straddles two lines
     persistent_ptr<KVLeaf> next;                           // next leaf in unsorted list
+    persistent_ptr<char[]> prefix;                         // key prefix shared by all slots
+    p<uint32_t> prefixsize;                                // length of shared key prefix
 };
 
 struct KVRoot {                                            // persistent root object
     persistent_ptr<KVLeaf> head;                           // head of linked list of leaves
+    p<uint8_t> freeing;                                    // set while Free is in progress
+    p<uint64_t> layout;                                    // KVTREE_LAYOUT, zero in older pools
 };
 
 struct KVInnerNode;
@@ -114,8 +170,15 @@ struct KVInnerNode final : KVNode {                        // volatile inner nod
 
 struct KVLeafNode final : KVNode {                         // volatile leaf nodes of the tree
     uint8_t hashes[LEAF_KEYS];                             // Pearson hashes of keys
-    string keys[LEAF_KEYS];                                // keys stored in this leaf
+    string keys[LEAF_KEYS];                                // keys stored in this leaf, w/o prefix
+    string prefix;                                         // prefix shared by all keys in leaf
     persistent_ptr<KVLeaf> leaf;                           // pointer to persistent leaf
+    bool has_prefix(string_view key) const {               // true if key can be in this leaf
+        return key.compare(0, prefix.size(), prefix) == 0;
+    }
+    bool matches(const int slot, string_view key) const {  // compare key having leaf prefix
+        return keys[slot].compare(0, string::npos, key, prefix.size(), string::npos) == 0;
+    }
 };
 
 struct KVRecoveredLeaf {                                   // temporary wrapper used for recovery
@@ -127,13 +190,40 @@ struct KVTreeAnalysis {                                    // tree analysis stru
     size_t leaf_empty;                                     // count of persisted leaves w/o keys
     size_t leaf_prealloc;                                  // count of persisted but unused leaves
     size_t leaf_total;                                     // count of all persisted leaves
+    size_t prefix_bytes;                                   // key bytes elided by leaf prefixes
+    size_t slot_lines;                                     // media lines spanned by slot buffers
     string path;                                           // path when constructed
 };
 
+struct KVTreeOptions {                                     // options chosen when opening
+    size_t recovery_threads = 1;                           // threads reading leaves on recovery
+    size_t fill = 50;                                      // percent of keys kept by split leaf
+    bool stats = false;                                    // count operations for Stats
+};
+
+struct KVTreeStats {                                       // operations counted since open
+    size_t gets;                                           // lookups, including MultiGet keys
+    size_t get_misses;                                     // lookups of keys not found
+    size_t puts;                                           // keys written
+    size_t removes;                                        // keys removed
+    size_t splits;                                         // leaves split by puts
+};
+
+struct KVCompaction {                                      // compaction progress & stats
+    size_t steps;                                          // steps run in current pass
+    size_t leaves_merged;                                  // sparse leaves merged into siblings
+    size_t leaves_relocated;                               // leaves moved to new allocations
+    size_t leaves_freed;                                   // empty leaves returned to the pool
+    size_t slots_relocated;                                // slot buffers moved in key order
+    size_t bytes_relocated;                                // total size of moved slot buffers
+    bool complete;                                         // true when pass has finished
+};
+
 class KVTree : public KVEngine {                           // hybrid B+ tree engine
   public:
 
-    KVTree(const string& path, const size_t size, const string layout);
+    KVTree(const string& path, const size_t size, const string layout,
+           const KVTreeOptions& options = KVTreeOptions());
     // KVTree(const string& path, size_t size);               // default constructor
     ~KVTree();                                             // default destructor
 
@@ -147,14 +237,36 @@ class KVTree : public KVEngine {                           // hybrid B+ tree eng
                  string* value) final;
     KVStatus Put(const string& key,                        // copy value from std::string
                  const string& value) final;
+    KVStatus Put(int32_t keybytes,                         // copy value from buffer
+                 int32_t valuebytes,
+                 const char* key,
+                 const char* value) final;
     KVStatus Remove(const string& key) final;              // remove value for key
+    KVStatus Remove(int32_t keybytes,                      // remove value for key in buffer
+                    const char* key) final;
+    void MultiGet(const vector<string>& keys,              // get values for several keys,
+                  vector<string>* values,                  // interleaving lookups in groups
+                  vector<KVStatus>* statuses) final;
+    void MultiGet(int32_t count,                           // get values for several keys
+                  const int32_t* limits,                   // into caller buffers,
+                  const int32_t* keybytes,                 // interleaving lookups in groups
+                  int32_t* valuebytes,
+                  const char* const* keys,
+                  char* const* values,
+                  KVStatus* statuses) final;
 
     void Free() final;
 
     PMEMoid GetRootOid() final;
     PMEMobjpool* GetPool() final;
+    bool CompressValues(size_t threshold) final;          // compress values this large or larger
 
     void Analyze(KVTreeAnalysis& analysis);                // report on internal state & stats
+    void Stats(KVTreeStats& stats);                        // report operations counted if enabled
+
+    bool CompactStep();                                    // run one bounded compaction step
+    void Compact(size_t steps_per_second);                 // run compaction pass w/ rate limit
+    void Compaction(KVCompaction& compaction);             // report compaction progress
 
     void ListAllKeyValuePairs(vector<string>& kv_pairs) final;      // list all the key value pairs
 
@@ -163,30 +275,48 @@ class KVTree : public KVEngine {                           // hybrid B+ tree eng
     size_t TotalNumKeys() final;
 
   protected:
-    KVLeafNode* LeafSearch(const string& key);             // find node for key
+    KVLeafNode* LeafSearch(string_view key);               // find node for key
+    int LeafFindSlot(KVLeafNode* leafnode,                 // find slot for key, -1 if missing
+                     uint8_t hash,
+                     string_view key);
+    template <typename KeyAt, typename Found>
+    void MultiGetGroups(size_t count,                      // interleave lookups of keyat(i),
+                        KeyAt keyat,                       // calling found(i, slot) for every
+                        Found found);                      // key found, NOT_FOUND otherwise
     void LeafFillEmptySlot(KVLeafNode* leafnode,           // write first unoccupied slot found
                            uint8_t hash,
-                           const string& key,
-                           const string& value);
+                           string_view key,
+                           string_view value);
     bool LeafFillSlotForKey(KVLeafNode* leafnode,          // write slot for matching key if found
                             uint8_t hash,
-                            const string& key,
-                            const string& value);
+                            string_view key,
+                            string_view value);
     void LeafFillSpecificSlot(KVLeafNode* leafnode,        // write slot at specific index
                               uint8_t hash,
-                              const string& key,
-                              const string& value,
+                              string_view key,
+                              string_view value,
                               int slot);
+    void LeafSetPrefix(KVLeafNode* leafnode,               // extend leaf prefix to common prefix
+                       const string_view* key);            // of its keys (and key if given)
+    void LeafTrimPrefix(KVLeafNode* leafnode,              // shorten leaf prefix, moving elided
+                        size_t prefixsize);                // bytes back into affected slots
     void LeafSplitFull(KVLeafNode* leafnode,               // split full leaf into two leaves
                        uint8_t hash,
-                       const string& key,
-                       const string& value);
+                       string_view key,
+                       string_view value);
     void InnerUpdateAfterSplit(KVNode* node,               // update parents after leaf split
                                unique_ptr<KVNode> newnode,
                                string* split_key);
     uint8_t PearsonHash(const char* data,                  // calculate 1-byte hash for string
                         size_t size);
+    persistent_ptr<KVLeaf> LeafAllocate();                 // allocate leaf within transaction
     void Recover();                                        // reload state from persistent pool
+    KVRecoveredLeaf RecoverLeaf(persistent_ptr<KVLeaf> leaf);  // rebuild volatile node for leaf
+    void FreeLeaves();                                     // free leaves & slots in batches
+    KVLeafNode* LeafFirst();                               // leftmost leaf in key order
+    KVLeafNode* LeafNext(KVNode* node);                    // next leaf in key order
+    void CompactLeaf(KVLeafNode* leafnode);                // merge or relocate one leaf
+    void CompactSweep();                                   // free one empty persistent leaf
   private:
     KVTree(const KVTree&);                                 // prevent copying
     void operator=(const KVTree&);                         // prevent assigning
@@ -194,6 +324,15 @@ class KVTree : public KVEngine {                           // hybrid B+ tree eng
     const string pmpath;                                   // path when constructed
     pool<KVRoot> pmpool;                                   // pool for persistent root
     unique_ptr<KVNode> tree_top;                           // pointer to uppermost inner node
+    KVCompaction compaction = {};                          // progress of current compaction
+    KVLeafNode* compact_leaf = nullptr;                    // next leaf to compact in key order
+    persistent_ptr<KVLeaf> compact_prev;                   // last leaf kept by persistent sweep
+    std::unordered_set<uint64_t> compact_free;             // offsets of leaves to free in sweep
+    bool compact_sweeping = false;                         // true when merging/moving is done
+    size_t compress_threshold = 0;                         // smallest value compressed, 0 if off
+    KVLineClasses line_classes;                            // flags for line-aligned allocations
+    const KVTreeOptions options;                           // options chosen when opening
+    KVTreeStats counters = {};                             // operations counted if enabled
 };
 
 } // namespace kvtree
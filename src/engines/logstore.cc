@@ -0,0 +1,565 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+#include "logstore.h"
+
+#define DO_LOG 0
+#define LOG(msg) if (DO_LOG) std::cout << "[logstore] " << msg << "\n"
+
+namespace pmemkv {
+namespace logstore {
+
+// Records are appended at the tail of the active segment with one fence each, and are only
+// valid when their checksum (seeded with the sequence of their segment) matches. Records left
+// over from an earlier use of a recycled segment, or torn by a crash, fail this check, so
+// segments never need to be zeroed and recovery stops at the first invalid record.
+static size_t RecordSize(const uint32_t keysize, const uint32_t valsize) {
+    size_t size = sizeof(LogRecordHeader) + keysize + (valsize == RECORD_TOMBSTONE ? 0 : valsize);
+    return (size + SEGMENT_ALIGN - 1) & ~((size_t) SEGMENT_ALIGN - 1);
+}
+
+static void CopyNoDrain(PMEMobjpool* pop, char* dest, const void* src, const size_t size) {
+#ifdef PMEMOBJ_F_MEM_NONTEMPORAL
+    pmemobj_memcpy(pop, dest, src, size, PMEMOBJ_F_MEM_NODRAIN | PMEMOBJ_F_MEM_NONTEMPORAL);
+#else
+    memcpy(dest, src, size);
+    pmemobj_flush(pop, dest, size);
+#endif
+}
+
+LogStore::LogStore(const string& path, const size_t size, const string& layout) : pmpath(path) {
+    if ((access(path.c_str(), F_OK) != 0) && (size > 0)) {
+        LOG("Creating filesystem pool, path=" << path << ", size=" << to_string(size));
+        pmpool = pool<LogRoot>::create(path.c_str(), layout, size, S_IRWXU);
+    } else {
+        LOG("Opening pool, path=" << path);
+        pmpool = pool<LogRoot>::open(path.c_str(), layout);
+    }
+
+    // stamp new roots with the layout, and refuse pools written with any other layout (such as
+    // records checksummed byte by byte), as roots grown from older pools read zero past their end
+    auto root = pmpool.get_root();
+    if (root->layout != LOGSTORE_LAYOUT) {
+        if (root->layout != 0 || root->head) {
+            pmpool.close();
+            throw std::invalid_argument("pool has an incompatible logstore layout");
+        }
+        transaction::run(pmpool, [&] {
+            root->freeing = 0;
+            root->layout = LOGSTORE_LAYOUT;
+        });
+    }
+    Recover();
+    maintenance::Executor::Shared().Schedule(this, maintenance::RECLAIM, [this] { CleanInBackground(true); },
+                                             std::chrono::milliseconds(SEGMENT_CLEAN_MILLIS));
+    LOG("Opened ok");
+}
+
+LogStore::~LogStore() {
+    LOG("Closing");
+    maintenance::Executor::Shared().Cancel(this);          // waits for cleaning in progress
+    pmpool.close();
+    LOG("Closed ok");
+}
+
+// ===============================================================================================
+// KEY/VALUE METHODS
+// ===============================================================================================
+
+KVStatus LogStore::Get(const int32_t limit, const int32_t keybytes, int32_t* valuebytes,
+                       const char* key, char* value) {
+    const string_view ckey(key, (size_t) keybytes);
+    LOG("Get for key=" << ckey);
+    std::shared_lock<std::shared_mutex> lock(shared_mutex);
+    auto it = index.find(ckey);
+    if (it == index.end()) {
+        LOG("   could not find key");
+        return NOT_FOUND;
+    }
+    auto header = Record(it->second);
+    auto vs = (int32_t) header->valsize;
+    *valuebytes = vs;
+    if (vs > limit) {
+        LOG("   buffer too small, size=" << to_string(vs));
+        return FAILED;
+    }
+    memcpy(value, (const char*) (header + 1) + header->keysize, (size_t) vs);
+    return OK;
+}
+
+KVStatus LogStore::Get(const string& key, string* value) {
+    LOG("Get for key=" << key.c_str());
+    std::shared_lock<std::shared_mutex> lock(shared_mutex);
+    auto it = index.find(key);
+    if (it == index.end()) {
+        LOG("   could not find key");
+        return NOT_FOUND;
+    }
+    auto header = Record(it->second);
+    value->append((const char*) (header + 1) + header->keysize, header->valsize);
+    return OK;
+}
+
+KVStatus LogStore::Put(const string& key, const string& value) {
+    return PutRecord(key, value.data(), value.size());
+}
+
+KVStatus LogStore::Put(const int32_t keybytes, const int32_t valuebytes, const char* key,
+                       const char* value) {
+    return PutRecord(string_view(key, (size_t) keybytes), value, (size_t) valuebytes);
+}
+
+KVStatus LogStore::PutRecord(const string_view key, const char* value, const size_t valsize) {
+    LOG("Put key=" << key << ", value.size=" << to_string(valsize));
+    if (RecordSize((uint32_t) std::min(key.size(), (size_t) SEGMENT_SIZE),
+                   (uint32_t) std::min(valsize, (size_t) SEGMENT_SIZE)) > SEGMENT_SIZE) {
+        LOG("   record larger than segment");
+        return FAILED;
+    }
+    const uint64_t valhash = Hash(value, valsize);         // before taking the writer lock
+    std::unique_lock<std::shared_mutex> lock(shared_mutex);
+    LogLocation location;
+    if (!Append(key, value, (uint32_t) valsize, valhash, &location)) return FAILED;
+    auto it = index.find(key);
+    if (it != index.end()) Kill(it->second);
+    Index(location);
+    return OK;
+}
+
+KVStatus LogStore::Remove(const string& key) {
+    return Remove((int32_t) key.size(), key.data());
+}
+
+KVStatus LogStore::Remove(const int32_t keybytes, const char* keydata) {
+    const string_view key(keydata, (size_t) keybytes);
+    LOG("Remove key=" << key);
+    std::unique_lock<std::shared_mutex> lock(shared_mutex);
+    auto it = index.find(key);
+    if (it == index.end()) {
+        LOG("   key not present");
+        return OK;
+    }
+    LogLocation location;
+    if (!Append(key, nullptr, RECORD_TOMBSTONE, 0, &location)) return FAILED;
+    it = index.find(key);                                  // cleaning may have moved record
+    Kill(it->second);
+    index.erase(it);
+    return OK;
+}
+
+void LogStore::Free() {
+    LOG("Freeing");
+    std::unique_lock<std::shared_mutex> lock(shared_mutex);
+    auto root = pmpool.get_root();
+    transaction::exec_tx(pmpool, [&] {
+        root->freeing = 1;
+    });
+    FreeSegments();
+    index.clear();
+    segments.clear();
+    log.clear();
+    free_segments.clear();
+    sequence = 0;
+    LOG("Freed ok");
+}
+
+PMEMoid LogStore::GetRootOid() {
+    return pmpool.get_root().raw();
+}
+
+PMEMobjpool* LogStore::GetPool() {
+    return pmpool.get_handle();
+}
+
+void LogStore::Analyze(LogAnalysis& analysis) {
+    LOG("Analyzing");
+    std::shared_lock<std::shared_mutex> lock(shared_mutex);
+    analysis.segments_free = free_segments.size();
+    analysis.segments_total = segments.size();
+    analysis.bytes_used = 0;
+    analysis.bytes_live = 0;
+    for (auto s : log) {
+        analysis.bytes_used += segments[s].tail;
+        analysis.bytes_live += segments[s].live;
+    }
+    analysis.cleanings = cleanings;
+    analysis.path = pmpath;
+    LOG("Analyzed ok");
+}
+
+bool LogStore::Clean() {
+    LOG("Cleaning");
+    std::unique_lock<std::shared_mutex> lock(shared_mutex);
+    return CleanOldest();
+}
+
+void LogStore::ListAllKeyValuePairs(vector<string>& kv_pairs) {
+    LOG("Listing");
+    std::shared_lock<std::shared_mutex> lock(shared_mutex);
+    for (auto& entry : index) {
+        auto header = Record(entry.second);
+        kv_pairs.emplace_back(entry.first);
+        kv_pairs.push_back(string((const char*) (header + 1) + header->keysize, header->valsize));
+    }
+    LOG("List ok");
+}
+
+void LogStore::ListAllKeys(vector<string>& keys) {
+    LOG("Listing");
+    std::shared_lock<std::shared_mutex> lock(shared_mutex);
+    for (auto& entry : index) keys.emplace_back(entry.first);
+    LOG("List ok");
+}
+
+size_t LogStore::TotalNumKeys() {
+    std::shared_lock<std::shared_mutex> lock(shared_mutex);
+    return index.size();
+}
+
+// ===============================================================================================
+// PROTECTED LOG METHODS
+// ===============================================================================================
+
+bool LogStore::Append(const string_view key, const char* value, const uint32_t valsize, const uint64_t valhash,
+                      LogLocation* location) {
+    const size_t size = RecordSize((uint32_t) key.size(), valsize);
+    if (log.empty() || segments[log.back()].tail + size > SEGMENT_SIZE) {
+        if (!Activate()) return false;
+    }
+    auto& info = segments[log.back()];
+    char* dest = info.segment->data + info.tail;
+    LogRecordHeader header = {Checksum(info.sequence, key.data(), (uint32_t) key.size(), valhash, valsize),
+                              (uint32_t) key.size(), valsize, 0};
+    auto pop = pmpool.get_handle();
+    CopyNoDrain(pop, dest, &header, sizeof(header));
+    CopyNoDrain(pop, dest + sizeof(header), key.data(), key.size());
+    if (valsize != RECORD_TOMBSTONE) CopyNoDrain(pop, dest + sizeof(header) + key.size(), value, valsize);
+    pmemobj_drain(pop);                                    // only fence for this record
+    location->segment = log.back();
+    location->offset = (uint32_t) info.tail;
+    info.tail += size;
+    if (valsize != RECORD_TOMBSTONE) info.live += size;    // tombstones are never indexed
+    return true;
+}
+
+bool LogStore::Activate() {
+    if (free_segments.empty() && !AddSegment()) {
+        LOG("   pool is full, cleaning in foreground");
+        if (!CleanOldest() || free_segments.empty()) return false;
+    }
+    const uint32_t s = free_segments.back();
+    free_segments.pop_back();
+    auto& info = segments[s];
+    info.sequence = ++sequence;
+    info.tail = 0;
+    info.live = 0;
+    info.segment->sequence = info.sequence;                // single 8-byte store
+    pmemobj_persist(pmpool.get_handle(), &info.segment->sequence, sizeof(uint64_t));
+    log.push_back(s);
+    LOG("   activated segment=" << s << ", sequence=" << info.sequence);
+    if (log.size() > 1 && !clean_queued.exchange(true)) {  // previous segment was sealed
+        maintenance::Executor::Shared().Schedule(this, maintenance::RECLAIM, [this] { CleanInBackground(false); });
+    }
+    return true;
+}
+
+bool LogStore::AddSegment() {
+    persistent_ptr<LogSegment> segment;
+    try {
+        transaction::exec_tx(pmpool, [&] {
+            auto root = pmpool.get_root();
+            segment = make_persistent<LogSegment>();
+            segment->next = root->head;
+            root->head = segment;
+        });
+    } catch (pmem::transaction_alloc_error) {
+        return false;
+    } catch (pmem::transaction_error) {
+        return false;
+    }
+    segments.push_back({segment, 0, 0, 0});
+    free_segments.push_back((uint32_t) (segments.size() - 1));
+    return true;
+}
+
+// Segments are cleaned strictly oldest first. A tombstone can then be dropped along with its
+// segment, since every older record it could have hidden was already cleaned away.
+bool LogStore::CleanOldest() {
+    if (log.size() < 2) return false;
+    const uint32_t oldest = log.front();
+    const size_t needed = segments[oldest].live;
+    if (SEGMENT_SIZE - segments[log.back()].tail < needed && free_segments.empty() && !AddSegment()) {
+        LOG("   no room to relocate live records");
+        return false;
+    }
+
+    // relocate live records to the active segment, in their original order
+    const char* data = segments[oldest].segment->data;
+    for (size_t offset = 0; offset < segments[oldest].tail;) {
+        auto header = (const LogRecordHeader*) (data + offset);
+        const size_t size = RecordSize(header->keysize, header->valsize);
+        if (header->valsize != RECORD_TOMBSTONE) {
+            auto it = index.find(string_view((const char*) (header + 1), header->keysize));
+            if (it != index.end() && it->second.segment == oldest && it->second.offset == offset) {
+                LogLocation moved;
+                const char* value = (const char*) (header + 1) + header->keysize;
+                if (!Append(it->first, value, header->valsize, Hash(value, header->valsize), &moved)) {
+                    return false;                          // relocated copies are still valid
+                }
+                Index(moved);                              // key now viewed in moved record
+                segments[oldest].live -= size;
+            }
+        }
+        offset += size;
+    }
+
+    log.erase(log.begin());
+    Recycle(oldest);
+    cleanings++;
+    LOG("   cleaned segment=" << oldest << ", relocated=" << to_string(needed));
+    return true;
+}
+
+bool LogStore::ShouldClean() {
+    if (log.size() < 2) return false;
+    size_t used = 0;
+    size_t live = 0;
+    for (size_t i = 0; i < log.size() - 1; i++) {          // sealed segments only
+        used += segments[log[i]].tail;
+        live += segments[log[i]].live;
+    }
+    return (used - live) * 100 >= used * SEGMENT_CLEAN_DEAD;
+}
+
+// Cleaning runs on the shared maintenance executor, one segment per task so that writers take
+// the lock in between. A periodic task checks for dead bytes left by updates and removes, while
+// sealing a segment queues a one-off task that keeps going only while cleaning is needed.
+void LogStore::CleanInBackground(const bool periodic) {
+    bool cleaned;
+    {
+        std::unique_lock<std::shared_mutex> lock(shared_mutex);
+        cleaned = ShouldClean() && CleanOldest();
+    }
+    auto& executor = maintenance::Executor::Shared();
+    if (cleaned) {
+        executor.Schedule(this, maintenance::RECLAIM, [this, periodic] { CleanInBackground(periodic); });
+    } else if (periodic) {
+        executor.Schedule(this, maintenance::RECLAIM, [this] { CleanInBackground(true); },
+                          std::chrono::milliseconds(SEGMENT_CLEAN_MILLIS));
+    } else {
+        clean_queued = false;
+    }
+}
+
+void LogStore::Kill(const LogLocation& location) {
+    auto header = Record(location);
+    segments[location.segment].live -= RecordSize(header->keysize, header->valsize);
+}
+
+// Index keys view the key of their record in the log, so keys are held once, in persistent
+// memory. Whenever a key's record changes, its view moves along before the old one is recycled.
+void LogStore::Index(const LogLocation& location) {
+    auto header = Record(location);
+    const string_view key((const char*) (header + 1), header->keysize);
+    auto node = index.extract(key);
+    if (node.empty()) {
+        index.emplace(key, location);
+    } else {
+        node.key() = key;
+        node.mapped() = location;
+        index.insert(std::move(node));
+    }
+}
+
+const LogRecordHeader* LogStore::Record(const LogLocation& location) {
+    return (const LogRecordHeader*) (segments[location.segment].segment->data + location.offset);
+}
+
+void LogStore::Recycle(const uint32_t index) {
+    auto& info = segments[index];
+    info.segment->sequence = 0;                            // stale records no longer match
+    pmemobj_persist(pmpool.get_handle(), &info.segment->sequence, sizeof(uint64_t));
+    info.sequence = 0;
+    info.tail = 0;
+    info.live = 0;
+    free_segments.push_back(index);
+}
+
+static const uint64_t PRIME1 = 0x9e3779b185ebca87ull;
+static const uint64_t PRIME2 = 0xc2b2ae3d27d4eb4full;
+static const uint64_t PRIME3 = 0x165667b19e3779f9ull;
+static const uint64_t PRIME4 = 0x85ebca77c2b2ae63ull;
+static const uint64_t PRIME5 = 0x27d4eb2f165667c5ull;
+
+static inline uint64_t Rotl(const uint64_t x, const int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t Round(uint64_t acc, const uint64_t input) {
+    acc += input * PRIME2;
+    return Rotl(acc, 31) * PRIME1;
+}
+
+static inline uint64_t Word(const char* data) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+// Values are hashed 32 bytes a step in four independent lanes, so that writers are limited by
+// the media rather than by a byte-at-a-time multiply chain. Put hashes its value before taking
+// the writer lock, leaving only the key and header to mix under it.
+uint64_t LogStore::Hash(const char* data, const size_t size) {
+    if (size == RECORD_TOMBSTONE) return 0;
+    const char* end = data + size;
+    uint64_t hash;
+    if (size >= 32) {
+        uint64_t lanes[4] = {PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1};
+        for (; data + 32 <= end; data += 32) {
+            for (int i = 0; i < 4; i++) lanes[i] = Round(lanes[i], Word(data + 8 * i));
+        }
+        hash = Rotl(lanes[0], 1) + Rotl(lanes[1], 7) + Rotl(lanes[2], 12) + Rotl(lanes[3], 18);
+        for (int i = 0; i < 4; i++) hash = (hash ^ Round(0, lanes[i])) * PRIME1 + PRIME4;
+    } else {
+        hash = PRIME5;
+    }
+    hash += size;
+    for (; data + 8 <= end; data += 8) hash = Rotl(hash ^ Round(0, Word(data)), 27) * PRIME1 + PRIME4;
+    for (; data < end; data++) hash = Rotl(hash ^ ((uint8_t) *data * PRIME5), 11) * PRIME1;
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    return hash ^ (hash >> 32);
+}
+
+uint32_t LogStore::Checksum(const uint64_t sequence, const char* key, const uint32_t keysize,
+                            const uint64_t valhash, const uint32_t valsize) {
+    uint64_t hash = Round(Round(Hash(key, keysize), sequence), ((uint64_t) keysize << 32) | valsize);
+    hash = Round(hash, valhash);
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    return (uint32_t) (hash ^ (hash >> 32));
+}
+
+// ===============================================================================================
+// PROTECTED LIFECYCLE METHODS
+// ===============================================================================================
+
+void LogStore::Recover() {
+    LOG("Recovering");
+
+    // finish freeing segments if interrupted by a crash
+    if (pmpool.get_root()->freeing) FreeSegments();
+
+    // gather persistent segments, sorting those in use by sequence
+    auto segment = pmpool.get_root()->head;
+    while (segment) {
+        const uint64_t s = segment->sequence;
+        segments.push_back({segment, s, 0, 0});
+        if (s == 0) {
+            free_segments.push_back((uint32_t) (segments.size() - 1));
+        } else {
+            log.push_back((uint32_t) (segments.size() - 1));
+            sequence = std::max(sequence, s);
+        }
+        segment = segment->next;  // advance to next linked segment
+    }
+    std::sort(log.begin(), log.end(), [this](const uint32_t lhs, const uint32_t rhs) {
+        return segments[lhs].sequence < segments[rhs].sequence;
+    });
+
+    // replay records in log order, stopping at first invalid record of each segment
+    for (auto s : log) {
+        auto& info = segments[s];
+        const char* data = info.segment->data;
+        size_t offset = 0;
+        while (offset + sizeof(LogRecordHeader) <= SEGMENT_SIZE) {
+            auto header = (const LogRecordHeader*) (data + offset);
+            if (header->keysize > SEGMENT_SIZE) break;
+            if (header->valsize != RECORD_TOMBSTONE && header->valsize > SEGMENT_SIZE) break;
+            const size_t size = RecordSize(header->keysize, header->valsize);
+            if (offset + size > SEGMENT_SIZE) break;
+            const char* key = (const char*) (header + 1);
+            if (header->checksum != Checksum(info.sequence, key, header->keysize,
+                                             Hash(key + header->keysize, header->valsize),
+                                             header->valsize)) break;
+            auto it = index.find(string_view(key, header->keysize));
+            if (it != index.end()) {
+                Kill(it->second);
+                if (header->valsize == RECORD_TOMBSTONE) index.erase(it);
+            }
+            if (header->valsize != RECORD_TOMBSTONE) {
+                Index({s, (uint32_t) offset});
+                info.live += size;
+            }
+            offset += size;
+        }
+        info.tail = offset;
+    }
+
+    LOG("Recovered ok, keys=" << to_string(index.size()) << ", segments=" << to_string(segments.size()));
+}
+
+void LogStore::FreeSegments() {
+    LOG("Freeing segments");
+    auto root = pmpool.get_root();
+    while (root->head) {
+        transaction::exec_tx(pmpool, [&] {                 // unlink & free batch
+            auto segment = root->head;
+            for (int count = SEGMENT_FREE_BATCH; segment && count--;) {
+                auto next = segment->next;
+                delete_persistent<LogSegment>(segment);
+                segment = next;
+            }
+            root->head = segment;
+        });
+    }
+    transaction::exec_tx(pmpool, [&] {
+        root->freeing = 0;
+    });
+    LOG("Freed segments ok");
+}
+
+static const bool registered = KVEngineRegistry::Register(ENGINE, [](const string& path, const size_t size,
+        const string& layout, const KVConfig& config) -> KVEngine* {
+    return config.empty() ? new LogStore(path, size, layout) : nullptr;
+});
+
+} // namespace logstore
+} // namespace pmemkv
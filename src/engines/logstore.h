@@ -0,0 +1,183 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "../pmemkv.h"
+#include "maintenance/executor.h"
+
+using std::string_view;
+using std::vector;
+using pmem::obj::p;
+using pmem::obj::persistent_ptr;
+using pmem::obj::make_persistent;
+using pmem::obj::transaction;
+using pmem::obj::delete_persistent;
+using pmem::obj::pool;
+
+namespace pmemkv {
+namespace logstore {
+
+const string ENGINE = "logstore";                          // engine identifier
+
+#define SEGMENT_SIZE (1024 * 1024)                         // bytes of records in each segment
+#define SEGMENT_ALIGN 8                                    // alignment of records in segment
+#define SEGMENT_CLEAN_DEAD 50                              // percent dead bytes to start cleaning
+#define SEGMENT_CLEAN_MILLIS 100                           // interval of periodic cleaning check
+#define SEGMENT_FREE_BATCH 16                              // segments freed per transaction
+#define RECORD_TOMBSTONE UINT32_MAX                        // value size marking removed key
+#define LOGSTORE_LAYOUT 0x6c6f6773746f0002ull              // "logsto" magic & persistent layout 2
+
+struct LogRecordHeader {                                   // header preceding key & value
+    uint32_t checksum;                                     // hash of sequence, sizes & data
+    uint32_t keysize;                                      // size of key in bytes
+    uint32_t valsize;                                      // size of value, or tombstone
+    uint32_t reserved;                                     // padding, always zero
+};
+
+struct LogSegment {                                        // persistent log segment
+    p<uint64_t> sequence;                                  // position in log, 0 when free
+    persistent_ptr<LogSegment> next;                       // next segment in unsorted list
+    char data[SEGMENT_SIZE];                               // appended records
+};
+
+struct LogRoot {                                           // persistent root object
+    persistent_ptr<LogSegment> head;                       // head of linked list of segments
+    p<uint8_t> freeing;                                    // set while Free is in progress
+    p<uint64_t> layout;                                    // LOGSTORE_LAYOUT, zero in older pools
+};
+
+struct LogLocation {                                       // position of live record
+    uint32_t segment;                                      // index into volatile segments
+    uint32_t offset;                                       // offset of record within segment
+};
+
+struct LogSegmentInfo {                                    // volatile state of each segment
+    persistent_ptr<LogSegment> segment;                    // pointer to persistent segment
+    uint64_t sequence;                                     // position in log, 0 when free
+    size_t tail;                                           // offset where next record goes
+    size_t live;                                           // bytes of records still indexed
+};
+
+struct LogAnalysis {                                       // log analysis structure
+    size_t segments_free;                                  // count of unused segments
+    size_t segments_total;                                 // count of all persisted segments
+    size_t bytes_used;                                     // bytes appended to live segments
+    size_t bytes_live;                                     // bytes of records still indexed
+    size_t cleanings;                                      // segments cleaned since open
+    string path;                                           // path when constructed
+};
+
+class LogStore : public KVEngine {                         // log-structured engine
+  public:
+    LogStore(const string& path, size_t size, const string& layout);
+    ~LogStore();                                           // default destructor
+
+    string Engine() final { return ENGINE; }               // engine identifier
+    KVStatus Get(int32_t limit,                            // copy value to fixed-size buffer
+                 int32_t keybytes,
+                 int32_t* valuebytes,
+                 const char* key,
+                 char* value) final;
+    KVStatus Get(const string& key,                        // append value to std::string
+                 string* value) final;
+    KVStatus Put(const string& key,                        // copy value from std::string
+                 const string& value) final;
+    KVStatus Put(int32_t keybytes,                         // copy value from buffer
+                 int32_t valuebytes,
+                 const char* key,
+                 const char* value) final;
+    KVStatus Remove(const string& key) final;              // remove value for key
+    KVStatus Remove(int32_t keybytes,                      // remove value for key in buffer
+                    const char* key) final;
+
+    void Free() final;
+
+    PMEMoid GetRootOid() final;
+    PMEMobjpool* GetPool() final;
+
+    void Analyze(LogAnalysis& analysis);                   // report on internal state & stats
+    bool Clean();                                          // clean oldest segment now
+
+    void ListAllKeyValuePairs(vector<string>& kv_pairs) final;      // list all the key value pairs
+    void ListAllKeys(vector<string>& keys) final;          // list all the keys
+    size_t TotalNumKeys() final;
+
+  protected:
+    KVStatus PutRecord(string_view key,                    // append record & index it, copying
+                       const char* value,                  // key & value straight into the log
+                       size_t valsize);
+    bool Append(string_view key,                           // append record to active segment
+                const char* value,
+                uint32_t valsize,
+                uint64_t valhash,                          // Hash of value, 0 for tombstone
+                LogLocation* location);
+    bool Activate();                                       // start new active segment
+    bool AddSegment();                                     // allocate free segment from pool
+    bool CleanOldest();                                    // relocate live records & recycle
+    bool ShouldClean();                                    // true when enough dead bytes
+    void CleanInBackground(bool periodic);                 // clean one segment & reschedule
+    void Kill(const LogLocation& location);                // account record as dead
+    void Index(const LogLocation& location);               // index record by key held in log
+    const LogRecordHeader* Record(const LogLocation& location);  // header of record
+    void Recover();                                        // reload state from persistent pool
+    void Recycle(uint32_t index);                          // return segment to free list
+    void FreeSegments();                                   // free segments in batches
+    static uint64_t Hash(const char* data,                 // xxhash-style hash, 8 bytes a step
+                         size_t size);
+    static uint32_t Checksum(uint64_t sequence,            // hash of sequence, sizes, key and
+                             const char* key,              // hash of value
+                             uint32_t keysize,
+                             uint64_t valhash,
+                             uint32_t valsize);
+  private:
+    LogStore(const LogStore&);                             // prevent copying
+    void operator=(const LogStore&);                       // prevent assigning
+    const string pmpath;                                   // path when constructed
+    pool<LogRoot> pmpool;                                  // pool for persistent root
+    std::unordered_map<string_view, LogLocation> index;    // live records by key within log
+    vector<LogSegmentInfo> segments;                       // all segments known
+    vector<uint32_t> log;                                  // segments in log order, oldest first
+    vector<uint32_t> free_segments;                        // segments ready to reuse
+    uint64_t sequence = 0;                                 // sequence of active segment
+    size_t cleanings = 0;                                  // segments cleaned since open
+    std::shared_mutex shared_mutex;                        // readers share, writers exclusive
+    std::atomic<bool> clean_queued{false};                 // cleaning queued since last seal
+};
+
+} // namespace logstore
+} // namespace pmemkv
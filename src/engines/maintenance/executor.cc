@@ -0,0 +1,168 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include "executor.h"
+
+#define DO_LOG 0
+#define LOG(msg) if (DO_LOG) std::cout << "[executor] " << msg << "\n"
+
+namespace pmemkv {
+namespace maintenance {
+
+Executor::Executor(const size_t threads) : limit(std::max(threads, (size_t) 1)) {}
+
+Executor::~Executor() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (auto& worker : workers) worker.join();
+}
+
+// Destroyed at exit after engines closed by static destructors, when those were created first.
+Executor& Executor::Shared() {
+    static Executor executor(EXECUTOR_THREADS);
+    return executor;
+}
+
+void Executor::Schedule(const void* owner, const TaskPriority priority, std::function<void()> task,
+                        const std::chrono::microseconds delay) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (stopping || cancelling.count(owner) > 0) return;
+    if (delay.count() > 0) {
+        delayed.emplace(clock::now() + delay, std::make_pair(priority, Task{owner, std::move(task)}));
+    } else {
+        ready[priority].push_back({owner, std::move(task)});
+    }
+    Grow();
+    wakeup.notify_all();                                   // idle workers recompute their deadline
+}
+
+void Executor::Cancel(const void* owner) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cancelling.insert(owner);
+    auto owned = [owner](const Task& task) { return task.owner == owner; };
+    for (auto& queue : ready) queue.erase(std::remove_if(queue.begin(), queue.end(), owned), queue.end());
+    for (auto it = delayed.begin(); it != delayed.end();) {
+        it = owned(it->second.second) ? delayed.erase(it) : std::next(it);
+    }
+    finished.wait(lock, [&] { return running.count(owner) == 0; });
+    cancelling.erase(cancelling.find(owner));
+}
+
+void Executor::Drain(const void* owner) {
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&] { return stopping || !Pending(owner); });
+}
+
+void Executor::SetThreads(const size_t threads) {
+    std::unique_lock<std::mutex> lock(mutex);
+    limit = std::max(threads, (size_t) 1);
+    Grow();
+    wakeup.notify_all();
+}
+
+size_t Executor::Threads() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return limit;
+}
+
+// Starts a worker when ready tasks outnumber idle workers, or when delayed tasks have no worker
+// to wait for them, as long as the bound allows.
+void Executor::Grow() {
+    size_t count = 0;
+    for (auto& queue : ready) count += queue.size();
+    if ((count > idle || (!delayed.empty() && workers.empty())) && workers.size() < limit) {
+        LOG("Starting worker=" << workers.size());
+        workers.emplace_back(&Executor::Worker, this, workers.size());
+    }
+}
+
+bool Executor::Pending(const void* owner) {
+    if (running.count(owner) > 0) return true;
+    for (auto& queue : ready) {
+        for (auto& task : queue) if (task.owner == owner) return true;
+    }
+    return false;
+}
+
+// Workers beyond a lowered bound stay idle rather than exiting, so they can be joined when the
+// executor is destroyed and resume if the bound is raised again.
+void Executor::Worker(const size_t index) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        const auto now = clock::now();
+        while (!delayed.empty() && delayed.begin()->first <= now) {
+            auto& entry = delayed.begin()->second;
+            ready[entry.first].push_back(std::move(entry.second));
+            delayed.erase(delayed.begin());
+        }
+        std::deque<Task>* queue = nullptr;
+        if (index < limit) {
+            for (auto& q : ready) {
+                if (!q.empty()) {
+                    queue = &q;
+                    break;
+                }
+            }
+        }
+        if (queue != nullptr) {
+            Task task = std::move(queue->front());
+            queue->pop_front();
+            running.insert(task.owner);
+            lock.unlock();
+            try {
+                task.run();
+            } catch (...) {
+                LOG("Task failed, owner=" << task.owner);
+            }
+            lock.lock();
+            running.erase(running.find(task.owner));
+            finished.notify_all();
+            continue;
+        }
+        idle++;
+        if (delayed.empty() || index >= limit) {
+            wakeup.wait(lock);
+        } else {
+            const auto due = delayed.begin()->first;       // entry may be erased while waiting
+            wakeup.wait_until(lock, due);
+        }
+        idle--;
+    }
+}
+
+} // namespace maintenance
+} // namespace pmemkv
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace pmemkv {
+namespace maintenance {
+
+#define EXECUTOR_THREADS 2                                 // default bound on worker threads
+
+// Deferred engine work is queued by priority, and ready tasks of a higher priority always run
+// before those of a lower one, in the order they were scheduled within a priority.
+typedef enum {
+    RECLAIM = 0,                                           // returning space, e.g. log cleaning
+    RESHAPE = 1,                                           // merging & relocating, e.g. compaction
+    ROUTINE = 2,                                           // sweeps, stats & checkpoints
+} TaskPriority;
+
+// Background executor running maintenance work of engines off their foreground threads.
+// Workers are started on demand, up to a bound shared by all engines of the process. Tasks
+// belong to an owner, usually the engine scheduling them, which cancels its tasks before it
+// is destroyed. Tasks may schedule further tasks, including themselves.
+class Executor {
+  public:
+    explicit Executor(size_t threads);                     // start with bound on workers
+    ~Executor();                                           // stop workers, dropping queued tasks
+
+    static Executor& Shared();                             // executor shared by all engines
+
+    void Schedule(const void* owner,                       // queue task to run once delay has
+                  TaskPriority priority,                   // passed, unless owner is being
+                  std::function<void()> task,              // cancelled
+                  std::chrono::microseconds delay = std::chrono::microseconds(0));
+    void Cancel(const void* owner);                        // drop queued tasks & wait for running
+                                                           // ones, not callable from owned tasks
+    void Drain(const void* owner);                         // wait for ready & running tasks
+    void SetThreads(size_t threads);                       // change bound on running workers
+    size_t Threads();                                      // bound on running workers
+
+  private:
+    struct Task {
+        const void* owner;
+        std::function<void()> run;
+    };
+    typedef std::chrono::steady_clock clock;
+
+    Executor(const Executor&);                             // prevent copying
+    void operator=(const Executor&);                       // prevent assigning
+    void Worker(size_t index);                             // run tasks while index is in bound
+    void Grow();                                           // start worker if needed & in bound
+    bool Pending(const void* owner);                       // owner has ready or running tasks
+
+    std::mutex mutex;                                      // protects all members below
+    std::condition_variable wakeup;                        // signalled when tasks are added
+    std::condition_variable finished;                      // signalled when a task completes
+    std::deque<Task> ready[ROUTINE + 1];                   // tasks due to run, by priority
+    std::multimap<clock::time_point,                       // tasks waiting for their delay
+                  std::pair<TaskPriority, Task>> delayed;
+    std::multiset<const void*> running;                    // owners of running tasks
+    std::multiset<const void*> cancelling;                 // owners whose tasks are dropped
+    std::vector<std::thread> workers;                      // started workers
+    size_t limit;                                          // bound on running workers
+    size_t idle = 0;                                       // workers waiting for tasks
+    bool stopping = false;                                 // true when destroyed
+};
+
+} // namespace maintenance
+} // namespace pmemkv
@@ -32,11 +32,14 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <list>
+#include <thread>
 #include <unistd.h>
 #include "mvtree.h"
+#include "codec/lz.h"
 
 #define DO_LOG 0
 #define LOG(msg) if (DO_LOG) std::cout << "[mvtree] " << msg << "\n"
@@ -52,7 +55,8 @@ static const string PMPATH_NO_PATH = "nopath";
 
 // Ctor to access or create KVEngine of the root object
 // path is in a state of not create or not opened
-MVTree::MVTree (const string& path, size_t size, const string& layout): pmpath(path) {
+MVTree::MVTree (const string& path, size_t size, const string& layout, const MVTreeOptions& options)
+        : pmpath(path), options(options) {
   if ((access(path.c_str(), F_OK) != 0) && (size > 0)) {
     LOG("Creating filesystem pool, path=" << path << ", size=" << to_string(size));
     pool<MVRoot> pop = pool<MVRoot>::create(path.c_str(), layout, size, S_IRWXU);
@@ -64,13 +68,15 @@ MVTree::MVTree (const string& path, size_t size, const string& layout): pmpath(p
     pmpool = pop;
     kv_root = pop.get_root();
   }
+  CheckLayout();
   Recover();
   LOG("Opened ok");
 }
 
 // Ctor to support existing pop with root object as kvroot
 // pop is already opened
-MVTree::MVTree (PMEMobjpool* pop): pmpool(pop), pmpath(PMPATH_NO_PATH) {
+MVTree::MVTree (PMEMobjpool* pop, const MVTreeOptions& options)
+        : pmpool(pop), pmpath(PMPATH_NO_PATH), options(options) {
   assert(pop != nullptr);
 
   LOG("retrieve or create root object of pmem"); 
@@ -78,6 +84,7 @@ MVTree::MVTree (PMEMobjpool* pop): pmpool(pop), pmpath(PMPATH_NO_PATH) {
   kv_root = popMV.get_root();
   LOG("pop=" << pop << ", oid=" << kv_root.raw().off);
 
+  CheckLayout();
   Recover();
   LOG("Opened ok");
 }
@@ -86,7 +93,8 @@ MVTree::MVTree (PMEMobjpool* pop): pmpool(pop), pmpath(PMPATH_NO_PATH) {
 // Ctor to access or create KVEngine of non-root object
 // assuming pop is already opened,
 // and we won't call pop.close in dtor
-MVTree::MVTree (PMEMobjpool* pop, const PMEMoid& oid): pmpool(pop), pmpath(PMPATH_NO_PATH) {
+MVTree::MVTree (PMEMobjpool* pop, const PMEMoid& oid, const MVTreeOptions& options)
+        : pmpool(pop), pmpath(PMPATH_NO_PATH), options(options) {
   if(pop == nullptr) {
     throw std::invalid_argument( "received PMEMobjpool* nullptr" );
   }
@@ -95,9 +103,13 @@ MVTree::MVTree (PMEMobjpool* pop, const PMEMoid& oid): pmpool(pop), pmpath(PMPAT
     make_persistent_atomic<MVRoot>(pmpool, kv_root);
   } else {
     // TODO check oid is of type MVRoot
+    if (pmemobj_alloc_usable_size(oid) < sizeof(MVRoot)) {
+      throw std::invalid_argument("root object is too small for mvtree layout");
+    }
     kv_root = oid;
   }
 
+  CheckLayout();
   Recover();
   LOG("Opened ok");
 }
@@ -105,6 +117,7 @@ MVTree::MVTree (PMEMobjpool* pop, const PMEMoid& oid): pmpool(pop), pmpath(PMPAT
 
 MVTree::~MVTree() {
   LOG("Closing");
+  maintenance::Executor::Shared().Cancel(this);            // waits for compaction step in progress
   if(PMPATH_NO_PATH != pmpath) {
     pmpool.close();
   }
@@ -123,6 +136,12 @@ PMEMobjpool* MVTree::GetPool() {
   return pmpool.get_handle();
 }
 
+bool MVTree::CompressValues(const size_t threshold) {
+  auto lock = WriteLock();
+  compress_threshold = threshold;
+  return true;
+}
+
 
 
 // ===============================================================================================
@@ -132,10 +151,11 @@ PMEMobjpool* MVTree::GetPool() {
 void MVTree::Analyze(MVTreeAnalysis &analysis) {
   LOG("Analyzing");
   
-  std::shared_lock<std::shared_mutex> lock(shared_mutex);
+  auto lock = ReadLock();
   analysis.leaf_empty = 0;
   analysis.leaf_prealloc = leaves_prealloc.size();
   analysis.leaf_total = 0;
+  analysis.prefix_bytes = 0;
   analysis.path = pmpath;
 
   // iterate persistent leaves for stats
@@ -143,9 +163,10 @@ void MVTree::Analyze(MVTreeAnalysis &analysis) {
   while (leaf) {
     bool empty = true;
     for (int slot = LEAF_KEYS; slot--;) {
-      if (!leaf->slots[slot].get_rw().empty()) {
+      auto kvslot = leaf->slots[slot].get_ro();
+      if (!kvslot.empty()) {
         empty = false;
-        break;
+        analysis.prefix_bytes += kvslot.prefixsize();
       }
     }
     if (empty) analysis.leaf_empty++;
@@ -160,15 +181,19 @@ void MVTree::Analyze(MVTreeAnalysis &analysis) {
 void MVTree::ListAllKeyValuePairs(vector<string>& kv_pairs) {
     LOG("Listing");
 
-    std::shared_lock<std::shared_mutex> lock(shared_mutex);
+    auto lock = ReadLock();
     // iterate persistent leaves for stats
     auto leaf = kv_root->head;
     while (leaf) {
         for (int slot = LEAF_KEYS; slot--;) {
             auto kvslot = leaf->slots[slot].get_rw();
             if (!kvslot.empty()) {
-              kv_pairs.push_back(string(kvslot.key(), kvslot.keysize()));
-              kv_pairs.push_back(string(kvslot.val(), kvslot.valsize()));
+              string key;
+              kvslot.append_key(leaf->prefix.get(), &key);
+              kv_pairs.push_back(std::move(key));
+              string value;
+              kvslot.append_value(&value);
+              kv_pairs.push_back(std::move(value));
             }
         }
         leaf = leaf->next;  // advance to next linked leaf
@@ -179,14 +204,16 @@ void MVTree::ListAllKeyValuePairs(vector<string>& kv_pairs) {
 void MVTree::ListAllKeys(vector<string>& keys) {
     LOG("Listing");
 
-    std::shared_lock<std::shared_mutex> lock(shared_mutex);
+    auto lock = ReadLock();
     // iterate persistent leaves for stats
     auto leaf = kv_root->head;
     while (leaf) {
         for (int slot = LEAF_KEYS; slot--;) {
             auto kvslot = leaf->slots[slot].get_rw();
             if (!kvslot.empty()) {
-              keys.push_back(string(kvslot.key(), kvslot.keysize()));
+              string key;
+              kvslot.append_key(leaf->prefix.get(), &key);
+              keys.push_back(std::move(key));
             }
         }
         leaf = leaf->next;  // advance to next linked leaf
@@ -197,7 +224,7 @@ void MVTree::ListAllKeys(vector<string>& keys) {
 size_t MVTree::TotalNumKeys() {
     size_t size = 0;
 
-    std::shared_lock<std::shared_mutex> lock(shared_mutex);
+    auto lock = ReadLock();
     LOG("Getting size");
     // iterate persistent leaves for stats
     auto leaf = kv_root->head;
@@ -218,21 +245,24 @@ size_t MVTree::TotalNumKeys() {
 KVStatus MVTree::Get(const int32_t limit, const int32_t keybytes, int32_t *valuebytes,
                          const char *key, char *value) {
 
-  std::shared_lock<std::shared_mutex> lock(shared_mutex);
-  auto ckey = std::string(key, keybytes);
+  auto lock = ReadLock();
+  const string_view ckey(key, (size_t) keybytes);
   LOG("Get for key=" << ckey);
   auto leafnode = LeafSearch(ckey);
-  if (leafnode) {
+  if (leafnode && leafnode->has_prefix(ckey)) {
     const uint8_t hash = PearsonHash(key, (size_t) keybytes);
     for (int slot = LEAF_KEYS; slot--;) {
       if (leafnode->hashes[slot] == hash) {
-        if (leafnode->keys[slot].compare(ckey) == 0) {
+        if (leafnode->matches(slot, ckey)) {
           auto kv = leafnode->leaf->slots[slot].get_ro();
           auto vs = kv.valsize();
           *valuebytes = vs;
           if (vs <= limit) {
             LOG("   found value, slot=" << slot << ", size=" << to_string(vs));
-            memcpy(value, kv.val(), vs);
+            if (!kv.copy_value(value)) {
+              LOG("   could not decompress value, slot=" << slot);
+              return FAILED;
+            }
             return OK;
           } else {
             LOG("   buffer too small, slot=" << slot << ", size=" << to_string(vs));
@@ -249,17 +279,16 @@ KVStatus MVTree::Get(const int32_t limit, const int32_t keybytes, int32_t *value
 KVStatus MVTree::Get(const string &key, string *value) {
   LOG("Get for key=" << key.c_str());
 
-  std::shared_lock<std::shared_mutex> lock(shared_mutex);
+  auto lock = ReadLock();
   auto leafnode = LeafSearch(key);
-  if (leafnode) {
+  if (leafnode && leafnode->has_prefix(key)) {
     const uint8_t hash = PearsonHash(key.c_str(), key.size());
     for (int slot = LEAF_KEYS; slot--;) {
       if (leafnode->hashes[slot] == hash) {
-        if (leafnode->keys[slot].compare(key) == 0) {
+        if (leafnode->matches(slot, key)) {
           auto kv = leafnode->leaf->slots[slot].get_ro();
           LOG("   found value, slot=" << slot << ", size=" << to_string(kv.valsize()));
-          value->append(kv.val(), kv.valsize());
-          return OK;
+          return kv.append_value(value) ? OK : FAILED;
         }
       }
     }
@@ -269,10 +298,18 @@ KVStatus MVTree::Get(const string &key, string *value) {
 }
 
 KVStatus MVTree::Put(const string &key, const string &value) {
-  LOG("Put key=" << key.c_str() << ", value.size=" << to_string(value.size()));
-  std::unique_lock<std::shared_mutex> lock(shared_mutex);
+  return Put((int32_t) key.size(), (int32_t) value.size(), key.data(), value.data());
+}
+
+// Key and value are only read in place, so the value is copied once, into its slot buffer.
+KVStatus MVTree::Put(const int32_t keybytes, const int32_t valuebytes, const char *keydata,
+                     const char *valuedata) {
+  const string_view key(keydata, (size_t) keybytes);
+  const string_view value(valuedata, (size_t) valuebytes);
+  LOG("Put key=" << key << ", value.size=" << to_string(value.size()));
+  auto lock = WriteLock();
   try {
-    const uint8_t hash = PearsonHash(key.c_str(), key.size());
+    const uint8_t hash = PearsonHash(key.data(), key.size());
     auto leafnode = LeafSearch(key);
     if (!leafnode) {
       LOG("   adding head leaf");
@@ -290,10 +327,22 @@ KVStatus MVTree::Put(const string &key, const string &value) {
                                        new_leaf->next = old_head;
                                        new_node->leaf = new_leaf;
                                      }
+                                     LeafSetPrefix(new_node.get(), nullptr);
                                      LeafFillSpecificSlot(new_node.get(), hash, key, value, 0);
                                    });
       tree_top = move(new_node);
-    } else if (LeafFillSlotForKey(leafnode, hash, key, value)) {
+      return OK;
+    }
+    if (!leafnode->has_prefix(key)) {
+      size_t common = 0;
+      while (common < leafnode->prefix.size() && common < key.size() &&
+             leafnode->prefix[common] == key[common]) common++;
+      LOG("   trimming leaf prefix to size=" << common);
+      transaction::exec_tx(pmpool, [&] {
+                                     LeafTrimPrefix(leafnode, common);
+                                   });
+    }
+    if (LeafFillSlotForKey(leafnode, hash, key, value)) {
       // nothing else to do
     } else {
       LeafSplitFull(leafnode, hash, key, value);
@@ -307,17 +356,25 @@ KVStatus MVTree::Put(const string &key, const string &value) {
 }
 
 KVStatus MVTree::Remove(const string &key) {
-  LOG("Remove key=" << key.c_str());
-  std::unique_lock<std::shared_mutex> lock(shared_mutex);
+  return Remove((int32_t) key.size(), key.data());
+}
+
+KVStatus MVTree::Remove(const int32_t keybytes, const char *keydata) {
+  const string_view key(keydata, (size_t) keybytes);
+  LOG("Remove key=" << key);
+  auto lock = WriteLock();
   auto leafnode = LeafSearch(key);
   if (!leafnode) {
     LOG("   head not present");
     return OK;
+  } else if (!leafnode->has_prefix(key)) {
+    LOG("   key outside leaf prefix");
+    return OK;
   }
-  const uint8_t hash = PearsonHash(key.c_str(), key.size());
+  const uint8_t hash = PearsonHash(key.data(), key.size());
   for (int slot = LEAF_KEYS; slot--;) {
     if (leafnode->hashes[slot] == hash) {
-      if (leafnode->keys[slot].compare(key) == 0) {
+      if (leafnode->matches(slot, key)) {
         LOG("   freeing slot=" << slot);
         leafnode->hashes[slot] = 0;
         leafnode->keys[slot].clear();
@@ -334,18 +391,28 @@ KVStatus MVTree::Remove(const string &key) {
 
 
 void MVTree::Free() {
-  LOG("Free the tree"); 
-  // TODO impl
-  if(kv_root != nullptr) {
-    std::unique_lock<std::shared_mutex> lock(shared_mutex);
-    persistent_ptr<MVLeaf> pLeaf = kv_root->head;
-    while(pLeaf != nullptr) {
-      persistent_ptr<MVLeaf> pt = pLeaf->next;
-      delete_persistent_atomic<MVLeaf>(pLeaf);
-      pLeaf = pt;
+  LOG("Freeing");
+  maintenance::Executor::Shared().Cancel(this);            // no compaction of the freed tree
+  compact_queued = false;
+  if (kv_root != nullptr) {
+    auto lock = WriteLock();
+    transaction::exec_tx(pmpool, [&] {
+                                   kv_root->freeing = 1;
+                                 });
+    FreeLeaves();
+    if (kv_root.raw().off != pmemobj_root(pmpool.get_handle(), 0).off) {
+      delete_persistent_atomic<MVRoot>(kv_root);           // root is not the pool root object
+      kv_root = nullptr;
     }
-    delete_persistent_atomic<MVRoot>(kv_root);
+    tree_top.reset(nullptr);
+    leaves_prealloc.clear();
+    compaction = {};
+    compact_leaf = nullptr;
+    compact_prev = nullptr;
+    compact_free.clear();
+    compact_sweeping = false;
   }
+  LOG("Freed ok");
 }
 
 
@@ -353,7 +420,7 @@ void MVTree::Free() {
 // PROTECTED LEAF METHODS
 // ===============================================================================================
 
-MVLeafNode *MVTree::LeafSearch(const string &key) {
+MVLeafNode *MVTree::LeafSearch(const string_view key) {
   MVNode *node = tree_top.get();
   if (node == nullptr) return nullptr;
   bool matched;
@@ -377,7 +444,7 @@ MVLeafNode *MVTree::LeafSearch(const string &key) {
 }
 
 void MVTree::LeafFillEmptySlot(MVLeafNode *leafnode, const uint8_t hash,
-                                   const string &key, const string &value) {
+                                   const string_view key, const string_view value) {
   for (int slot = LEAF_KEYS; slot--;) {
     if (leafnode->hashes[slot] == 0) {
       LeafFillSpecificSlot(leafnode, hash, key, value, slot);
@@ -387,7 +454,7 @@ void MVTree::LeafFillEmptySlot(MVLeafNode *leafnode, const uint8_t hash,
 }
 
 bool MVTree::LeafFillSlotForKey(MVLeafNode *leafnode, const uint8_t hash,
-                                    const string &key, const string &value) {
+                                    const string_view key, const string_view value) {
   // scan for empty/matching slots
   int last_empty_slot = -1;
   int key_match_slot = -1;
@@ -396,7 +463,7 @@ bool MVTree::LeafFillSlotForKey(MVLeafNode *leafnode, const uint8_t hash,
     if (slot_hash == 0) {
       last_empty_slot = slot;
     } else if (slot_hash == hash) {
-      if (leafnode->keys[slot].compare(key) == 0) {
+      if (leafnode->matches(slot, key)) {
         key_match_slot = slot;
         break;  // no duplicate keys allowed
       }
@@ -415,29 +482,95 @@ bool MVTree::LeafFillSlotForKey(MVLeafNode *leafnode, const uint8_t hash,
 }
 
 void MVTree::LeafFillSpecificSlot(MVLeafNode *leafnode, const uint8_t hash,
-                                      const string &key, const string &value, const int slot) {
+                                      const string_view key, const string_view value, const int slot) {
   if (leafnode->hashes[slot] == 0) {
     leafnode->hashes[slot] = hash;
-    leafnode->keys[slot] = key;
+    leafnode->keys[slot].assign(key, leafnode->prefix.size(), string::npos);
+  }
+  leafnode->leaf->slots[slot].get_rw().set(hash, (uint32_t) leafnode->prefix.size(), key, value, compress_threshold);
+}
+
+// Leaves elide the prefix common to all of their keys, storing it once in the persistent leaf
+// rather than in every slot buffer. Slots record how many prefix bytes they elide, so the prefix
+// can grow when a split leaves only keys sharing a longer prefix, without rewriting any slots.
+void MVTree::LeafSetPrefix(MVLeafNode *leafnode, const string_view *key) {
+  const char *first = nullptr;                             // suffix other keys are compared to
+  size_t common = 0;                                       // bytes shared beyond current prefix
+  if (key != nullptr) {
+    first = key->data() + leafnode->prefix.size();
+    common = key->size() - leafnode->prefix.size();
+  }
+  for (int slot = LEAF_KEYS; slot--;) {
+    if (leafnode->hashes[slot] == 0) continue;
+    const string &suffix = leafnode->keys[slot];
+    if (first == nullptr) {
+      first = suffix.data();
+      common = suffix.size();
+    } else {
+      size_t idx = 0;
+      while (idx < common && idx < suffix.size() && suffix[idx] == first[idx]) idx++;
+      common = idx;
+    }
+  }
+  string prefix = leafnode->prefix;
+  if (common > 0) prefix.append(first, common);
+
+  auto leaf = leafnode->leaf;
+  if (common == 0 && leaf->prefixsize == prefix.size() &&
+      (prefix.empty() || memcmp(leaf->prefix.get(), prefix.data(), prefix.size()) == 0)) {
+    return;                                                // persistent prefix is unchanged
+  }
+  if (leaf->prefix) delete_persistent<char[]>(leaf->prefix, leaf->prefixsize);
+  leaf->prefix = nullptr;
+  if (!prefix.empty()) {
+    leaf->prefix = make_persistent<char[]>(prefix.size());
+    memcpy(leaf->prefix.get(), prefix.data(), prefix.size());
+  }
+  leaf->prefixsize = (uint32_t) prefix.size();
+  for (int slot = LEAF_KEYS; slot--;) {
+    if (leafnode->hashes[slot] != 0) leafnode->keys[slot].erase(0, common);
+  }
+  leafnode->prefix = move(prefix);
+}
+
+void MVTree::LeafTrimPrefix(MVLeafNode *leafnode, const size_t prefixsize) {
+  auto leaf = leafnode->leaf;
+  for (int slot = LEAF_KEYS; slot--;) {
+    if (leafnode->hashes[slot] == 0) continue;
+    if (leaf->slots[slot].get_ro().prefixsize() > prefixsize) {
+      leaf->slots[slot].get_rw().relocate(leafnode->prefix, (uint32_t) prefixsize);
+    }
   }
-  leafnode->leaf->slots[slot].get_rw().set(hash, key, value);
+  if (leaf->prefix) delete_persistent<char[]>(leaf->prefix, leaf->prefixsize);
+  leaf->prefix = nullptr;
+  if (prefixsize > 0) {
+    leaf->prefix = make_persistent<char[]>(prefixsize);
+    memcpy(leaf->prefix.get(), leafnode->prefix.data(), prefixsize);
+  }
+  leaf->prefixsize = (uint32_t) prefixsize;
+  for (int slot = LEAF_KEYS; slot--;) {
+    if (leafnode->hashes[slot] != 0) leafnode->keys[slot].insert(0, leafnode->prefix, prefixsize, string::npos);
+  }
+  leafnode->prefix.resize(prefixsize);
 }
 
 void MVTree::LeafSplitFull(MVLeafNode *leafnode, const uint8_t hash,
-                               const string &key, const string &value) {
-  string keys[LEAF_KEYS + 1];
-  keys[LEAF_KEYS] = key;
+                               const string_view key, const string_view value) {
+  string keys[LEAF_KEYS + 1];                               // keys without leaf prefix
+  keys[LEAF_KEYS].assign(key, leafnode->prefix.size(), string::npos);
   for (int slot = LEAF_KEYS; slot--;) keys[slot] = leafnode->keys[slot];
   std::sort(std::begin(keys), std::end(keys), [](const string &lhs, const string &rhs) {
                                                 return lhs.compare(rhs) < 0;
                                               });
-  string split_key = keys[LEAF_KEYS_MIDPOINT];
+  const string &split_suffix = keys[LEAF_KEYS_MIDPOINT];
+  string split_key = leafnode->prefix + split_suffix;
   LOG("   splitting leaf at key=" << split_key);
 
   // split leaf into two leaves, moving slots that sort above split key to new leaf
   unique_ptr<MVLeafNode> new_leafnode(new MVLeafNode());
   new_leafnode->parent = leafnode->parent;
   new_leafnode->is_leaf = true;
+  new_leafnode->prefix = leafnode->prefix;                 // moved slots keep their prefix
   transaction::exec_tx(pmpool, [&] {
                                  persistent_ptr<MVLeaf> new_leaf;
                                  if (!leaves_prealloc.empty()) {
@@ -453,7 +586,7 @@ void MVTree::LeafSplitFull(MVLeafNode *leafnode, const uint8_t hash,
                                    new_leafnode->leaf = new_leaf;
                                  }
                                  for (int slot = LEAF_KEYS; slot--;) {
-                                   if (leafnode->keys[slot].compare(split_key) > 0) {
+                                   if (leafnode->hashes[slot] != 0 && leafnode->keys[slot].compare(split_suffix) > 0) {
                                      new_leaf->slots[slot].swap(leafnode->leaf->slots[slot]);
                                      new_leafnode->hashes[slot] = leafnode->hashes[slot];
                                      new_leafnode->keys[slot] = leafnode->keys[slot];
@@ -462,6 +595,8 @@ void MVTree::LeafSplitFull(MVLeafNode *leafnode, const uint8_t hash,
                                    }
                                  }
                                  auto target = key.compare(split_key) > 0 ? new_leafnode.get() : leafnode;
+                                 LeafSetPrefix(leafnode, target == leafnode ? &key : nullptr);
+                                 LeafSetPrefix(new_leafnode.get(), target == leafnode ? nullptr : &key);
                                  LeafFillEmptySlot(target, hash, key, value);
                                });
 
@@ -530,10 +665,242 @@ void MVTree::InnerUpdateAfterSplit(MVNode *node, unique_ptr<MVNode> new_node, st
   InnerUpdateAfterSplit(inner, move(ni), &new_split_key);              // recursive update
 }
 
+// ===============================================================================================
+// COMPACTION METHODS
+// ===============================================================================================
+
+bool MVTree::CompactStep() {
+    auto lock = WriteLock();
+    try {
+        if (compact_leaf == nullptr && !compact_sweeping) {
+            LOG("Starting compaction pass");
+            compaction = {};
+            compact_leaf = LeafFirst();
+        }
+        compaction.steps++;
+        if (compact_leaf != nullptr) {
+            CompactLeaf(compact_leaf);
+            if (compact_leaf == nullptr) {                               // start sweeping leaves
+                compact_sweeping = true;
+                compact_prev = nullptr;
+                for (auto& leaf : leaves_prealloc) compact_free.insert(leaf.raw().off);
+                leaves_prealloc.clear();
+            }
+        } else {
+            CompactSweep();
+            if (!compact_sweeping) {
+                LOG("Compaction pass complete, steps=" << compaction.steps);
+                compaction.complete = true;
+                return false;
+            }
+        }
+        return true;
+    } catch (pmem::transaction_alloc_error) {
+        LOG("Compaction step failed to allocate");
+        return false;
+    } catch (pmem::transaction_error) {
+        LOG("Compaction step failed");
+        return false;
+    }
+}
+
+void MVTree::Compact(const size_t steps_per_second) {
+    LOG("Compacting, steps_per_second=" << steps_per_second);
+    auto interval = std::chrono::microseconds(steps_per_second > 0 ? 1000000 / steps_per_second : 0);
+    auto next_step = std::chrono::steady_clock::now();
+    while (CompactStep()) {
+        if (steps_per_second > 0) {
+            next_step += interval;
+            std::this_thread::sleep_until(next_step);
+        }
+    }
+}
+
+// Steps run on the shared maintenance executor, which spaces them out by the rate limit and
+// runs other engines' more urgent work, such as log cleaning, ahead of them. A single-threaded
+// engine takes no locks, so its pass runs at once on the caller's thread, which is the only
+// thread allowed to use the tree; there is nothing for the rate limit to make room for.
+void MVTree::CompactInBackground(const size_t steps_per_second) {
+    LOG("Compacting in background, steps_per_second=" << steps_per_second);
+    if (options.single_threaded) {
+        Compact(0);
+        return;
+    }
+    if (compact_queued.exchange(true)) return;             // pass already under way
+    auto interval = std::chrono::microseconds(steps_per_second > 0 ? 1000000 / steps_per_second : 0);
+    maintenance::Executor::Shared().Schedule(this, maintenance::RESHAPE, [this, interval] {
+        CompactQueued(interval);
+    });
+}
+
+void MVTree::CompactQueued(const std::chrono::microseconds interval) {
+    if (!CompactStep()) {
+        compact_queued = false;
+        return;
+    }
+    maintenance::Executor::Shared().Schedule(this, maintenance::RESHAPE, [this, interval] {
+        CompactQueued(interval);
+    }, interval);
+}
+
+void MVTree::Compaction(MVCompaction& compaction) {
+    auto lock = ReadLock();
+    compaction = this->compaction;
+}
+
+MVLeafNode* MVTree::LeafFirst() {
+    MVNode* node = tree_top.get();
+    if (node == nullptr) return nullptr;
+    while (!node->is_leaf) node = ((MVInnerNode*) node)->children[0].get();
+    return (MVLeafNode*) node;
+}
+
+MVLeafNode* MVTree::LeafNext(MVNode* node) {
+    while (node->parent) {
+        MVInnerNode* inner = node->parent;
+        int idx = 0;
+        while (inner->children[idx].get() != node) idx++;
+        if (idx < inner->keycount) {
+            node = inner->children[idx + 1].get();
+            while (!node->is_leaf) node = ((MVInnerNode*) node)->children[0].get();
+            return (MVLeafNode*) node;
+        }
+        node = inner;
+    }
+    return nullptr;
+}
+
+void MVTree::CompactLeaf(MVLeafNode* leafnode) {
+    int slots[LEAF_KEYS];                                  // occupied slots in key order
+    int count = 0;
+    for (int slot = 0; slot < LEAF_KEYS; slot++) {
+        if (leafnode->hashes[slot] != 0) slots[count++] = slot;
+    }
+
+    // merge right sibling into this leaf if both are sparse, staying on this leaf afterwards
+    MVInnerNode* inner = leafnode->parent;
+    if (inner != nullptr && inner->keycount > 1) {
+        int idx = 0;
+        while (inner->children[idx].get() != leafnode) idx++;
+        if (idx < inner->keycount && inner->children[idx + 1]->is_leaf) {
+            auto sibling = (MVLeafNode*) inner->children[idx + 1].get();
+            int targets[LEAF_KEYS];                        // destination slot for sibling slots
+            int merged = count;
+            for (int slot = 0, target = 0; slot < LEAF_KEYS; slot++) {
+                if (sibling->hashes[slot] == 0) continue;
+                while (target < LEAF_KEYS && leafnode->hashes[target] != 0) target++;
+                targets[slot] = target++;
+                merged++;
+            }
+            if (merged <= LEAF_KEYS_MERGE) {
+                LOG("   merging leaf with sibling, keys=" << merged);
+                size_t common = 0;                         // prefix shared by both leaves
+                while (common < leafnode->prefix.size() && common < sibling->prefix.size() &&
+                       leafnode->prefix[common] == sibling->prefix[common]) common++;
+                transaction::exec_tx(pmpool, [&] {
+                    if (leafnode->prefix.size() > common) LeafTrimPrefix(leafnode, common);
+                    if (sibling->prefix.size() > common) LeafTrimPrefix(sibling, common);
+                    for (int slot = LEAF_KEYS; slot--;) {
+                        if (sibling->hashes[slot] == 0) continue;
+                        leafnode->leaf->slots[targets[slot]].swap(sibling->leaf->slots[slot]);
+                    }
+                });
+                for (int slot = LEAF_KEYS; slot--;) {
+                    if (sibling->hashes[slot] == 0) continue;
+                    leafnode->hashes[targets[slot]] = sibling->hashes[slot];
+                    leafnode->keys[targets[slot]] = move(sibling->keys[slot]);
+                }
+                leaves_prealloc.push_back(sibling->leaf);  // swept & freed after merging
+                const uint8_t keycount = inner->keycount;
+                for (int i = idx + 1; i < keycount; i++) inner->keys[i - 1] = move(inner->keys[i]);
+                for (int i = idx + 2; i <= keycount; i++) inner->children[i - 1] = move(inner->children[i]);
+                inner->keys[keycount - 1].clear();
+                inner->children[keycount].reset();         // deletes sibling if still present
+                inner->keycount = (uint8_t) (keycount - 1);
+#ifndef NDEBUG
+                inner->assert_invariants();
+#endif
+                compaction.leaves_merged++;
+                return;
+            }
+        }
+    }
+
+    // move leaf and its slot buffers to fresh allocations, with buffers allocated in key order
+    if (count > 0) {
+        std::sort(slots, slots + count, [&](const int lhs, const int rhs) {
+            return leafnode->keys[lhs].compare(leafnode->keys[rhs]) < 0;
+        });
+        auto old_leaf = leafnode->leaf;
+        persistent_ptr<MVLeaf> new_leaf;
+        size_t bytes = 0;
+        transaction::exec_tx(pmpool, [&] {
+            auto root = kv_root;
+            new_leaf = make_persistent<MVLeaf>();
+            new_leaf->next = root->head;
+            root->head = new_leaf;
+            for (int i = 0; i < count; i++) {
+                new_leaf->slots[slots[i]].swap(old_leaf->slots[slots[i]]);
+                bytes += new_leaf->slots[slots[i]].get_rw().relocate(leafnode->prefix,
+                                                                     (uint32_t) leafnode->prefix.size());
+            }
+            new_leaf->prefix = old_leaf->prefix;                         // slots now elide all of it
+            new_leaf->prefixsize = old_leaf->prefixsize;
+            old_leaf->prefix = nullptr;
+            old_leaf->prefixsize = 0;
+        });
+        leafnode->leaf = new_leaf;
+        leaves_prealloc.push_back(old_leaf);               // swept & freed after relocating
+        compaction.leaves_relocated++;
+        compaction.slots_relocated += count;
+        compaction.bytes_relocated += bytes;
+    }
+    compact_leaf = LeafNext(leafnode);
+}
+
+void MVTree::CompactSweep() {
+    auto root = kv_root;
+    auto leaf = compact_prev ? compact_prev->next : root->head;
+    if (!leaf) {
+        compact_sweeping = false;                          // reached end of persistent list
+        compact_free.clear();
+        return;
+    }
+    if (compact_free.erase(leaf.raw().off) == 0) {
+        compact_prev = leaf;                               // keep leaf that is still in use
+        return;
+    }
+    LOG("   freeing empty leaf");
+    transaction::exec_tx(pmpool, [&] {
+        if (compact_prev) {
+            compact_prev->next = leaf->next;
+        } else {
+            root->head = leaf->next;
+        }
+        if (leaf->prefix) delete_persistent<char[]>(leaf->prefix, leaf->prefixsize);
+        delete_persistent<MVLeaf>(leaf);
+    });
+    compaction.leaves_freed++;
+}
+
 // ===============================================================================================
 // PROTECTED LIFECYCLE METHODS
 // ===============================================================================================
 
+// stamp new roots with the layout, and refuse roots written with any other layout, as roots
+// grown from older pools read zero past their former end
+void MVTree::CheckLayout() {
+  if (kv_root->layout == MVTREE_LAYOUT) return;
+  if (kv_root->layout != 0 || kv_root->head) {
+    if (PMPATH_NO_PATH != pmpath) pmpool.close();
+    throw std::invalid_argument("pool has an incompatible mvtree layout");
+  }
+  transaction::run(pmpool, [&] {
+    kv_root->freeing = 0;
+    kv_root->layout = MVTREE_LAYOUT;
+  });
+}
+
 void MVTree::Recover() {
   LOG("Recovering");
 
@@ -541,13 +908,17 @@ void MVTree::Recover() {
   // traverse persistent leaves to build list of leaves to recover
   std::list<MVRecoveredLeaf> leaves;
 
-  std::unique_lock<std::shared_mutex> lock(shared_mutex);
+  auto lock = WriteLock();
+
+  // finish freeing leaves if interrupted by a crash
+  if (kv_root->freeing) FreeLeaves();
 
   auto leaf = kv_root->head;
   while (leaf) {
     unique_ptr<MVLeafNode> leafnode(new MVLeafNode());
     leafnode->leaf = leaf;
     leafnode->is_leaf = true;
+    if (leaf->prefixsize > 0) leafnode->prefix.assign(leaf->prefix.get(), leaf->prefixsize);
 
     // find highest sorting key in leaf, while recovering all hashes
     bool empty_leaf = true;
@@ -557,15 +928,16 @@ void MVTree::Recover() {
       if (kvslot.empty()) continue;
       leafnode->hashes[slot] = kvslot.hash();
       if (leafnode->hashes[slot] == 0) continue;
-      const char *key = kvslot.key();
+      const size_t elided = leafnode->prefix.size() - kvslot.prefixsize();  // stored by slot
+      leafnode->keys[slot] = string(kvslot.key() + elided, kvslot.get_ks() - elided);
       if (empty_leaf) {
-        max_key = string(kvslot.key(), kvslot.get_ks());
+        max_key = leafnode->keys[slot];
         empty_leaf = false;
-      } else if (max_key.compare(0, string::npos, kvslot.key(), kvslot.get_ks()) < 0) {
-        max_key = string(kvslot.key(), kvslot.get_ks());
+      } else if (max_key.compare(leafnode->keys[slot]) < 0) {
+        max_key = leafnode->keys[slot];
       }
-      leafnode->keys[slot] = string(key, kvslot.get_ks());
     }
+    max_key.insert(0, leafnode->prefix);
 
     // use highest sorting key to decide how to recover the leaf
     if (empty_leaf) {
@@ -605,6 +977,27 @@ void MVTree::Recover() {
   LOG("Recovered ok");
 }
 
+void MVTree::FreeLeaves() {
+  LOG("Freeing leaves");
+  while (kv_root->head) {
+    transaction::exec_tx(pmpool, [&] {                     // unlink & free batch
+                                   auto leaf = kv_root->head;
+                                   for (int count = FREE_BATCH_LEAVES; leaf && count--;) {
+                                     for (int slot = LEAF_KEYS; slot--;) leaf->slots[slot].get_ro().release();
+                                     if (leaf->prefix) delete_persistent<char[]>(leaf->prefix, leaf->prefixsize);
+                                     auto next = leaf->next;
+                                     delete_persistent<MVLeaf>(leaf);
+                                     leaf = next;
+                                   }
+                                   kv_root->head = leaf;
+                                 });
+  }
+  transaction::exec_tx(pmpool, [&] {
+                                 kv_root->freeing = 0;
+                               });
+  LOG("Freed leaves ok");
+}
+
 // ===============================================================================================
 // PEARSON HASH METHODS
 // ===============================================================================================
@@ -645,6 +1038,42 @@ uint8_t MVTree::PearsonHash(const char *data, const size_t size) {
 // SLOT CLASS METHODS
 // ===============================================================================================
 
+// Compressed values are stored as their raw size followed by an LZ block, and are flagged in the
+// value size. Values are left uncompressed when below the threshold or when compression would not
+// save at least 1/VALUE_MIN_SAVING of their size, so incompressible values are never penalized.
+static string_view EncodeValue(const string_view value, const size_t threshold, uint32_t* vs) {
+    *vs = (uint32_t) value.size();
+    if (threshold == 0 || value.size() < threshold || value.size() < VALUE_MIN_SAVING * sizeof(uint32_t)) {
+        return value;
+    }
+    static thread_local string scratch;                                     // reused between puts
+    const size_t capacity = value.size() - value.size() / VALUE_MIN_SAVING - sizeof(uint32_t);
+    scratch.resize(sizeof(uint32_t) + capacity);
+    size_t compressed = codec::LZCompress(value.data(), value.size(), &scratch[sizeof(uint32_t)], capacity);
+    if (compressed == 0) return value;                                      // not worth compressing
+    *((uint32_t*) &scratch[0]) = (uint32_t) value.size();
+    scratch.resize(sizeof(uint32_t) + compressed);
+    *vs = (uint32_t) scratch.size() | VALUE_COMPRESSED;
+    return scratch;
+}
+
+bool MVSlot::copy_value(char* dest) const {
+    if (!compressed()) {
+        memcpy(dest, val(), get_vs());
+        return true;
+    }
+    const size_t stored = (get_vs() & ~VALUE_COMPRESSED) - sizeof(uint32_t);
+    return codec::LZDecompress(val() + sizeof(uint32_t), stored, dest, valsize());
+}
+
+bool MVSlot::append_value(string* value) const {
+    const size_t start = value->size();
+    value->resize(start + valsize());
+    if (copy_value(&(*value)[start])) return true;
+    value->resize(start);                                                   // drop partial value
+    return false;
+}
+
 bool MVSlot::empty() {
     if (kv)
         return false;
@@ -652,38 +1081,81 @@ bool MVSlot::empty() {
         return true;
 }
 
+void MVSlot::append_key(const char* prefix, string* key) const {
+    if (get_pl() > 0) key->append(prefix, get_pl());
+    key->append(this->key(), get_ks());
+}
+
+// Moves the buffer to a new allocation that elides prefixsize bytes of the key, where prefix is
+// the current prefix of the leaf. Bytes no longer elided are copied back from the leaf prefix.
+size_t MVSlot::relocate(const string& prefix, const uint32_t prefixsize) {
+    if (!kv) return 0;
+    char* p = kv.get();
+    const uint32_t pl = get_pl_direct(p);
+    const uint32_t ks = get_ks_direct(p);
+    const uint32_t moved_ks = ks + pl - prefixsize;
+    size_t size = bufsize_direct(p) - ks + moved_ks;
+    auto moved = make_persistent<char[]>(size);
+    char* m = moved.get();
+    const size_t header = key_direct(p) - p;
+    memcpy(m, p, header);                                                   // copy hash & sizes
+    set_ks_direct(m, moved_ks);
+    set_pl_direct(m, prefixsize);
+    char* kvptr = m + header;
+    if (prefixsize < pl) {
+        memcpy(kvptr, prefix.data() + prefixsize, pl - prefixsize);         // restore prefix bytes
+        memcpy(kvptr + pl - prefixsize, key_direct(p), ks);
+    } else {
+        memcpy(kvptr, key_direct(p) + prefixsize - pl, moved_ks);           // drop prefix bytes
+    }
+    memcpy(kvptr + moved_ks, key_direct(p) + ks, size - (kvptr + moved_ks - m));  // copy value
+    delete_persistent<char[]>(kv, bufsize_direct(p));
+    kv = moved;
+    return size;
+}
+
+void MVSlot::release() const {
+    if (kv) {
+        char* p = kv.get();
+        delete_persistent<char[]>(kv, bufsize_direct(p));
+    }
+}
+
 void MVSlot::clear() {
     if (kv) {
         char* p = kv.get();
+        size_t size = bufsize_direct(p);
         set_ph_direct(p, 0);
         set_ks_direct(p, 0);
         set_vs_direct(p, 0);
-        delete_persistent<char[]>(kv, sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks_direct(p) +
-                                      get_vs_direct(p) + 2);
+        delete_persistent<char[]>(kv, size);
         kv = nullptr;
     }
 }
 
-void MVSlot::set(const uint8_t hash, const string& key, const string& value) {
+void MVSlot::set(const uint8_t hash, const uint32_t prefixsize, const string_view key,
+                 const string_view value, const size_t compress_threshold) {
     if (kv) {
         char* p = kv.get();
-        delete_persistent<char[]>(kv, sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks_direct(p) +
-                                      get_vs_direct(p) + 2);
+        delete_persistent<char[]>(kv, bufsize_direct(p));
     }
+    uint32_t vs;
+    const string_view stored = EncodeValue(value, compress_threshold, &vs);
     size_t ksize;
     size_t vsize;
-    ksize = key.size();
-    vsize = value.size();
-    size_t size = ksize + vsize + 2 + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
+    ksize = key.size() - prefixsize;
+    vsize = stored.size();
+    size_t size = ksize + vsize + 2 + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
     kv = make_persistent<char[]>(size);
     char* p = kv.get();
     set_ph_direct(p, hash);
     set_ks_direct(p, (uint32_t) ksize);
-    set_vs_direct(p, (uint32_t) vsize);
-    char* kvptr = p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
-    memcpy(kvptr, key.data(), ksize);                                       // copy key into buffer
+    set_vs_direct(p, vs);
+    set_pl_direct(p, prefixsize);
+    char* kvptr = p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
+    memcpy(kvptr, key.data() + prefixsize, ksize);                          // copy key into buffer
     kvptr += ksize + 1;                                                     // advance ptr past key
-    memcpy(kvptr, value.data(), vsize);                                     // copy value into buffer
+    memcpy(kvptr, stored.data(), vsize);                                    // copy value into buffer
 }
 
 // ===============================================================================================
@@ -701,5 +1173,30 @@ void MVInnerNode::assert_invariants() {
         assert(children[i] == nullptr);
 }
 
+static bool ReadOptions(const KVConfig& config, MVTreeOptions* options) {
+    auto concurrency = config.find("concurrency");
+    if (!ConfigOnly(config, {"concurrency"})) return false;
+    if (concurrency != config.end()) {
+        if (concurrency->second != "shared" && concurrency->second != "single") return false;
+        options->single_threaded = concurrency->second == "single";
+    }
+    return true;
+}
+
+static KVEngine* Open(const string& path, const size_t size, const string& layout, const KVConfig& config) {
+    MVTreeOptions options;
+    if (!ReadOptions(config, &options)) return nullptr;
+    return new MVTree(path, size, layout, options);
+}
+
+static KVEngine* OpenInPool(PMEMobjpool* pop, const PMEMoid* oid, const KVConfig& config) {
+    MVTreeOptions options;
+    if (!ReadOptions(config, &options)) return nullptr;
+    return oid == nullptr ? new MVTree(pop, options) : new MVTree(pop, *oid, options);
+}
+
+static const bool registered = KVEngineRegistry::Register(ENGINE, Open);
+static const bool registered_pool = KVEngineRegistry::Register(ENGINE, OpenInPool);
+
 } // namespace kvtree
 } // namespace pmemkv
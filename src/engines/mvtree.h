@@ -32,11 +32,18 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <vector>
+#include <mutex>
 #include <shared_mutex>
+#include <cstring>
+#include <unordered_set>
 #include "../pmemkv.h"
+#include "maintenance/executor.h"
 
 using std::move;
+using std::string_view;
 using std::unique_ptr;
 using std::vector;
 using pmem::obj::p;
@@ -59,34 +66,54 @@ const string ENGINE = "mvtree";                           // engine identifier
 #define INNER_KEYS_UPPER ((INNER_KEYS / 2) + 1)            // index where upper half of keys begins
 #define LEAF_KEYS 48                                       // maximum keys in tree nodes
 #define LEAF_KEYS_MIDPOINT (LEAF_KEYS / 2)                 // halfway point within the node
+#define LEAF_KEYS_MERGE ((LEAF_KEYS * 3) / 4)              // max keys after merging sibling leaves
+#define FREE_BATCH_LEAVES 64                               // leaves freed per transaction
+#define VALUE_COMPRESSED 0x80000000u                       // value size flag for compressed values
+#define VALUE_MIN_SAVING 8                                 // compress only when saving 1/8 or more
+#define MVTREE_LAYOUT 0x6d76747265650001ull                // "mvtree" magic & persistent layout 1
 
 class MVSlot {
   public:
     uint8_t hash() const { return get_ph(); }
-    uint8_t hash_direct(char *p) const { return *((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))); }
-    const char* key() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
-    const char* key_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
+    uint8_t hash_direct(char *p) const { return *((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t))); }
+    const char* key() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
+    const char* key_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
     const uint32_t keysize() const { return get_ks(); }
     const uint32_t keysize_direct(char *p) const { return *((uint32_t *)(p)); }
-    const char* val() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks() + 1); }
-    const char* val_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + *((uint32_t *)(p)) + 1); }
-    const uint32_t valsize() const { return get_vs(); }
+    const uint32_t prefixsize() const { return get_pl(); }
+    const char* val() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks() + 1); }
+    const char* val_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + *((uint32_t *)(p)) + 1); }
+    const uint32_t valsize() const { uint32_t vs = get_vs(); if (compressed()) memcpy(&vs, val(), sizeof(vs)); return vs; }
     const uint32_t valsize_direct(char *p) const { return *((uint32_t *)(p + sizeof(uint32_t))); }
     void clear();
-    void set(const uint8_t hash, const string& key, const string& value);
-    void set_ph(uint8_t v) {*((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
-    void set_ph_direct(char *p, uint8_t v) {*((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
+    void set(const uint8_t hash, uint32_t prefixsize,      // key bytes before prefixsize are
+             string_view key, string_view value,           // stored by leaf and not in slot
+             size_t compress_threshold);
+    void set_ph(uint8_t v) {*((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
+    void set_ph_direct(char *p, uint8_t v) {*((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
     void set_ks(uint32_t v) {*((uint32_t *)(kv.get())) = v;}
     void set_ks_direct(char * p, uint32_t v) {*((uint32_t *)(p)) = v;}
     void set_vs(uint32_t v) {*((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t))) = v;}
     void set_vs_direct(char *p, uint32_t v) {*((uint32_t *)((char *)(p) + sizeof(uint32_t))) = v;}
-    uint8_t get_ph() const {return *((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t)));}
-    uint8_t get_ph_direct(char *p) const {return *((uint8_t *)((char *)(p) + sizeof(uint32_t) + sizeof(uint32_t)));}
+    void set_pl_direct(char *p, uint32_t v) {*((uint32_t *)((char *)(p) + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
+    uint8_t get_ph() const {return *((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t)));}
+    uint8_t get_ph_direct(char *p) const {return *((uint8_t *)((char *)(p) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t)));}
     uint32_t get_ks() const {return *((uint32_t *)(kv.get()));}
     uint32_t get_ks_direct(char *p) const {return *((uint32_t *)(p));}
     uint32_t get_vs() const {return *((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t)));}
     uint32_t get_vs_direct(char *p) const {return *((uint32_t *)((char *)(p) + sizeof(uint32_t)));}
+    uint32_t get_pl() const {return *((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t)));}
+    uint32_t get_pl_direct(char *p) const {return *((uint32_t *)((char *)(p) + sizeof(uint32_t) + sizeof(uint32_t)));}
+    size_t bufsize_direct(char *p) const { return sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks_direct(p) + (get_vs_direct(p) & ~VALUE_COMPRESSED) + 2; }
+    bool compressed() const { return (get_vs() & VALUE_COMPRESSED) != 0; }
+    bool copy_value(char* dest) const;                     // copy or decompress value to buffer
+    bool append_value(string* value) const;                // append decompressed value to string
+    void append_key(const char* prefix,                    // append full key, using stored
+                    string* key) const;                    // prefix of leaf
     bool empty();
+    size_t relocate(const string& prefix,                  // move buffer to new allocation,
+                    uint32_t prefixsize);                  // eliding prefixsize bytes of key
+    void release() const;                                  // free buffer of leaf being freed
   private:
     persistent_ptr<char[]> kv;                             // buffer for key & value
 };
@@ -94,10 +121,14 @@ class MVSlot {
 struct MVLeaf {
     p<MVSlot> slots[LEAF_KEYS];                            // array of slot containers
     persistent_ptr<MVLeaf> next;                           // next leaf in unsorted list
+    persistent_ptr<char[]> prefix;                         // key prefix shared by all slots
+    p<uint32_t> prefixsize;                                // length of shared key prefix
 };
 
 struct MVRoot {                                            // persistent root object
     persistent_ptr<MVLeaf> head;                           // head of linked list of leaves
+    p<uint8_t> freeing;                                    // set while Free is in progress
+    p<uint64_t> layout;                                    // MVTREE_LAYOUT, zero in older pools
 };
 
 struct MVInnerNode;
@@ -117,8 +148,15 @@ struct MVInnerNode final : MVNode {                        // volatile inner nod
 
 struct MVLeafNode final : MVNode {                         // volatile leaf nodes of the tree
     uint8_t hashes[LEAF_KEYS];                             // Pearson hashes of keys
-    string keys[LEAF_KEYS];                                // keys stored in this leaf
+    string keys[LEAF_KEYS];                                // keys stored in this leaf, w/o prefix
+    string prefix;                                         // prefix shared by all keys in leaf
     persistent_ptr<MVLeaf> leaf;                           // pointer to persistent leaf
+    bool has_prefix(string_view key) const {               // true if key can be in this leaf
+        return key.compare(0, prefix.size(), prefix) == 0;
+    }
+    bool matches(const int slot, string_view key) const {  // compare key having leaf prefix
+        return keys[slot].compare(0, string::npos, key, prefix.size(), string::npos) == 0;
+    }
 };
 
 struct MVRecoveredLeaf {                                   // temporary wrapper used for recovery
@@ -130,24 +168,40 @@ struct MVTreeAnalysis {                                    // tree analysis stru
     size_t leaf_empty;                                     // count of persisted leaves w/o keys
     size_t leaf_prealloc;                                  // count of persisted but unused leaves
     size_t leaf_total;                                     // count of all persisted leaves
+    size_t prefix_bytes;                                   // key bytes elided by leaf prefixes
     string path;                                           // path when constructed
 };
 
+struct MVCompaction {                                      // compaction progress & stats
+    size_t steps;                                          // steps run in current pass
+    size_t leaves_merged;                                  // sparse leaves merged into siblings
+    size_t leaves_relocated;                               // leaves moved to new allocations
+    size_t leaves_freed;                                   // empty leaves returned to the pool
+    size_t slots_relocated;                                // slot buffers moved in key order
+    size_t bytes_relocated;                                // total size of moved slot buffers
+    bool complete;                                         // true when pass has finished
+};
+
+struct MVTreeOptions {                                     // options chosen when opening
+    bool single_threaded = false;                          // caller never shares the engine,
+};                                                         // so methods skip locking
+
 class MVTree : public KVEngine {                           // hybrid B+ tree engine
   public:
 
     // constructor to create or open root object based KVEngine
     // with pool not created or not opened
-    MVTree (const string& path, size_t size, const string& layout);  
+    MVTree (const string& path, size_t size, const string& layout,
+            const MVTreeOptions& options = MVTreeOptions());
     // MVTree (const string& path, size_t size);  
 
     // constructor to create or open root object based KVEngine
     // with pool already opened
-    MVTree(PMEMobjpool* pop);
+    MVTree(PMEMobjpool* pop, const MVTreeOptions& options = MVTreeOptions());
 
     // constructor to create or open pmemobj based KVEngine
     // OID_NULL means create a new tree, using a new pmemobj as the kvroot
-    MVTree(PMEMobjpool* pop, const PMEMoid& oid);
+    MVTree(PMEMobjpool* pop, const PMEMoid& oid, const MVTreeOptions& options = MVTreeOptions());
     ~MVTree();                                             // default destructor
 
     string Engine() final { return ENGINE; }               // engine identifier
@@ -161,7 +215,13 @@ class MVTree : public KVEngine {                           // hybrid B+ tree eng
                  string* value) final;
     KVStatus Put(const string& key,                        // copy value from std::string
                  const string& value) final;
+    KVStatus Put(int32_t keybytes,                         // copy value from buffer
+                 int32_t valuebytes,
+                 const char* key,
+                 const char* value) final;
     KVStatus Remove(const string& key) final;              // remove value for key
+    KVStatus Remove(int32_t keybytes,                      // remove value for key in buffer
+                    const char* key) final;
 
     // destroy those pmem used
     void Free() final;
@@ -174,34 +234,51 @@ class MVTree : public KVEngine {                           // hybrid B+ tree eng
 
     PMEMoid GetRootOid() final;
     PMEMobjpool* GetPool() final;
+    bool CompressValues(size_t threshold) final;          // compress values this large or larger
 
 
     void Analyze(MVTreeAnalysis& analysis);                // report on internal state & stats
+
+    bool CompactStep();                                    // run one bounded compaction step
+    void Compact(size_t steps_per_second);                 // run compaction pass w/ rate limit
+    void CompactInBackground(size_t steps_per_second);     // run pass on maintenance executor
+    void Compaction(MVCompaction& compaction);             // report compaction progress
   protected:
-    MVLeafNode* LeafSearch(const string& key);             // find node for key
+    MVLeafNode* LeafSearch(string_view key);               // find node for key
     void LeafFillEmptySlot(MVLeafNode* leafnode,           // write first unoccupied slot found
                            uint8_t hash,
-                           const string& key,
-                           const string& value);
+                           string_view key,
+                           string_view value);
     bool LeafFillSlotForKey(MVLeafNode* leafnode,          // write slot for matching key if found
                             uint8_t hash,
-                            const string& key,
-                            const string& value);
+                            string_view key,
+                            string_view value);
     void LeafFillSpecificSlot(MVLeafNode* leafnode,        // write slot at specific index
                               uint8_t hash,
-                              const string& key,
-                              const string& value,
+                              string_view key,
+                              string_view value,
                               int slot);
+    void LeafSetPrefix(MVLeafNode* leafnode,               // extend leaf prefix to common prefix
+                       const string_view* key);            // of its keys (and key if given)
+    void LeafTrimPrefix(MVLeafNode* leafnode,              // shorten leaf prefix, moving elided
+                        size_t prefixsize);                // bytes back into affected slots
     void LeafSplitFull(MVLeafNode* leafnode,               // split full leaf into two leaves
                        uint8_t hash,
-                       const string& key,
-                       const string& value);
+                       string_view key,
+                       string_view value);
     void InnerUpdateAfterSplit(MVNode* node,               // update parents after leaf split
                                unique_ptr<MVNode> newnode,
                                string* split_key);
     uint8_t PearsonHash(const char* data,                  // calculate 1-byte hash for string
                         size_t size);
+    void CheckLayout();                                    // stamp new root, refuse other layouts
     void Recover();                                        // reload state from persistent pool
+    void FreeLeaves();                                     // free leaves & slots in batches
+    MVLeafNode* LeafFirst();                               // leftmost leaf in key order
+    MVLeafNode* LeafNext(MVNode* node);                    // next leaf in key order
+    void CompactLeaf(MVLeafNode* leafnode);                // merge or relocate one leaf
+    void CompactSweep();                                   // free one empty persistent leaf
+    void CompactQueued(std::chrono::microseconds interval);  // run step & queue next one
   private:
     MVTree(const MVTree&);                                 // prevent copying
     void operator=(const MVTree&);                         // prevent assigning
@@ -210,7 +287,23 @@ class MVTree : public KVEngine {                           // hybrid B+ tree eng
     pool_base pmpool;
     persistent_ptr<MVRoot> kv_root;                                      // pointer to persistent root
     unique_ptr<MVNode> tree_top;                           // pointer to uppermost inner node
+    MVCompaction compaction = {};                          // progress of current compaction
+    MVLeafNode* compact_leaf = nullptr;                    // next leaf to compact in key order
+    persistent_ptr<MVLeaf> compact_prev;                   // last leaf kept by persistent sweep
+    std::unordered_set<uint64_t> compact_free;             // offsets of leaves to free in sweep
+    bool compact_sweeping = false;                         // true when merging/moving is done
+    std::atomic<bool> compact_queued{false};               // background compaction under way
+    size_t compress_threshold = 0;                         // smallest value compressed, 0 if off
     std::shared_mutex shared_mutex;
+    const MVTreeOptions options = MVTreeOptions();         // options chosen when opening
+    std::shared_lock<std::shared_mutex> ReadLock() {       // shared lock, unless single-threaded
+        return options.single_threaded ? std::shared_lock<std::shared_mutex>()
+                                       : std::shared_lock<std::shared_mutex>(shared_mutex);
+    }
+    std::unique_lock<std::shared_mutex> WriteLock() {      // exclusive lock, unless single-threaded
+        return options.single_threaded ? std::unique_lock<std::shared_mutex>()
+                                       : std::unique_lock<std::shared_mutex>(shared_mutex);
+    }
 };
 
 } // namespace mvtree
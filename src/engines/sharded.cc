@@ -0,0 +1,235 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <exception>
+#include <iostream>
+#include <sched.h>
+#include <thread>
+#include <unistd.h>
+#ifdef PMEMKV_USE_NUMA
+#include <numa.h>
+#endif
+#include "sharded.h"
+
+#define DO_LOG 0
+#define LOG(msg) if (DO_LOG) std::cout << "[sharded] " << msg << "\n"
+
+namespace pmemkv {
+namespace sharded {
+
+Sharded::Sharded(const string& path, const size_t size, const string& layout) {
+    vector<string> paths;
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find(',', start);
+        if (end == string::npos) end = path.size();
+        if (end > start) paths.push_back(path.substr(start, end - start));
+        start = end + 1;
+    }
+    if (paths.empty()) throw std::invalid_argument("no path given for sharded engine");
+
+    // expand single path to one pool per node, unless shards already exist on disk,
+    // in which case their count wins so keys keep routing to the same shard
+    const int node_count = NodeCount();
+    if (paths.size() == 1) {
+        const string prefix = paths[0];
+        paths.clear();
+        int existing = 0;
+        while (access((prefix + "." + to_string(existing)).c_str(), F_OK) == 0) existing++;
+        const int count = existing > 0 ? existing : node_count;
+        for (int i = 0; i < count; i++) paths.push_back(prefix + "." + to_string(i));
+    }
+
+    // open every shard from a thread bound to its node, so that the volatile index
+    // rebuilt during recovery is first touched by (and allocated on) the local node
+    const size_t shard_size = size / paths.size();
+    shards.resize(paths.size());
+    nodes.resize(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) nodes[i] = (int) (i % node_count);
+    EveryShard([&](const size_t i) {
+        LOG("Opening shard=" << i << ", node=" << nodes[i] << ", path=" << paths[i]);
+        shards[i].reset(new mvtree::MVTree(paths[i], shard_size, layout));
+    });
+    LOG("Opened ok, shards=" << shards.size());
+}
+
+// Exceptions must not escape a worker thread, which would terminate the process, so they are
+// kept per shard and the first one is rethrown on the calling thread once all workers are done.
+void Sharded::EveryShard(const std::function<void(size_t)>& work) {
+    vector<std::exception_ptr> errors(shards.size());
+    vector<std::thread> workers;
+    for (size_t i = 0; i < shards.size(); i++) {
+        workers.emplace_back([&, i] {
+            try {
+                BindThread(nodes[i]);
+                work(i);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    for (auto& error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+}
+
+Sharded::~Sharded() {
+    LOG("Closing");
+    shards.clear();
+    LOG("Closed ok");
+}
+
+// ===============================================================================================
+// KEY/VALUE METHODS
+// ===============================================================================================
+
+KVStatus Sharded::Get(const int32_t limit, const int32_t keybytes, int32_t* valuebytes,
+                      const char* key, char* value) {
+    return shards[ShardFor(key, (size_t) keybytes)]->Get(limit, keybytes, valuebytes, key, value);
+}
+
+KVStatus Sharded::Get(const string& key, string* value) {
+    return shards[ShardFor(key)]->Get(key, value);
+}
+
+KVStatus Sharded::Put(const string& key, const string& value) {
+    return shards[ShardFor(key)]->Put(key, value);
+}
+
+KVStatus Sharded::Put(const int32_t keybytes, const int32_t valuebytes, const char* key,
+                      const char* value) {
+    return shards[ShardFor(key, (size_t) keybytes)]->Put(keybytes, valuebytes, key, value);
+}
+
+KVStatus Sharded::Remove(const string& key) {
+    return shards[ShardFor(key)]->Remove(key);
+}
+
+KVStatus Sharded::Remove(const int32_t keybytes, const char* key) {
+    return shards[ShardFor(key, (size_t) keybytes)]->Remove(keybytes, key);
+}
+
+void Sharded::Free() {
+    LOG("Free the shards");
+    EveryShard([this](const size_t i) { shards[i]->Free(); });  // free each shard in parallel
+}
+
+PMEMoid Sharded::GetRootOid() {
+    return OID_NULL;                                       // no single root object
+}
+
+PMEMobjpool* Sharded::GetPool() {
+    return nullptr;                                        // no single pool
+}
+
+void Sharded::ListAllKeyValuePairs(vector<string>& kv_pairs) {
+    for (auto& shard : shards) shard->ListAllKeyValuePairs(kv_pairs);
+}
+
+void Sharded::ListAllKeys(vector<string>& keys) {
+    for (auto& shard : shards) shard->ListAllKeys(keys);
+}
+
+size_t Sharded::TotalNumKeys() {
+    size_t total = 0;
+    for (auto& shard : shards) total += shard->TotalNumKeys();
+    return total;
+}
+
+void Sharded::Prefault(const size_t threads, const bool huge_pages) {
+    const size_t per_shard = std::max(threads / shards.size(), (size_t) 1);
+    EveryShard([&](const size_t i) {                       // fault pages from the owning node
+        shards[i]->Prefault(per_shard, huge_pages);
+    });
+}
+
+bool Sharded::CompressValues(const size_t threshold) {
+    bool supported = true;
+    for (auto& shard : shards) supported = shard->CompressValues(threshold) && supported;
+    return supported;
+}
+
+// ===============================================================================================
+// SHARD ROUTING & NUMA METHODS
+// ===============================================================================================
+
+// FNV-1a is used (rather than std::hash) since shard placement is persistent
+size_t Sharded::ShardFor(const char* key, const size_t keybytes) const {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < keybytes; i++) {
+        hash ^= (uint8_t) key[i];
+        hash *= 1099511628211ull;
+    }
+    return (size_t) (hash % shards.size());
+}
+
+int Sharded::NodeCount() {
+#ifdef PMEMKV_USE_NUMA
+    if (numa_available() >= 0) {
+        const int count = numa_num_configured_nodes();
+        if (count > 0) return count;
+    }
+#endif
+    return 1;
+}
+
+int Sharded::CurrentNode() {
+#ifdef PMEMKV_USE_NUMA
+    if (numa_available() >= 0) {
+        const int cpu = sched_getcpu();
+        const int node = cpu < 0 ? -1 : numa_node_of_cpu(cpu);
+        if (node >= 0) return node;
+    }
+#endif
+    return 0;
+}
+
+bool Sharded::BindThread(const int node) {
+#ifdef PMEMKV_USE_NUMA
+    if (numa_available() >= 0 && node >= 0 && node <= numa_max_node()) {
+        if (numa_run_on_node(node) != 0) return false;
+        numa_set_preferred(node);                          // volatile allocations go local
+        return true;
+    }
+#endif
+    return node == 0;
+}
+
+static const bool registered = KVEngineRegistry::Register(ENGINE, [](const string& path, const size_t size,
+        const string& layout, const KVConfig& config) -> KVEngine* {
+    return config.empty() ? new Sharded(path, size, layout) : nullptr;
+});
+
+} // namespace sharded
+} // namespace pmemkv
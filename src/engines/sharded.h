@@ -0,0 +1,100 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include "../pmemkv.h"
+#include "mvtree.h"
+
+namespace pmemkv {
+namespace sharded {
+
+const string ENGINE = "sharded";                           // engine identifier
+
+class Sharded : public KVEngine {                          // one pool per NUMA node
+  public:
+    // Path is either a comma-separated list of pools (one per shard, in NUMA node
+    // order) or a single path, which is expanded to "<path>.<node>" for every node.
+    // Size is the total capacity, split evenly across shards when creating pools.
+    Sharded(const string& path, size_t size, const string& layout);
+    ~Sharded();                                            // default destructor
+
+    string Engine() final { return ENGINE; }               // engine identifier
+    KVStatus Get(int32_t limit,                            // copy value to fixed-size buffer
+                 int32_t keybytes,
+                 int32_t* valuebytes,
+                 const char* key,
+                 char* value) final;
+    KVStatus Get(const string& key,                        // append value to std::string
+                 string* value) final;
+    KVStatus Put(const string& key,                        // copy value from std::string
+                 const string& value) final;
+    KVStatus Put(int32_t keybytes,                         // copy value from buffer
+                 int32_t valuebytes,
+                 const char* key,
+                 const char* value) final;
+    KVStatus Remove(const string& key) final;              // remove value for key
+    KVStatus Remove(int32_t keybytes,                      // remove value for key in buffer
+                    const char* key) final;
+
+    void Free() final;
+
+    PMEMoid GetRootOid() final;
+    PMEMobjpool* GetPool() final;
+
+    void ListAllKeyValuePairs(vector<string>& kv_pairs) final;  // list all key value pairs
+    void ListAllKeys(vector<string>& keys) final;          // list all keys
+    size_t TotalNumKeys() final;                           // get total number of keys
+    void Prefault(size_t threads, bool huge_pages) final;  // prefault shards on their nodes
+    bool CompressValues(size_t threshold) final;          // compress values in every shard
+
+    size_t ShardCount() const { return shards.size(); }    // number of shards (pools)
+    size_t ShardFor(const char* key, size_t keybytes) const;  // stable shard for key
+    size_t ShardFor(const string& key) const { return ShardFor(key.data(), key.size()); }
+    int ShardNode(size_t shard) const { return nodes[shard]; }  // NUMA node owning shard
+
+    static int NodeCount();                                // configured NUMA nodes (>= 1)
+    static int CurrentNode();                              // NUMA node of calling thread
+    static bool BindThread(int node);                      // pin calling thread to node
+  private:
+    Sharded(const Sharded&);                               // prevent copying
+    void operator=(const Sharded&);                        // prevent assigning
+    void EveryShard(const std::function<void(size_t)>& work);  // run per shard on its node,
+                                                           // rethrowing first error after join
+    vector<unique_ptr<mvtree::MVTree>> shards;             // shard engines, one per pool
+    vector<int> nodes;                                     // NUMA node for each shard
+};
+
+} // namespace sharded
+} // namespace pmemkv
@@ -30,89 +30,267 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include "engines/blackhole.h"
-#include "engines/kvtree2.h"
-#include "engines/btree.h"
-#include "engines/mvtree.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23                             // since Linux 5.14
+#endif
 
 namespace pmemkv {
 
-KVEngine* KVEngine::Open(const string& engine,
-                         const string& path,
-                         const size_t size,
-                         const string& layout
-                         ) {
+// constructed on first use, as engines register from static initializers of other units
+static std::map<string, KVEngineFactory>& Factories() {
+    static std::map<string, KVEngineFactory> factories;
+    return factories;
+}
+
+static std::map<string, KVEnginePoolFactory>& PoolFactories() {
+    static std::map<string, KVEnginePoolFactory> factories;
+    return factories;
+}
+
+bool KVEngineRegistry::Register(const string& engine, const KVEngineFactory factory) {
+    Factories()[engine] = factory;
+    return true;
+}
+
+bool KVEngineRegistry::Register(const string& engine, const KVEnginePoolFactory factory) {
+    PoolFactories()[engine] = factory;
+    return true;
+}
+
+KVEngineFactory KVEngineRegistry::Find(const string& engine) {
+    auto it = Factories().find(engine);
+    return it == Factories().end() ? nullptr : it->second;
+}
+
+KVEnginePoolFactory KVEngineRegistry::FindPool(const string& engine) {
+    auto it = PoolFactories().find(engine);
+    return it == PoolFactories().end() ? nullptr : it->second;
+}
+
+vector<string> KVEngineRegistry::Engines() {
+    vector<string> engines;
+    for (auto& factory : Factories()) engines.push_back(factory.first);
+    return engines;
+}
+
+// Splits "name" or "name:key=value,key=value" into engine name and options
+static bool ParseEngine(const string& engine, string* name, KVConfig* config) {
+    const size_t colon = engine.find(':');
+    *name = engine.substr(0, colon);
+    if (colon == string::npos) return true;
+    size_t start = colon + 1;
+    while (start <= engine.size()) {
+        size_t end = engine.find(',', start);
+        if (end == string::npos) end = engine.size();
+        const size_t equals = engine.find('=', start);
+        if (equals == string::npos || equals >= end || equals == start) return false;
+        (*config)[engine.substr(start, equals - start)] = engine.substr(equals + 1, end - equals - 1);
+        start = end + 1;
+    }
+    return true;
+}
+
+bool ConfigSize(const KVConfig& config, const string& name, size_t* value) {
+    auto option = config.find(name);
+    if (option == config.end()) return true;
+    const string& text = option->second;
+    if (text.empty() || text.find_first_not_of("0123456789") != string::npos) return false;
+    errno = 0;
+    const unsigned long long parsed = strtoull(text.c_str(), nullptr, 10);
+    if (errno == ERANGE || parsed > SIZE_MAX) return false;
+    *value = (size_t) parsed;
+    return true;
+}
+
+bool ConfigFlag(const KVConfig& config, const string& name, bool* value) {
+    auto option = config.find(name);
+    if (option == config.end()) return true;
+    if (option->second != "0" && option->second != "1") return false;
+    *value = option->second == "1";
+    return true;
+}
+
+bool ConfigOnly(const KVConfig& config, const vector<string>& names) {
+    for (auto& option : config) {
+        if (std::find(names.begin(), names.end(), option.first) == names.end()) return false;
+    }
+    return true;
+}
+
+// Parses the engine name & options, has create make the engine from its name and the options
+// specific to it, then applies the options common to all engines. Returns nullptr on failure.
+template <typename Create>
+static KVEngine* OpenEngine(const string& engine, Create create) {
     try {
-        if (engine == blackhole::ENGINE) {
-            return new blackhole::Blackhole();
-        } else if(engine == mvtree::ENGINE) {
-            return new mvtree::MVTree(path, size, layout);
-        }  else if (engine == kvtree2::ENGINE) {
-            return new kvtree2::KVTree(path, size, layout);
-        } else if (engine == btree::ENGINE) {
-            return new btree::BTreeEngine(path, size, layout);
-        } else {
-            return nullptr;
+        string name;
+        KVConfig config;
+        if (!ParseEngine(engine, &name, &config)) return nullptr;
+
+        // options common to all engines, applied once the engine is open
+        size_t prefault = 0;
+        bool huge_pages = false;
+        size_t compress = 0;
+        if (!ConfigSize(config, "prefault", &prefault) || !ConfigFlag(config, "huge_pages", &huge_pages) ||
+            !ConfigSize(config, "compress", &compress)) return nullptr;
+        if (huge_pages && prefault == 0) return nullptr;            // only requested while prefaulting
+        config.erase("prefault");
+        config.erase("huge_pages");
+        config.erase("compress");
+
+        KVEngine* kv = create(name, config);
+        if (kv == nullptr) return nullptr;
+        try {
+            if (compress > 0 && !kv->CompressValues(compress)) {
+                delete kv;                                          // engine cannot compress
+                return nullptr;
+            }
+            if (prefault > 0) kv->Prefault(prefault, huge_pages);
+        } catch (...) {
+            delete kv;
+            throw;
         }
+        return kv;
     } catch (...) {
         return nullptr;
     }
 }
 
+KVEngine* KVEngine::Open(const string& engine,
+                         const string& path,
+                         const size_t size,
+                         const string& layout
+                         ) {
+    return OpenEngine(engine, [&](const string& name, const KVConfig& config) -> KVEngine* {
+        auto factory = KVEngineRegistry::Find(name);
+        return factory == nullptr ? nullptr : factory(path, size, layout, config);
+    });
+}
+
 KVEngine* KVEngine::Open(const string& engine,           
                          const string& path,           
                          size_t size) {
     return Open(engine, path, size, LAYOUT);
 }
 
-
-
 KVEngine* KVEngine::Open(const string& engine, PMEMobjpool* pop) {
-     try {
-        if(engine == mvtree::ENGINE) {
-            return new mvtree::MVTree(pop);
-        } else {
-            return nullptr;
-        }
-    } catch (...) {
-        return nullptr;
-    } 
+    return OpenEngine(engine, [&](const string& name, const KVConfig& config) -> KVEngine* {
+        auto factory = KVEngineRegistry::FindPool(name);
+        return factory == nullptr ? nullptr : factory(pop, nullptr, config);
+    });
 }
 
 KVEngine* KVEngine::Open(const string& engine, PMEMobjpool* pop, const PMEMoid& oid) {
-    try {
-        if(engine == mvtree::ENGINE) {
-            return new mvtree::MVTree(pop, oid);
-        } else {
-            return nullptr;
-        }
-    } catch (...) {
-        return nullptr;
-    }
+    return OpenEngine(engine, [&](const string& name, const KVConfig& config) -> KVEngine* {
+        auto factory = KVEngineRegistry::FindPool(name);
+        return factory == nullptr ? nullptr : factory(pop, &oid, config);
+    });
 }
 
-
 void KVEngine::Close(KVEngine* kv) {
-    auto engine = kv->Engine();
-    if (engine == blackhole::ENGINE) {
-        delete (blackhole::Blackhole*) kv;
-    } else if (engine == mvtree::ENGINE) {
-        delete (mvtree::MVTree*) kv;
-    } else if (engine == kvtree2::ENGINE) {
-        delete (kvtree2::KVTree*) kv;
-    } else if (engine == btree::ENGINE) {
-        delete (btree::BTreeEngine*) kv;
-    }
-    kv = nullptr;
+    delete kv;
 }
 
 void KVEngine::Free(KVEngine* kv) {
-    auto engine = kv->Engine();
     kv->Free();
     // TODO free and close shall be transactional?
     KVEngine::Close(kv);
 }
 
+KVStatus KVEngine::Put(const int32_t keybytes, const int32_t valuebytes, const char* key,
+                       const char* value) {
+    return Put(string(key, (size_t) keybytes), string(value, (size_t) valuebytes));
+}
+
+KVStatus KVEngine::Remove(const int32_t keybytes, const char* key) {
+    return Remove(string(key, (size_t) keybytes));
+}
+
+void KVEngine::MultiGet(const vector<string>& keys, vector<string>* values,
+                        vector<KVStatus>* statuses) {
+    values->assign(keys.size(), string());
+    statuses->assign(keys.size(), NOT_FOUND);
+    for (size_t i = 0; i < keys.size(); i++) (*statuses)[i] = Get(keys[i], &(*values)[i]);
+}
+
+void KVEngine::MultiGet(const int32_t count, const int32_t* limits, const int32_t* keybytes,
+                        int32_t* valuebytes, const char* const* keys, char* const* values,
+                        KVStatus* statuses) {
+    for (int32_t i = 0; i < count; i++) {
+        statuses[i] = Get(limits[i], keybytes[i], &valuebytes[i], keys[i], values[i]);
+    }
+}
+
+// locate the extent of the pool file mapped at the given address, which may span several
+// mappings once parts of it have been remapped or had their protection changed
+static bool FindMapping(const void* addr, char** start, size_t* length) {
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps == nullptr) return false;
+    bool found = false;
+    char line[4096];
+    char path[4096];
+    string file;
+    unsigned long lo, hi, end = 0;
+    while (fgets(line, sizeof(line), maps) != nullptr) {
+        path[0] = '\0';
+        if (sscanf(line, "%lx-%lx %*s %*s %*s %*s %4095s", &lo, &hi, path) < 2) continue;
+        if (!found) {
+            if ((uintptr_t) addr < lo || (uintptr_t) addr >= hi) continue;
+            found = true;
+            file = path;
+        } else if (lo != end || file.empty() || file != path) {
+            break;
+        }
+        end = hi;
+    }
+    fclose(maps);
+    if (!found) return false;
+    *start = (char*) addr;
+    *length = end - (uintptr_t) addr;
+    struct stat info;
+    if (!file.empty() && stat(file.c_str(), &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        *length = std::min(*length, (size_t) info.st_size);
+    }
+    return true;
+}
+
+static void PrefaultRange(char* start, const size_t length, const size_t page) {
+    if (madvise(start, length, MADV_POPULATE_WRITE) == 0) return;
+    for (size_t offset = 0; offset < length; offset += page) {
+        __atomic_fetch_add(start + offset, 0, __ATOMIC_RELAXED);  // write fault, value unchanged
+    }
+}
+
+void KVEngine::Prefault(const size_t threads, const bool huge_pages) {
+    PMEMobjpool* pop = GetPool();
+    char* start;
+    size_t length;
+    if (pop == nullptr || !FindMapping(pop, &start, &length)) return;
+    if (huge_pages) madvise(start, length, MADV_HUGEPAGE);
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t count = std::max(threads, (size_t) 1);
+    if (count == 1) {
+        PrefaultRange(start, length, page);
+        return;
+    }
+    const size_t chunk = ((length / count) + page - 1) / page * page;
+    vector<std::thread> workers;
+    for (size_t offset = 0; offset < length; offset += chunk) {
+        workers.emplace_back(PrefaultRange, start + offset, std::min(chunk, length - offset), page);
+    }
+    for (auto& worker : workers) worker.join();
+}
+
 extern "C" KVEngine* kvengine_open(const char* engine, const char* path, const size_t size) {
     return KVEngine::Open(engine, path, size);
 };
@@ -143,11 +321,11 @@ extern "C" int8_t kvengine_get(KVEngine* kv, const int32_t limit, const int32_t
 
 extern "C" int8_t kvengine_put(KVEngine* kv, const int32_t keybytes, int32_t* valuebytes,
                                const char* key, const char* value) {
-    return kv->Put(string(key, (size_t) keybytes), string(value, (size_t) *valuebytes));
+    return kv->Put(keybytes, *valuebytes, key, value);
 }
 
 extern "C" int8_t kvengine_remove(KVEngine* kv, const int32_t keybytes, const char* key) {
-    return kv->Remove(string(key, (size_t) keybytes));
+    return kv->Remove(keybytes, key);
 };
 
 extern "C" int8_t kvengine_get_ffi(FFIBuffer* buf) {
@@ -156,12 +334,79 @@ extern "C" int8_t kvengine_get_ffi(FFIBuffer* buf) {
 }
 
 extern "C" int8_t kvengine_put_ffi(const FFIBuffer* buf) {
-    return buf->kv->Put(string(buf->data, (size_t) buf->keybytes),
-                        string(buf->data + buf->keybytes, (size_t) buf->valuebytes));
+    return buf->kv->Put(buf->keybytes, buf->valuebytes, buf->data, buf->data + buf->keybytes);
 }
 
 extern "C" int8_t kvengine_remove_ffi(const FFIBuffer* buf) {
-    return buf->kv->Remove(string(buf->data, (size_t) buf->keybytes));
+    return buf->kv->Remove(buf->keybytes, buf->data);
+}
+
+// Multiget records are sized by limit and write batch records by valuebytes, so records of
+// either batch can be walked without reading anything written back by the call.
+size_t FFIRecordSize(const int32_t keybytes, const int32_t valuebytes) {
+    const size_t size = sizeof(FFIRecord) + (size_t) std::max(keybytes, 0) + (size_t) std::max(valuebytes, 0);
+    return (size + FFI_RECORD_ALIGN - 1) & ~((size_t) FFI_RECORD_ALIGN - 1);
+}
+
+static FFIRecord* NextRecord(FFIRecord* record, const int32_t valuebytes) {
+    return (FFIRecord*) ((char*) record + FFIRecordSize(record->keybytes, valuebytes));
+}
+
+// Keys are read and values written in place, so only pointers into the batch are gathered.
+extern "C" int8_t kvengine_multiget_ffi(FFIBatch* batch) {
+    const auto count = (size_t) std::max(batch->count, 0);
+    vector<int32_t> limits(count), keybytes(count), valuebytes(count);
+    vector<const char*> keys(count);
+    vector<char*> values(count);
+    vector<FFIRecord*> records(count);
+    auto record = (FFIRecord*) batch->data;
+    for (size_t i = 0; i < count; i++) {
+        records[i] = record;
+        limits[i] = record->limit;
+        keybytes[i] = record->keybytes;
+        valuebytes[i] = record->valuebytes;
+        keys[i] = record->data;
+        values[i] = record->data + record->keybytes;
+        record = NextRecord(record, record->limit);
+    }
+    vector<KVStatus> statuses(count, NOT_FOUND);
+    batch->kv->MultiGet((int32_t) count, limits.data(), keybytes.data(), valuebytes.data(),
+                        keys.data(), values.data(), statuses.data());   // engine may interleave
+    int8_t result = OK;
+    for (size_t i = 0; i < count; i++) {
+        records[i]->valuebytes = valuebytes[i];
+        records[i]->status = statuses[i];
+        if (statuses[i] == FAILED) result = FAILED;
+    }
+    return result;
+}
+
+extern "C" int8_t kvengine_write_batch_ffi(FFIBatch* batch) {
+    int8_t result = OK;
+    auto record = (FFIRecord*) batch->data;
+    for (int32_t i = 0; i < batch->count; i++) {
+        if (record->valuebytes < 0) {
+            record->status = batch->kv->Remove(record->keybytes, record->data);
+        } else {
+            record->status = batch->kv->Put(record->keybytes, record->valuebytes, record->data,
+                                            record->data + record->keybytes);
+        }
+        if (record->status == FAILED) result = FAILED;
+        record = NextRecord(record, record->valuebytes);
+    }
+    return result;
+}
+
+extern "C" void kvengine_prefault(KVEngine* kv, const size_t threads, const int8_t huge_pages) {
+    kv->Prefault(threads, huge_pages != 0);
+}
+
+extern "C" int8_t kvengine_compress_values(KVEngine* kv, const size_t threshold) {
+    return kv->CompressValues(threshold) ? OK : FAILED;
+}
+
+extern "C" void kvengine_cache_inner_nodes(KVEngine* kv, const int8_t enabled) {
+    kv->CacheInnerNodes(enabled != 0);
 }
 
 extern "C" PMEMoid kvengine_get_rootoid(KVEngine* kv) {
@@ -40,6 +40,7 @@ typedef enum {                                             // status enumeration
 
 #ifdef __cplusplus
 
+#include <cstddef>
 #include <string>
 #include <libpmemobj++/make_persistent.hpp>
 #include <libpmemobj++/make_persistent_array.hpp>
@@ -48,6 +49,7 @@ typedef enum {                                             // status enumeration
 #include <libpmemobj++/transaction.hpp>
 #include <libpmemobj++/make_persistent_atomic.hpp>
 
+#include <map>
 #include <vector>
 
 
@@ -59,9 +61,16 @@ namespace pmemkv {
 
 const string LAYOUT = "pmemkv";                            // pool layout identifier
 
+typedef std::map<string, string> KVConfig;                 // engine options by name
+
 class KVEngine {                                           // storage engine implementations
   public:
-    // Open a pmemobj_root based KVEngine
+    virtual ~KVEngine() = default;                         // engines are deleted by Close
+
+    // Open a pmemobj_root based KVEngine. The engine name may be followed by options,
+    // as in "btree:degree=32,value=64". Options common to all engines are applied here
+    // (prefault=threads, huge_pages=0|1, compress=bytes) and the rest are passed to the
+    // engine as a KVConfig, which fails the open when any of them is not recognized.
     static KVEngine* Open(const string& engine,            // open storage engine
                           const string& path,              // path to persistent pool
                           size_t size);                    // size used when creating pool
@@ -97,6 +106,32 @@ class KVEngine {                                           // storage engine imp
     virtual KVStatus Put(const string& key,                // copy value from std::string
                          const string& value) = 0;
     virtual KVStatus Remove(const string& key) = 0;        // remove value for key
+
+    // Put and Remove of keys & values held in caller buffers, used by the C API so that
+    // data is copied only into the engine. Engines that do not override these copy the
+    // buffers into strings and call the methods above.
+    virtual KVStatus Put(int32_t keybytes,                 // copy value from buffer
+                         int32_t valuebytes,
+                         const char* key,
+                         const char* value);
+    virtual KVStatus Remove(int32_t keybytes,              // remove value for key in buffer
+                            const char* key);
+
+    // Get the value of every key, replacing values and statuses with one entry per key.
+    // Engines may interleave the lookups so that their persistent memory reads overlap.
+    virtual void MultiGet(const vector<string>& keys,      // get values for several keys
+                          vector<string>* values,
+                          vector<KVStatus>* statuses);
+
+    // Get the value of every key into its fixed-size buffer as the Get above does, used by
+    // the C API so that keys are read in place and values copied only into caller buffers.
+    virtual void MultiGet(int32_t count,                   // get values for several keys
+                          const int32_t* limits,           // into caller buffers
+                          const int32_t* keybytes,
+                          int32_t* valuebytes,
+                          const char* const* keys,
+                          char* const* values,
+                          KVStatus* statuses);
     virtual void Free() = 0;        // remove value for key
 
     virtual PMEMoid GetRootOid() = 0;
@@ -108,8 +143,67 @@ class KVEngine {                                           // storage engine imp
 
     virtual size_t TotalNumKeys() = 0; // get total number of keys.
 
+    // Fault in every page of the pool(s) up front, optionally from parallel threads,
+    // so first-touch page faults are not paid by the first requests after open.
+    // With huge_pages set, transparent huge pages are also requested for the mapping.
+    virtual void Prefault(size_t threads,                  // prefault mapped pool pages
+                          bool huge_pages);
+
+    // Store values of at least threshold bytes compressed, when that saves space.
+    // Values already stored stay readable whatever the setting, and 0 turns it off.
+    // Returns false, changing nothing, when the engine does not support compression.
+    virtual bool CompressValues(size_t threshold) {        // compress large values
+        return threshold == 0;
+    }
+
+    // Keep a volatile copy of persistent inner index nodes in DRAM, so lookups only read
+    // leaves from persistent memory. Must not be called concurrently with other methods.
+    // Engines whose inner index already lives in DRAM ignore this.
+    virtual void CacheInnerNodes(bool enabled) {}          // mirror inner nodes in DRAM
+
+    // Append up to limit key/value pairs with keys less than before to kv_pairs, as key
+    // and value in turn, greatest key first. An empty before starts from the greatest key.
+    // Engines that do not keep keys ordered return FAILED.
+    virtual KVStatus ReverseScan(const string& before,      // list pairs in descending order
+                                 size_t limit,
+                                 vector<string>& kv_pairs) { return FAILED; }
+
 };
 
+// Creates an engine for a pool, or returns nullptr (or throws) when the options don't apply.
+typedef KVEngine* (*KVEngineFactory)(const string& path, size_t size,
+                                     const string& layout, const KVConfig& config);
+
+// Creates an engine within a pool the caller has opened, at its root object when oid is
+// nullptr, or at the object *oid (a new one when *oid is OID_NULL) otherwise.
+typedef KVEngine* (*KVEnginePoolFactory)(PMEMobjpool* pop, const PMEMoid* oid,
+                                         const KVConfig& config);
+
+// Engines register a factory under their name, usually from a static initializer of their
+// own translation unit, so that KVEngine::Open finds them without a list of all engines.
+// Engines that can live in a pool opened by the caller also register a pool factory.
+class KVEngineRegistry {
+  public:
+    static bool Register(const string& engine,             // add engine, returns true so it
+                         KVEngineFactory factory);         // can initialize a static
+    static bool Register(const string& engine,             // add engine opened within pools
+                         KVEnginePoolFactory factory);
+    static KVEngineFactory Find(const string& engine);     // factory for name w/o options
+    static KVEnginePoolFactory FindPool(const string& engine);  // pool factory, if any
+    static vector<string> Engines();                       // names of registered engines
+};
+
+// Helpers reading options in engine factories. Options not present leave the value as is,
+// and each helper returns false when the option is present but malformed.
+bool ConfigSize(const KVConfig& config,                    // read non-negative integer
+                const string& name,
+                size_t* value);
+bool ConfigFlag(const KVConfig& config,                    // read 0 or 1
+                const string& name,
+                bool* value);
+bool ConfigOnly(const KVConfig& config,                    // false if any option not in names
+                const vector<string>& names);
+
 #pragma pack(push, 1)
 struct FFIBuffer {                                         // FFI buffer providing all params
     KVEngine* kv;
@@ -118,8 +212,34 @@ struct FFIBuffer {                                         // FFI buffer providi
     int32_t valuebytes;
     char data[];
 };
+
+struct FFIBatch {                                          // FFI buffer holding many records
+    KVEngine* kv;
+    int32_t count;                                         // count of records packed in data
+    char data[];                                           // records, each followed by the next
+};
 #pragma pack(pop)
 
+// Records are not packed: fields sit at fixed, naturally aligned offsets, and each record
+// starts at an offset of the batch rounded up to FFI_RECORD_ALIGN (see FFIRecordSize).
+#define FFI_RECORD_ALIGN 4                                 // alignment of records within batch
+
+struct FFIRecord {                                         // record within batched FFI buffer
+    int32_t limit;                                         // space for value (multiget only)
+    int32_t keybytes;
+    int32_t valuebytes;                                    // -1 removes key (write batch only)
+    int8_t status;                                         // status written back per record
+    int8_t reserved[3];                                    // padding, ignored
+    char data[];                                           // key, then value or space for value
+};
+
+static_assert(sizeof(FFIRecord) == 16 && alignof(FFIRecord) == FFI_RECORD_ALIGN, "FFIRecord layout");
+static_assert(offsetof(FFIBatch, data) % FFI_RECORD_ALIGN == 0, "FFIBatch records misaligned");
+
+// bytes from the start of a record to the next, for a value (or space for one) of valuebytes
+size_t FFIRecordSize(int32_t keybytes,
+                     int32_t valuebytes);
+
 extern "C" {
 #endif
 
@@ -130,6 +250,8 @@ struct KVEngine;                                           // define types as si
 typedef struct KVEngine KVEngine;
 struct FFIBuffer;
 typedef struct FFIBuffer FFIBuffer;
+struct FFIBatch;
+typedef struct FFIBatch FFIBatch;
 
 KVEngine* kvengine_open(const char* engine,                // open storage engine
                         const char* path,
@@ -172,6 +294,22 @@ int8_t kvengine_get_ffi(FFIBuffer* buf);                   // FFI optimized meth
 int8_t kvengine_put_ffi(const FFIBuffer* buf);
 int8_t kvengine_remove_ffi(const FFIBuffer* buf);
 
+// Batched FFI methods process all records of the buffer in one call, writing status (and
+// for multiget value & valuebytes) back into each record. FAILED is returned if any record
+// failed, and OK otherwise. A write batch is applied in order but is not atomic.
+int8_t kvengine_multiget_ffi(FFIBatch* batch);             // get value for every record
+int8_t kvengine_write_batch_ffi(FFIBatch* batch);          // put or remove every record
+
+void kvengine_prefault(KVEngine* kv,                      // prefault mapped pool pages
+                       size_t threads,
+                       int8_t huge_pages);
+
+int8_t kvengine_compress_values(KVEngine* kv,             // compress large values, FAILED
+                                size_t threshold);         // if engine cannot compress
+
+void kvengine_cache_inner_nodes(KVEngine* kv,             // mirror inner nodes in DRAM
+                                int8_t enabled);
+
 PMEMoid kvengine_get_rootoid(KVEngine* kv);
 PMEMobjpool* kvengine_get_pool(KVEngine* kv);
 
@@ -30,6 +30,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <cstdio>
 #include <cstdlib>
@@ -39,6 +40,7 @@
 #include "mutexlock.h"
 #include "random.h"
 #include "pmemkv.h"
+#include "engines/btree.h"
 
 static const string USAGE =
         "pmemkv_bench\n"
@@ -52,6 +54,13 @@ static const string USAGE =
         "--reads=<integer>          (number of read operations, default: 1000000)\n"
         "--threads=<integer>        (number of concurrent threads, default: 1)\n"
         "--value_size=<integer>     (size of values in bytes, default: 100)\n"
+        "--prefault_threads=<int>   (threads used to prefault pool pages at open, default: 0)\n"
+        "--huge_pages=<0|1>         (request transparent huge pages while prefaulting, default: 0)\n"
+        "--compress=<integer>       (compress values of at least this many bytes, default: 0)\n"
+        "--cache_inner=<0|1>        (mirror persistent inner nodes in DRAM, default: 0)\n"
+        "--int_keys=<0|1>           (use 8-byte integer keys, as btree_u64 expects, default: 0)\n"
+        "--btree_sweep=<0|1>        (run benchmarks for each registered btree geometry, default: 0)\n"
+        "                           (note: geometries whose values are too small are skipped)\n"
         "--benchmarks=<name>,       (comma-separated list of benchmarks to run)\n"
         "    fillseq                (load N values in sequential key order)\n"
         "    fillrandom             (load N values in random key order)\n"
@@ -93,8 +102,34 @@ static const char *FLAGS_db = NULL;
 // Use following size when opening the database.
 static int FLAGS_db_size_in_gb = 0;
 
+// Number of threads used to prefault pool pages after opening (0 to skip prefaulting).
+static int FLAGS_prefault_threads = 0;
+
+// Request transparent huge pages for pool mappings.
+static bool FLAGS_huge_pages = false;
+
+// Compress values of at least this many bytes (0 to store values uncompressed).
+static int FLAGS_compress = 0;
+
+// Keep a DRAM copy of persistent inner index nodes.
+static bool FLAGS_cache_inner = false;
+
+// Use the 8 bytes of an integer as keys instead of 16 decimal digits.
+static bool FLAGS_int_keys = false;
+
+// Run benchmarks once per registered btree geometry, replacing --engine.
+static bool FLAGS_btree_sweep = false;
+
 using namespace leveldb;
 
+// Minor & major page faults taken by this process so far
+static void PageFaults(long *minor, long *major) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    *minor = usage.ru_minflt;
+    *major = usage.ru_majflt;
+}
+
 leveldb::Env *g_env = NULL;
 
 #if defined(__linux)
@@ -113,6 +148,17 @@ static Slice TrimSpace(Slice s) {
 
 #endif
 
+// Key for entry k, or a key that is never written when missing is set
+static string BenchKey(const int k, const bool missing) {
+    if (FLAGS_int_keys) {
+        const uint64_t key = missing ? (uint64_t) k | (1ull << 63) : (uint64_t) k;
+        return string((const char*) &key, sizeof(key));
+    }
+    char key[100];
+    snprintf(key, sizeof(key), missing ? "%016d!" : "%016d", k);
+    return key;
+}
+
 static void AppendWithSpace(std::string *str, Slice msg) {
     if (msg.empty()) return;
     if (!str->empty()) {
@@ -337,7 +383,7 @@ public:
     }
 
     ~Benchmark() {
-        delete kv_;
+        if (kv_ != NULL) pmemkv::KVEngine::Close(kv_);
     }
 
     void Run() {
@@ -470,6 +516,8 @@ private:
             shared.cv.Wait();
         }
 
+        long minflt, majflt, start_minflt, start_majflt;
+        PageFaults(&start_minflt, &start_majflt);
         shared.start = true;
         shared.cv.SignalAll();
         while (shared.num_done < n) {
@@ -480,6 +528,10 @@ private:
         for (int i = 1; i < n; i++) {
             arg[0].thread->stats.Merge(arg[i].thread->stats);
         }
+        PageFaults(&minflt, &majflt);
+        char msg[100];
+        snprintf(msg, sizeof(msg), "(%ld minor / %ld major faults)", minflt - start_minflt, majflt - start_majflt);
+        arg[0].thread->stats.AddMessage(msg);
         arg[0].thread->stats.Report(name);
 
         for (int i = 0; i < n; i++) {
@@ -490,13 +542,32 @@ private:
 
     void Open() {
         assert(kv_ == NULL);
+        string engine = FLAGS_engine;
+        if (FLAGS_prefault_threads > 0) {
+            engine += engine.find(':') == string::npos ? ":" : ",";
+            engine += "prefault=" + std::to_string(FLAGS_prefault_threads);
+        }
+        if (FLAGS_huge_pages) {                                  // fails to open without prefault
+            engine += engine.find(':') == string::npos ? ":" : ",";
+            engine += "huge_pages=1";
+        }
+        long minflt, majflt, start_minflt, start_majflt;
+        PageFaults(&start_minflt, &start_majflt);
         auto start = g_env->NowMicros();
-        kv_ = pmemkv::KVEngine::Open(FLAGS_engine, FLAGS_db, ((size_t) 1024 * 1024 * 1024 * FLAGS_db_size_in_gb), LAYOUT);
+        kv_ = pmemkv::KVEngine::Open(engine, FLAGS_db, ((size_t) 1024 * 1024 * 1024 * FLAGS_db_size_in_gb), LAYOUT);
         if (kv_ == nullptr) {
             fprintf(stderr, "Cannot open db (%s) with %i GB capacity\n", FLAGS_db, FLAGS_db_size_in_gb);
             exit(-42);
         }
-        fprintf(stdout, "%-12s : %11.3f millis/op;\n", "open", ((g_env->NowMicros() - start) * 1e-3));
+        PageFaults(&minflt, &majflt);
+        fprintf(stdout, "%-12s : %11.3f millis/op; (%d prefault threads, huge pages %s, %ld minor / %ld major faults)\n",
+                "open", ((g_env->NowMicros() - start) * 1e-3), FLAGS_prefault_threads,
+                FLAGS_huge_pages ? "on" : "off", minflt - start_minflt, majflt - start_majflt);
+        if (FLAGS_compress > 0 && !kv_->CompressValues((size_t) FLAGS_compress)) {
+            fprintf(stderr, "Engine %s does not support compression\n", FLAGS_engine);
+            exit(1);
+        }
+        if (FLAGS_cache_inner) kv_->CacheInnerNodes(true);
     }
 
     void DoWrite(ThreadState *thread, bool seq) {
@@ -510,12 +581,11 @@ private:
         int64_t bytes = 0;
         for (int i = 0; i < num_; i++) {
             const int k = seq ? i : (thread->rand.Next() % FLAGS_num);
-            char key[100];
-            snprintf(key, sizeof(key), "%016d", k);
+            const string key = BenchKey(k, false);
             string value = string();
             value.append(value_size_, 'X');
             s = kv_->Put(key, value);
-            bytes += value_size_ + strlen(key);
+            bytes += value_size_ + key.size();
             thread->stats.FinishedSingleOp();
             if (s != OK) {
                 fprintf(stdout, "Out of space at key %i\n", i);
@@ -539,12 +609,11 @@ private:
         int found = 0;
         for (int i = 0; i < reads_; i++) {
             const int k = seq ? i : (thread->rand.Next() % FLAGS_num);
-            char key[100];
-            snprintf(key, sizeof(key), missing ? "%016d!" : "%016d", k);
+            const string key = BenchKey(k, missing);
             string value;
             if (kv_->Get(key, &value) == OK) found++;
             thread->stats.FinishedSingleOp();
-            bytes += value.length() + strlen(key);
+            bytes += value.length() + key.size();
         }
         thread->stats.AddBytes(bytes);
         char msg[100];
@@ -567,9 +636,7 @@ private:
     void DoDelete(ThreadState *thread, bool seq) {
         for (int i = 0; i < num_; i++) {
             const int k = seq ? i : (thread->rand.Next() % FLAGS_num);
-            char key[100];
-            snprintf(key, sizeof(key), "%016d", k);
-            kv_->Remove(key);
+            kv_->Remove(BenchKey(k, false));
             thread->stats.FinishedSingleOp();
         }
     }
@@ -616,6 +683,18 @@ int main(int argc, char **argv) {
             FLAGS_db = argv[i] + 5;
         } else if (sscanf(argv[i], "--db_size_in_gb=%d%c", &n, &junk) == 1) {
             FLAGS_db_size_in_gb = n;
+        } else if (sscanf(argv[i], "--prefault_threads=%d%c", &n, &junk) == 1) {
+            FLAGS_prefault_threads = n;
+        } else if (sscanf(argv[i], "--huge_pages=%d%c", &n, &junk) == 1 && (n == 0 || n == 1)) {
+            FLAGS_huge_pages = n;
+        } else if (sscanf(argv[i], "--compress=%d%c", &n, &junk) == 1 && n >= 0) {
+            FLAGS_compress = n;
+        } else if (sscanf(argv[i], "--cache_inner=%d%c", &n, &junk) == 1 && (n == 0 || n == 1)) {
+            FLAGS_cache_inner = n;
+        } else if (sscanf(argv[i], "--int_keys=%d%c", &n, &junk) == 1 && (n == 0 || n == 1)) {
+            FLAGS_int_keys = n;
+        } else if (sscanf(argv[i], "--btree_sweep=%d%c", &n, &junk) == 1 && (n == 0 || n == 1)) {
+            FLAGS_btree_sweep = n;
         } else {
             fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
             exit(1);
@@ -629,7 +708,25 @@ int main(int argc, char **argv) {
 
     // Run benchmark against default environment
     g_env = leveldb::Env::Default();
-    Benchmark benchmark;
-    benchmark.Run();
+    if (!FLAGS_btree_sweep) {
+        Benchmark benchmark;
+        benchmark.Run();
+        return 0;
+    }
+
+    // Run the same benchmarks against a fresh pool for each btree geometry
+    for (auto& geometry : pmemkv::btree::Geometries()) {
+        size_t degree, key_size, value_size = pmemkv::btree::MAX_VALUE_SIZE;
+        sscanf(geometry.c_str(), "btree:degree=%zu,key=%zu,value=%zu", &degree, &key_size, &value_size);
+        if (value_size < (size_t) FLAGS_value_size) {
+            fprintf(stdout, "Skipping %s\n", geometry.c_str());
+            continue;
+        }
+        FLAGS_engine = geometry.c_str();
+        if (FLAGS_db_size_in_gb > 0) std::remove(FLAGS_db);
+        Benchmark benchmark;
+        benchmark.Run();
+        fprintf(stdout, "\n");
+    }
     return 0;
 }
@@ -0,0 +1,529 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <libpmem.h>
+#include "pmemkv.h"
+
+using namespace pmemkv;
+using std::vector;
+
+static const string USAGE =
+        "pmemkv_stress\n"
+        "--engine=<name>            (storage engine name, default: kvtree2)\n"
+        "--db=<location>            (path to scratch pool, default: /dev/shm/pmemkv)\n"
+        "                           (note: persistence calls are simulated, pool is not durable)\n"
+        "--db_size_in_mb=<integer>  (size of persistent pool to create in MB, default: 128)\n"
+        "--rounds=<integer>         (number of crash & recovery rounds, default: 20)\n"
+        "--ops=<integer>            (number of operations per round, default: 10000)\n"
+        "--keys=<integer>           (number of distinct keys, default: 5000)\n"
+        "--threads=<integer>        (concurrent threads, thread-safe engines only, default: 1)\n"
+        "--value_size=<integer>     (maximum size of values in bytes, default: 100)\n"
+        "--removes=<0-100>          (percentage of operations that are removes, default: 20)\n"
+        "--evict=<0-100>            (chance that an unflushed line persists at crash, default: 0)\n"
+        "--seed=<integer>           (random seed, default: time based)\n";
+
+// Storage engine to stress
+static const char* FLAGS_engine = "kvtree2";
+
+// Path of the pool, crash images are written next to it
+static const char* FLAGS_db = "/dev/shm/pmemkv";
+
+// Size of the pool in MB when creating it
+static int FLAGS_db_size_in_mb = 128;
+
+// Number of crash & recovery rounds
+static int FLAGS_rounds = 20;
+
+// Number of operations per round, split between threads
+static int FLAGS_ops = 10000;
+
+// Number of distinct keys
+static int FLAGS_keys = 5000;
+
+// Number of concurrent threads
+static int FLAGS_threads = 1;
+
+// Maximum size of values, actual sizes are random
+static int FLAGS_value_size = 100;
+
+// Percentage of operations that are removes
+static int FLAGS_removes = 20;
+
+// Percentage of dirty but unflushed cache lines that still persist at crash
+static int FLAGS_evict = 0;
+
+// Random seed
+static unsigned FLAGS_seed = 0;
+
+#define CACHELINE 64                                       // unit of persistence
+#define CRASH_EXIT 99                                      // child exit code after crash
+#define FAILED_EXIT 98                                     // child exit code on open failure
+
+// ===============================================================================================
+// SIMULATED PERSISTENCE DOMAIN
+// ===============================================================================================
+
+// Persistence calls of libpmem are interposed for the pool being tracked. Flushed cache lines
+// are captured at flush time and only reach the shadow copy (the persistence domain) at the
+// next fence issued by the same thread. A crash writes the shadow copy out as the pool image,
+// so stores that were never flushed and fenced are lost, as they would be on power failure.
+
+struct PendingLine {                                       // flushed line awaiting fence
+    size_t offset;                                         // offset of line within pool
+    char data[CACHELINE];                                  // line contents at flush time
+};
+
+static char* g_pool = nullptr;                             // tracked pool (null if none)
+static size_t g_pool_size = 0;                             // size of tracked pool
+static char* g_shadow = nullptr;                           // contents of persistence domain
+static std::mutex g_shadow_mutex;                          // protects shadow & crash
+static std::atomic<uint64_t> g_fences(0);                  // fences issued while tracking
+static uint64_t g_crash_at = 0;                            // fence to crash at, 0 for none
+static thread_local vector<PendingLine> t_pending;         // flushed but unfenced lines
+
+static void Flush(const void* addr, const size_t len) {
+    char* pool = g_pool;
+    if (pool == nullptr || len == 0) return;
+    auto start = (const char*) addr;
+    if (start < pool || start >= pool + g_pool_size) return;
+    size_t first = (size_t) (start - pool) & ~((size_t) CACHELINE - 1);
+    size_t last = std::min((size_t) (start - pool) + len, g_pool_size);
+    for (size_t offset = first; offset < last; offset += CACHELINE) {
+        t_pending.emplace_back();
+        t_pending.back().offset = offset;
+        memcpy(t_pending.back().data, pool + offset, CACHELINE);
+    }
+}
+
+static void Crash() {
+    // flushed but unfenced lines of this thread may or may not have reached the domain
+    unsigned rnd = (unsigned) g_crash_at;
+    for (auto& line : t_pending) {
+        if (rand_r(&rnd) % 2) memcpy(g_shadow + line.offset, line.data, CACHELINE);
+    }
+
+    // dirty lines may also have been evicted from caches without any flush
+    if (FLAGS_evict > 0) {
+        for (size_t offset = 0; offset < g_pool_size; offset += CACHELINE) {
+            if (memcmp(g_shadow + offset, g_pool + offset, CACHELINE) == 0) continue;
+            if ((int) (rand_r(&rnd) % 100) < FLAGS_evict) memcpy(g_shadow + offset, g_pool + offset, CACHELINE);
+        }
+    }
+
+    // write crash image beside the pool, other threads keep writing to the pool itself
+    string image = string(FLAGS_db) + ".crash";
+    int fd = open(image.c_str(), O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    size_t written = 0;
+    while (fd >= 0 && written < g_pool_size) {
+        ssize_t n = write(fd, g_shadow + written, g_pool_size - written);
+        if (n <= 0) break;
+        written += (size_t) n;
+    }
+    if (fd >= 0) fsync(fd);
+    _exit(written == g_pool_size ? CRASH_EXIT : FAILED_EXIT);
+}
+
+static void Drain() {
+    if (g_pool == nullptr) {
+        t_pending.clear();
+        return;
+    }
+    uint64_t fence = ++g_fences;
+    std::lock_guard<std::mutex> lock(g_shadow_mutex);
+    if (g_crash_at > 0 && fence >= g_crash_at) Crash();    // crash before fence completes
+    for (auto& line : t_pending) memcpy(g_shadow + line.offset, line.data, CACHELINE);
+    t_pending.clear();
+}
+
+static void Track(KVEngine* kv) {
+    struct stat st;
+    if (stat(FLAGS_db, &st) != 0) return;
+    g_shadow = (char*) malloc((size_t) st.st_size);
+    if (g_shadow == nullptr) return;
+    memcpy(g_shadow, kv->GetPool(), (size_t) st.st_size);  // pool was persisted by open
+    g_pool_size = (size_t) st.st_size;
+    g_pool = (char*) kv->GetPool();
+}
+
+static void Untrack() {
+    std::lock_guard<std::mutex> lock(g_shadow_mutex);
+    g_pool = nullptr;
+}
+
+extern "C" {
+
+void pmem_flush(const void* addr, size_t len) {
+    Flush(addr, len);
+}
+
+void pmem_drain(void) {
+    Drain();
+}
+
+void pmem_persist(const void* addr, size_t len) {
+    Flush(addr, len);
+    Drain();
+}
+
+int pmem_msync(const void* addr, size_t len) {
+    Flush(addr, len);
+    Drain();
+    return 0;
+}
+
+void* pmem_memcpy_nodrain(void* pmemdest, const void* src, size_t len) {
+    memcpy(pmemdest, src, len);
+    Flush(pmemdest, len);
+    return pmemdest;
+}
+
+void* pmem_memcpy_persist(void* pmemdest, const void* src, size_t len) {
+    pmem_memcpy_nodrain(pmemdest, src, len);
+    Drain();
+    return pmemdest;
+}
+
+void* pmem_memmove_nodrain(void* pmemdest, const void* src, size_t len) {
+    memmove(pmemdest, src, len);
+    Flush(pmemdest, len);
+    return pmemdest;
+}
+
+void* pmem_memmove_persist(void* pmemdest, const void* src, size_t len) {
+    pmem_memmove_nodrain(pmemdest, src, len);
+    Drain();
+    return pmemdest;
+}
+
+void* pmem_memset_nodrain(void* pmemdest, int c, size_t len) {
+    memset(pmemdest, c, len);
+    Flush(pmemdest, len);
+    return pmemdest;
+}
+
+void* pmem_memset_persist(void* pmemdest, int c, size_t len) {
+    pmem_memset_nodrain(pmemdest, c, len);
+    Drain();
+    return pmemdest;
+}
+
+#ifdef PMEM_F_MEM_NODRAIN
+static void FinishMem(void* pmemdest, size_t len, unsigned flags) {
+    if (flags & PMEM_F_MEM_NOFLUSH) return;
+    Flush(pmemdest, len);
+    if (!(flags & PMEM_F_MEM_NODRAIN)) Drain();
+}
+
+void* pmem_memcpy(void* pmemdest, const void* src, size_t len, unsigned flags) {
+    memcpy(pmemdest, src, len);
+    FinishMem(pmemdest, len, flags);
+    return pmemdest;
+}
+
+void* pmem_memmove(void* pmemdest, const void* src, size_t len, unsigned flags) {
+    memmove(pmemdest, src, len);
+    FinishMem(pmemdest, len, flags);
+    return pmemdest;
+}
+
+void* pmem_memset(void* pmemdest, int c, size_t len, unsigned flags) {
+    memset(pmemdest, c, len);
+    FinishMem(pmemdest, len, flags);
+    return pmemdest;
+}
+#endif
+
+} // extern "C"
+
+// ===============================================================================================
+// WORKLOAD
+// ===============================================================================================
+
+struct LogRecord {                                         // written by child, read by parent
+    char kind;                                             // 'p'ut, 'r'emove, 'e'nd, 'f'ences
+    uint8_t status;                                        // KVStatus when kind is 'e'nd
+    uint32_t key;                                          // key index
+    uint64_t version;                                      // value version, or fence count
+};
+
+static int g_log = -1;                                     // write end of log pipe
+
+static void Log(const char kind, const KVStatus status, const uint32_t key, const uint64_t version) {
+    LogRecord record = {kind, (uint8_t) status, key, version};
+    ssize_t n = write(g_log, &record, sizeof(record));     // atomic, less than PIPE_BUF
+    (void) n;
+}
+
+static string MakeKey(const uint32_t key) {
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), "%08u", key);
+    return string(buffer);
+}
+
+static string MakeValue(const uint32_t key, const uint64_t version) {
+    std::mt19937_64 rng(version ^ ((uint64_t) key << 40));
+    string value(1 + rng() % FLAGS_value_size, ' ');
+    for (auto& c : value) c = (char) ('a' + rng() % 26);
+    return value;
+}
+
+static void Worker(KVEngine* kv, const int round, const int thread) {
+    std::mt19937_64 rng(FLAGS_seed + (uint64_t) round * 1000 + thread);
+    const uint32_t owned = (uint32_t) std::max(FLAGS_keys / FLAGS_threads, 1);
+    for (int i = thread; i < FLAGS_ops; i += FLAGS_threads) {
+        const uint32_t key = thread + FLAGS_threads * (uint32_t) (rng() % owned);  // keys per thread
+        const uint64_t version = rng();
+        if ((int) (rng() % 100) < FLAGS_removes) {
+            Log('r', OK, key, version);
+            Log('e', kv->Remove(MakeKey(key)), key, version);
+        } else {
+            Log('p', OK, key, version);
+            Log('e', kv->Put(MakeKey(key), MakeValue(key, version)), key, version);
+        }
+    }
+}
+
+static void RunChild(const int round, const uint64_t crash_at) {
+    KVEngine* kv = KVEngine::Open(FLAGS_engine, FLAGS_db, (size_t) FLAGS_db_size_in_mb * 1024 * 1024, LAYOUT);
+    if (kv == nullptr) _exit(FAILED_EXIT);
+    g_crash_at = crash_at;
+    Track(kv);
+    if (g_pool == nullptr) _exit(FAILED_EXIT);
+    vector<std::thread> workers;
+    for (int t = 0; t < FLAGS_threads; t++) workers.emplace_back(Worker, kv, round, t);
+    for (auto& worker : workers) worker.join();
+    Untrack();
+    Log('f', OK, 0, g_fences.load());
+    KVEngine::Close(kv);
+    _exit(0);
+}
+
+// ===============================================================================================
+// VERIFICATION
+// ===============================================================================================
+
+struct InFlight {                                          // operation interrupted by crash
+    char kind;                                             // 'p'ut or 'r'emove
+    uint64_t version;                                      // version of value being put
+};
+
+int main(int argc, char** argv) {
+    // Print usage statement if necessary
+    if (argc != 1) {
+        if ((strcmp(argv[1], "?") == 0) || (strcmp(argv[1], "-?") == 0)
+            || (strcmp(argv[1], "h") == 0) || (strcmp(argv[1], "-h") == 0)
+            || (strcmp(argv[1], "-help") == 0) || (strcmp(argv[1], "--help") == 0)) {
+            fprintf(stderr, "%s", USAGE.c_str());
+            exit(1);
+        }
+    }
+
+    // Fences are only interposed when libpmem treats the pool as persistent memory
+    setenv("PMEM_IS_PMEM_FORCE", "1", 1);
+
+    // Parse command-line arguments
+    FLAGS_seed = (unsigned) time(nullptr);
+    for (int i = 1; i < argc; i++) {
+        int n;
+        char junk;
+        if (strncmp(argv[i], "--engine=", 9) == 0) {
+            FLAGS_engine = argv[i] + 9;
+        } else if (strncmp(argv[i], "--db=", 5) == 0) {
+            FLAGS_db = argv[i] + 5;
+        } else if (sscanf(argv[i], "--db_size_in_mb=%d%c", &n, &junk) == 1 && n > 0) {
+            FLAGS_db_size_in_mb = n;
+        } else if (sscanf(argv[i], "--rounds=%d%c", &n, &junk) == 1 && n > 0) {
+            FLAGS_rounds = n;
+        } else if (sscanf(argv[i], "--ops=%d%c", &n, &junk) == 1 && n > 0) {
+            FLAGS_ops = n;
+        } else if (sscanf(argv[i], "--keys=%d%c", &n, &junk) == 1 && n > 0) {
+            FLAGS_keys = n;
+        } else if (sscanf(argv[i], "--threads=%d%c", &n, &junk) == 1 && n > 0) {
+            FLAGS_threads = n;
+        } else if (sscanf(argv[i], "--value_size=%d%c", &n, &junk) == 1 && n > 0) {
+            FLAGS_value_size = n;
+        } else if (sscanf(argv[i], "--removes=%d%c", &n, &junk) == 1 && n >= 0 && n <= 100) {
+            FLAGS_removes = n;
+        } else if (sscanf(argv[i], "--evict=%d%c", &n, &junk) == 1 && n >= 0 && n <= 100) {
+            FLAGS_evict = n;
+        } else if (sscanf(argv[i], "--seed=%d%c", &n, &junk) == 1) {
+            FLAGS_seed = (unsigned) n;
+        } else {
+            fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
+            exit(1);
+        }
+    }
+    const string engine = string(FLAGS_engine).substr(0, string(FLAGS_engine).find(':'));
+    const vector<string> thread_safe = {"btree", "btree_u64", "logstore", "mvtree"};
+    if (FLAGS_threads > 1 && (std::find(thread_safe.begin(), thread_safe.end(), engine) == thread_safe.end() ||
+                              strstr(FLAGS_engine, "concurrency=single") != nullptr)) {
+        fprintf(stderr, "Engine %s is not thread-safe, using 1 thread\n", FLAGS_engine);
+        FLAGS_threads = 1;
+    }
+    if (engine == "blackhole" || engine == "sharded") {
+        fprintf(stderr, "Engine %s does not use a single persistent pool\n", FLAGS_engine);
+        exit(1);
+    }
+
+    fprintf(stdout, "Engine:     %s\n", FLAGS_engine);
+    fprintf(stdout, "Path:       %s\n", FLAGS_db);
+    fprintf(stdout, "Rounds:     %d of %d ops on %d keys\n", FLAGS_rounds, FLAGS_ops, FLAGS_keys);
+    fprintf(stdout, "Threads:    %d\n", FLAGS_threads);
+    fprintf(stdout, "Seed:       %u\n", FLAGS_seed);
+    fprintf(stdout, "------------------------------------------------\n");
+
+    std::remove(FLAGS_db);
+    const string image = string(FLAGS_db) + ".crash";
+    std::mt19937_64 rng(FLAGS_seed);
+    std::map<uint32_t, string> model;                      // expected contents
+    uint64_t fences = 0;                                   // fences seen in last full round
+    int crashes = 0;
+    double recovery_min = 0, recovery_max = 0, recovery_total = 0;
+
+    for (int round = 0; round < FLAGS_rounds; round++) {
+        // first round runs to completion to learn how many fences a round issues
+        const uint64_t crash_at = (round == 0 || fences == 0) ? 0 : 1 + rng() % fences;
+        int fds[2];
+        if (pipe(fds) != 0) {
+            perror("pipe");
+            exit(1);
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            g_log = fds[1];
+            RunChild(round, crash_at);
+        }
+        close(fds[1]);
+
+        // replay log of completed operations into model, remembering interrupted ones
+        std::map<uint32_t, InFlight> inflight;
+        LogRecord record;
+        while (read(fds[0], &record, sizeof(record)) == sizeof(record)) {
+            if (record.kind == 'f') {
+                fences = record.version;
+            } else if (record.kind != 'e') {
+                inflight[record.key] = {record.kind, record.version};
+            } else {
+                auto op = inflight.find(record.key);
+                if (record.status == OK && op->second.kind == 'p') {
+                    model[record.key] = MakeValue(record.key, op->second.version);
+                } else if (record.status == OK) {
+                    model.erase(record.key);
+                }
+                inflight.erase(op);
+            }
+        }
+        close(fds[0]);
+        int status;
+        waitpid(pid, &status, 0);
+        const bool crashed = WIFEXITED(status) && WEXITSTATUS(status) == CRASH_EXIT;
+        if (!crashed && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            fprintf(stderr, "round %d: workload failed with status %d\n", round, status);
+            exit(1);
+        }
+        if (round == 0 && fences == 0) {
+            fprintf(stderr, "round %d: no fences observed, crashes cannot be injected\n", round);
+            exit(1);
+        }
+        if (crashed) {
+            crashes++;
+            if (rename(image.c_str(), FLAGS_db) != 0) {
+                perror("rename");
+                exit(1);
+            }
+        }
+
+        // recover and time it
+        auto start = std::chrono::steady_clock::now();
+        KVEngine* kv = KVEngine::Open(FLAGS_engine, FLAGS_db, 0, LAYOUT);
+        double millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (kv == nullptr) {
+            fprintf(stderr, "round %d: recovery failed after crash at fence %lu\n", round, crash_at);
+            exit(1);
+        }
+        recovery_min = (round == 0 || millis < recovery_min) ? millis : recovery_min;
+        recovery_max = std::max(millis, recovery_max);
+        recovery_total += millis;
+
+        // every key must match model, or outcome of its interrupted operation
+        for (uint32_t key = 0; key < (uint32_t) FLAGS_keys; key++) {
+            string value;
+            KVStatus s = kv->Get(MakeKey(key), &value);
+            auto expected = model.find(key);
+            bool matches = (s == NOT_FOUND && expected == model.end()) ||
+                           (s == OK && expected != model.end() && value == expected->second);
+            auto op = inflight.find(key);
+            if (!matches && op != inflight.end()) {
+                matches = op->second.kind == 'p' ? (s == OK && value == MakeValue(key, op->second.version))
+                                                 : (s == NOT_FOUND);
+            }
+            if (!matches) {
+                fprintf(stderr, "round %d: key %s has %s after crash at fence %lu\n", round,
+                        MakeKey(key).c_str(), s == OK ? "unexpected value" : "no value", crash_at);
+                exit(1);
+            }
+            if (s == OK) {
+                model[key] = value;                        // adopt outcome of interrupted ops
+            } else {
+                model.erase(key);
+            }
+        }
+        KVEngine::Close(kv);
+
+        fprintf(stdout, "round %-4d : %s, %11.3f millis recovery; (%zu keys, %zu interrupted)\n", round,
+                crashed ? ("crash at fence " + std::to_string(crash_at)).c_str() : "completed",
+                millis, model.size(), inflight.size());
+        fflush(stdout);
+    }
+
+    fprintf(stdout, "------------------------------------------------\n");
+    fprintf(stdout, "%d rounds, %d crashes, recovery %.3f/%.3f/%.3f millis min/avg/max\n", FLAGS_rounds, crashes,
+            recovery_min, recovery_total / FLAGS_rounds, recovery_max);
+    std::remove(FLAGS_db);
+    return 0;
+}
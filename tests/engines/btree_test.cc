@@ -30,19 +30,24 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
+#include <future>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "gtest/gtest.h"
 #include "../../src/engines/btree.h"
 
 using namespace pmemkv::btree;
 
 const string PATH = "/dev/shm/pmemkv";
+const string LAYOUT = "pmemkv";
 const size_t SIZE = 1024ull * 1024ull * 512ull;
 const size_t LARGE_SIZE = 1024ull * 1024ull * 1024ull * 2ull;
 
-template <size_t POOL_SIZE>
+template <size_t POOL_SIZE, typename TEngine = BTreeEngine>
 class BTreeEngineBaseTest : public testing::Test {
 public:
-    BTreeEngine* kv;
+    TEngine* kv;
 
     BTreeEngineBaseTest() {
         std::remove(PATH.c_str());
@@ -60,12 +65,13 @@ public:
 
 protected:
     void Open() {
-        kv = new BTreeEngine(PATH, POOL_SIZE);
+        kv = new TEngine(PATH, POOL_SIZE, LAYOUT);
     }
 };
 
 typedef BTreeEngineBaseTest<SIZE> BTreeEngineTest;
 typedef BTreeEngineBaseTest<LARGE_SIZE> BTreeEngineLargeTest;
+typedef BTreeEngineBaseTest<SIZE, BTreeU64Engine> BTreeU64EngineTest;
 
 
 TEST_F(BTreeEngineTest, SimpleTest) {
@@ -129,6 +135,27 @@ TEST_F(BTreeEngineTest, GetHeadlessTest) {
     ASSERT_TRUE(kv->Get("waldo", &value) == NOT_FOUND);
 }
 
+TEST_F(BTreeEngineTest, GetIntoBufferTest) {
+    ASSERT_TRUE(kv->Put("key1", "cool") == OK) << pmemobj_errormsg();
+    char value[8];
+    int32_t valuebytes = 0;
+    ASSERT_TRUE(kv->Get(8, 4, &valuebytes, "key1", value) == OK);
+    ASSERT_TRUE(valuebytes == 4 && string(value, 4) == "cool");
+    ASSERT_TRUE(kv->Get(2, 4, &valuebytes, "key1", value) == FAILED && valuebytes == 4);
+    ASSERT_TRUE(kv->Get(8, 5, &valuebytes, "waldo", value) == NOT_FOUND);
+}
+
+TEST_F(BTreeEngineTest, MultiGetTest) {
+    ASSERT_TRUE(kv->Put("abc", "A1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("def", "B2") == OK) << pmemobj_errormsg();
+    vector<string> values;
+    vector<KVStatus> statuses;
+    kv->MultiGet({"def", "waldo", "abc"}, &values, &statuses);
+    ASSERT_TRUE(statuses[0] == OK && values[0] == "B2");
+    ASSERT_TRUE(statuses[1] == NOT_FOUND && values[1].empty());
+    ASSERT_TRUE(statuses[2] == OK && values[2] == "A1");
+}
+
 TEST_F(BTreeEngineTest, GetMultipleTest) {
     ASSERT_TRUE(kv->Put("abc", "A1") == OK) << pmemobj_errormsg();
     ASSERT_TRUE(kv->Put("def", "B2") == OK) << pmemobj_errormsg();
@@ -313,6 +340,21 @@ TEST_F(BTreeEngineTest, GetMultipleAfterRecoveryTest) {
     ASSERT_TRUE(kv->Get("mno", &value5) == OK && value5 == "E5");
 }
 
+TEST_F(BTreeEngineTest, ReopenReleasesNodeSlotsTest) {
+    for (int i = 1; i <= 10000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    for (int i = 0; i < 10; i++) Reopen();
+    ASSERT_EQ(persistent::internal::node_slots_registry().slots.size(), 1);
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    for (int i = 1; i <= 10000; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+    }
+}
+
 // TODO: enable this test when remove operaation is implemented in versioned B+tree
 /*
 TEST_F(BTreeEngineTest, GetMultiple2AfterRecoveryTest) {
@@ -574,6 +616,368 @@ TEST_F(BTreeEngineTest, UsePreallocAfterMultipleLeafRecoveryTest) {
     ASSERT_EQ(kv->Put(to_string(LEAF_ENTRIES + 1), "!"), OK) << pmemobj_errormsg();
 }*/
 
+TEST_F(BTreeEngineTest, ReuseNodeSlotsAfterRecoveryTest) {
+    for (int i = 1; i <= 5000; i++)
+        ASSERT_EQ(kv->Put(to_string(i), to_string(i) + "!"), OK) << pmemobj_errormsg();
+    Reopen();
+
+    for (int i = 5001; i <= 10000; i++)
+        ASSERT_EQ(kv->Put(to_string(i), to_string(i) + "!"), OK) << pmemobj_errormsg();
+    Reopen();
+
+    for (int i = 1; i <= 10000; i++) {
+        string value;
+        ASSERT_EQ(kv->Get(to_string(i), &value), OK);
+        ASSERT_EQ(value, to_string(i) + "!");
+    }
+}
+
+// =============================================================================================
+// TEST KEYS WITH EQUAL HEADS
+// =============================================================================================
+
+TEST_F(BTreeEngineTest, KeysWithEqualHeadsTest) {
+    for (int i = SINGLE_INNER_LIMIT; i >= 1; i--) {
+        string istr = "samehead" + to_string(i);
+        ASSERT_TRUE(kv->Put(istr, to_string(i)) == OK) << pmemobj_errormsg();
+    }
+    ASSERT_TRUE(kv->Put("samehead", "short") == OK) << pmemobj_errormsg();
+    Reopen();
+    for (int i = 1; i <= SINGLE_INNER_LIMIT; i++) {
+        string istr = "samehead" + to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == to_string(i));
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("samehead", &value) == OK && value == "short");
+    ASSERT_TRUE(kv->Get("samehea", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("samehead0", &value) == NOT_FOUND);
+}
+
+TEST_F(BTreeEngineTest, KeysWithHighBytesTest) {
+    for (int i = 0; i < 256; i++) {
+        string istr = string(1, (char) i) + "key" + string(1, (char) (255 - i));
+        ASSERT_TRUE(kv->Put(istr, to_string(i)) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 0; i < 256; i++) {
+        string istr = string(1, (char) i) + "key" + string(1, (char) (255 - i));
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == to_string(i));
+        ASSERT_TRUE(kv->Get(istr.substr(0, 4), &value) == NOT_FOUND);
+    }
+}
+
+// =============================================================================================
+// TEST CONCURRENT ACCESS
+// =============================================================================================
+
+static void ReadWhileWriting(BTreeEngine* kv) {
+    const int limit = SINGLE_INNER_LIMIT;
+    for (int i = 0; i < limit; i += 2) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+    std::future<void> readers[4];
+    for (int t = 0; t < 4; t++) {
+        readers[t] = std::async(std::launch::async, [&, t]() {
+            do {
+                for (int i = t * 2; i < limit; i += 8) {
+                    string istr = to_string(i);
+                    string value;
+                    if (kv->Get(istr, &value) != OK || (value != istr + "!" && value != istr + "?")) errors++;
+                }
+            } while (!done);
+        });
+    }
+    for (int i = 1; i < limit; i += 2) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+        string even = to_string(i - 1);
+        ASSERT_TRUE(kv->Put(even, even + "?") == OK) << pmemobj_errormsg();
+    }
+    done = true;
+    for (auto& reader : readers) reader.wait();
+    ASSERT_EQ(errors, 0);
+    for (int i = 0; i < limit; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + (i % 2 ? "!" : "?"));
+    }
+}
+
+TEST_F(BTreeEngineTest, ConcurrentReadersTest) {
+    ReadWhileWriting(kv);
+}
+
+TEST_F(BTreeEngineTest, ConcurrentReadersWithCachedInnerNodesTest) {
+    kv->CacheInnerNodes(true);
+    ReadWhileWriting(kv);
+}
+
+// =============================================================================================
+// TEST CACHED INNER NODES
+// =============================================================================================
+
+TEST_F(BTreeEngineTest, CachedInnerNodesTest) {
+    kv->CacheInnerNodes(true);
+    string value;
+    ASSERT_TRUE(kv->Get("1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Put("1", "1!") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Get("1", &value) == OK && value == "1!");
+    for (int i = 1; i <= SINGLE_INNER_LIMIT * 2; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+        if (i % 100 == 0) {
+            string value;
+            ASSERT_TRUE(kv->Get(to_string(i / 2), &value) == OK && value == to_string(i / 2) + "!");
+        }
+    }
+    for (int i = 1; i <= SINGLE_INNER_LIMIT * 2; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!");
+    }
+    ASSERT_TRUE(kv->Get("0", &value) == NOT_FOUND);
+    kv->CacheInnerNodes(false);
+    string value2;
+    ASSERT_TRUE(kv->Get("2", &value2) == OK && value2 == "2!");
+}
+
+TEST_F(BTreeEngineTest, CachedInnerNodesOverBudgetTest) {
+    kv->CacheBudget(1);                                    // less than one inner node
+    kv->CacheInnerNodes(true);
+    for (int i = 1; i <= SINGLE_INNER_LIMIT * 2; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= SINGLE_INNER_LIMIT * 2; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!");
+    }
+    kv->CacheBudget(SIZE_MAX);
+    string value;
+    ASSERT_TRUE(kv->Get("2", &value) == OK && value == "2!");
+}
+
+TEST_F(BTreeEngineTest, CachedInnerNodesAfterRecoveryTest) {
+    for (int i = 1; i <= SINGLE_INNER_LIMIT * 2; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    Reopen();
+    kv->CacheInnerNodes(true);
+    for (int i = 1; i <= SINGLE_INNER_LIMIT * 2; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!");
+    }
+    kv->Free();
+    string value;
+    ASSERT_TRUE(kv->Get("1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Put("1", "1?") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Get("1", &value) == OK && value == "1?");
+}
+
+// =============================================================================================
+// TEST REVERSE SCANS
+// =============================================================================================
+
+TEST_F(BTreeEngineTest, ReverseScanTest) {
+    vector<string> kv_pairs;
+    ASSERT_TRUE(kv->ReverseScan("", 10, kv_pairs) == OK);
+    ASSERT_TRUE(kv_pairs.empty());
+    for (int i = 0; i < 1000; i += 2) {
+        char key[8];
+        snprintf(key, sizeof(key), "%04d", i);
+        ASSERT_TRUE(kv->Put(key, to_string(i)) == OK) << pmemobj_errormsg();
+    }
+    ASSERT_TRUE(kv->ReverseScan("", 3, kv_pairs) == OK);
+    ASSERT_EQ(kv_pairs, vector<string>({"0998", "998", "0996", "996", "0994", "994"}));
+    kv_pairs.clear();
+    ASSERT_TRUE(kv->ReverseScan("0500", 2, kv_pairs) == OK);              // existing key
+    ASSERT_EQ(kv_pairs, vector<string>({"0498", "498", "0496", "496"}));
+    kv_pairs.clear();
+    ASSERT_TRUE(kv->ReverseScan("0501", 2, kv_pairs) == OK);              // missing key
+    ASSERT_EQ(kv_pairs, vector<string>({"0500", "500", "0498", "498"}));
+    kv_pairs.clear();
+    ASSERT_TRUE(kv->ReverseScan("0004", 10, kv_pairs) == OK);             // runs out of keys
+    ASSERT_EQ(kv_pairs, vector<string>({"0002", "2", "0000", "0"}));
+    kv_pairs.clear();
+    ASSERT_TRUE(kv->ReverseScan("0000", 10, kv_pairs) == OK);
+    ASSERT_TRUE(kv_pairs.empty());
+    ASSERT_TRUE(kv->ReverseScan("", 0, kv_pairs) == OK);
+    ASSERT_TRUE(kv_pairs.empty());
+}
+
+TEST_F(BTreeEngineTest, ReverseScanAllAfterRecoveryTest) {
+    for (int i = 0; i < SINGLE_INNER_LIMIT; i++) {
+        char key[8];
+        snprintf(key, sizeof(key), "%05d", i);
+        ASSERT_TRUE(kv->Put(key, to_string(i)) == OK) << pmemobj_errormsg();
+    }
+    Reopen();
+    vector<string> kv_pairs;
+    ASSERT_TRUE(kv->ReverseScan("", SINGLE_INNER_LIMIT + 1, kv_pairs) == OK);
+    ASSERT_EQ(kv_pairs.size(), 2 * SINGLE_INNER_LIMIT);
+    for (int i = 0; i < SINGLE_INNER_LIMIT; i++) {
+        ASSERT_EQ(kv_pairs[2 * i + 1], to_string(SINGLE_INNER_LIMIT - 1 - i));
+    }
+}
+
+// =============================================================================================
+// TEST INTEGER KEYS
+// =============================================================================================
+
+static string U64Key(uint64_t k) {
+    return string((const char*) &k, sizeof(k));
+}
+
+TEST_F(BTreeU64EngineTest, SimpleTest) {
+    ASSERT_EQ(kv->Engine(), U64_ENGINE);
+    string value;
+    ASSERT_TRUE(kv->Get(U64Key(1), &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Put(U64Key(1), "value1") == OK);
+    ASSERT_TRUE(kv->Get(U64Key(1), &value) == OK && value == "value1");
+    ASSERT_TRUE(kv->Put(U64Key(1), "value2") == OK);
+    value.clear();
+    ASSERT_TRUE(kv->Get(U64Key(1), &value) == OK && value == "value2");
+}
+
+TEST_F(BTreeU64EngineTest, InvalidKeyTest) {
+    string value;
+    ASSERT_TRUE(kv->Put("key1", "value1") == FAILED);
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("", &value) == NOT_FOUND);
+}
+
+TEST_F(BTreeU64EngineTest, ReverseScanTest) {
+    for (uint64_t k = 1; k <= 1000; k++) {
+        ASSERT_TRUE(kv->Put(U64Key(k << 40), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    vector<string> kv_pairs;
+    ASSERT_TRUE(kv->ReverseScan(U64Key(300ull << 40), 2, kv_pairs) == OK);
+    ASSERT_EQ(kv_pairs, vector<string>({U64Key(299ull << 40), "299", U64Key(298ull << 40), "298"}));
+    ASSERT_TRUE(kv->ReverseScan("short", 2, kv_pairs) == FAILED);
+}
+
+TEST_F(BTreeU64EngineTest, KeysAfterRecoveryTest) {
+    for (uint64_t i = 0; i < 10000; i++) {
+        const uint64_t k = i * 0x9E3779B97F4A7C15ull;
+        ASSERT_TRUE(kv->Put(U64Key(k), to_string(i)) == OK) << pmemobj_errormsg();
+    }
+    Reopen();
+    for (uint64_t i = 0; i < 10000; i++) {
+        const uint64_t k = i * 0x9E3779B97F4A7C15ull;
+        string value;
+        ASSERT_TRUE(kv->Get(U64Key(k), &value) == OK && value == to_string(i));
+        ASSERT_TRUE(kv->Get(U64Key(k + 1), &value) == NOT_FOUND);
+    }
+}
+
+// =============================================================================================
+// TEST NODE GEOMETRY
+// =============================================================================================
+
+typedef BTreeEngineBaseTest<SIZE, BTreeEngineBase<pstring<16>, 16, 64>> BTreeSmallGeometryTest;
+
+TEST_F(BTreeSmallGeometryTest, SimpleTest) {
+    ASSERT_EQ(kv->Engine(), "btree:degree=16,key=16,value=64");
+    for (int i = 1; i <= 10000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    ASSERT_TRUE(kv->Put(string(17, 'K'), "value") == FAILED);
+    ASSERT_TRUE(kv->Put("key", string(65, 'V')) == FAILED);
+    ASSERT_TRUE(kv->Put(string(16, 'K'), string(64, 'V')) == OK);
+    Reopen();
+    for (int i = 1; i <= 10000; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!");
+    }
+}
+
+TEST_F(BTreeSmallGeometryTest, MismatchedGeometryAfterRecoveryTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    delete kv;
+    kv = nullptr;
+    ASSERT_THROW(BTreeEngine(PATH, SIZE, LAYOUT), std::invalid_argument);
+    ASSERT_THROW(BTreeU64Engine(PATH, SIZE, LAYOUT), std::invalid_argument);
+    Open();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
+}
+
+TEST(BTreeGeometryTest, OpenByNameTest) {
+    std::remove(PATH.c_str());
+    auto engines = pmemkv::KVEngineRegistry::Engines();
+    ASSERT_TRUE(std::find(engines.begin(), engines.end(), ENGINE) != engines.end());
+    ASSERT_TRUE(std::find(engines.begin(), engines.end(), U64_ENGINE) != engines.end());
+    ASSERT_TRUE(pmemkv::KVEngine::Open("btree:degree", PATH, SIZE, LAYOUT) == nullptr);
+    ASSERT_TRUE(pmemkv::KVEngine::Open("btree:fanout=32", PATH, SIZE, LAYOUT) == nullptr);
+    ASSERT_TRUE(pmemkv::KVEngine::Open("btreex", PATH, SIZE, LAYOUT) == nullptr);
+    ASSERT_TRUE(pmemkv::KVEngine::Open("btree:degree=33", PATH, SIZE, LAYOUT) == nullptr);
+    ASSERT_TRUE(pmemkv::KVEngine::Open("btree_u64:degree=32", PATH, SIZE, LAYOUT) == nullptr);
+    ASSERT_TRUE(pmemkv::KVEngine::Open("btree:cache=-1", PATH, SIZE, LAYOUT) == nullptr);
+    auto names = Geometries();
+    ASSERT_EQ(names[0], ENGINE);
+    ASSERT_TRUE(std::find(names.begin(), names.end(), "btree:degree=32,key=16,value=64") != names.end());
+
+    pmemkv::KVEngine* engine = pmemkv::KVEngine::Open("btree:value=64,key=16,degree=32", PATH, SIZE, LAYOUT);
+    ASSERT_TRUE(engine != nullptr);
+    ASSERT_EQ(engine->Engine(), "btree:degree=32,key=16,value=64");
+    ASSERT_TRUE(engine->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    pmemkv::KVEngine::Close(engine);
+    ASSERT_TRUE(pmemkv::KVEngine::Open("btree:degree=16,key=16,value=64", PATH, SIZE, LAYOUT) == nullptr);
+    engine = pmemkv::KVEngine::Open("btree:degree=32,key=16,value=64,cache=1048576", PATH, SIZE, LAYOUT);
+    string value;
+    ASSERT_TRUE(engine->Get("key1", &value) == OK && value == "value1");
+    ASSERT_FALSE(engine->CompressValues(64));
+    ASSERT_EQ(pmemkv::kvengine_compress_values(engine, 64), FAILED);
+    pmemkv::KVEngine::Close(engine);
+    ASSERT_TRUE(pmemkv::KVEngine::Open("btree:degree=32,key=16,value=64,compress=64", PATH, SIZE, LAYOUT) == nullptr);
+    ASSERT_TRUE(pmemkv::KVEngine::Open("btree:degree=32,key=16,value=64,huge_pages=1", PATH, SIZE, LAYOUT) == nullptr);
+    std::remove(PATH.c_str());
+}
+
+static size_t ResidentPages(pmemkv::KVEngine* engine, const size_t length) {
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    vector<unsigned char> resident((length + page - 1) / page);
+    if (mincore(engine->GetPool(), length, resident.data()) != 0) return 0;
+    return (size_t) std::count_if(resident.begin(), resident.end(), [](unsigned char p) { return p & 1; });
+}
+
+TEST(BTreeGeometryTest, PrefaultAtOpenTest) {
+    const size_t pages = SIZE / (size_t) sysconf(_SC_PAGESIZE);
+    std::remove(PATH.c_str());
+    pmemkv::KVEngine* engine = pmemkv::KVEngine::Open("btree:prefault=4", PATH, SIZE, LAYOUT);
+    ASSERT_TRUE(engine != nullptr);
+    ASSERT_EQ(ResidentPages(engine, SIZE), pages);
+    ASSERT_TRUE(engine->Put("key1", "value1") == OK);
+    pmemkv::KVEngine::Close(engine);
+    std::remove(PATH.c_str());
+}
+
+// =============================================================================================
+// TEST FREEING TREE
+// =============================================================================================
+TEST_F(BTreeEngineTest, FreeTest) {
+    for (int i = 1; i <= 10000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    kv->Free();
+    string value;
+    ASSERT_TRUE(kv->Get("1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Put("1", "1!") == OK);
+    Reopen();
+    ASSERT_TRUE(kv->Get("1", &value) == OK && value == "1!");
+    ASSERT_TRUE(kv->Get("2", &value) == NOT_FOUND);
+}
+
 // =============================================================================================
 // TEST LARGE TREE
 // =============================================================================================
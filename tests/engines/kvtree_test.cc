@@ -38,6 +38,7 @@ using namespace pmemkv::kvtree2;
 
 const string PATH = "/dev/shm/pmemkv";
 const string PATH_CACHED = "/tmp/pmemkv";
+const string LAYOUT = "pmemkv";
 const size_t SIZE = ((size_t) (1024 * 1024 * 1104));
 
 class KVEmptyTest : public testing::Test {
@@ -72,7 +73,7 @@ public:
 
 private:
     void Open() {
-        kv = new KVTree(PATH, SIZE);
+        kv = new KVTree(PATH, SIZE, LAYOUT);
     }
 };
 
@@ -81,7 +82,7 @@ private:
 // =============================================================================================
 
 TEST_F(KVEmptyTest, CreateInstanceTest) {
-    KVTree *kv = new KVTree(PATH, PMEMOBJ_MIN_POOL);
+    KVTree *kv = new KVTree(PATH, PMEMOBJ_MIN_POOL, LAYOUT);
     KVTreeAnalysis analysis = {};
     kv->Analyze(analysis);
     ASSERT_EQ(analysis.leaf_empty, 0);
@@ -90,9 +91,23 @@ TEST_F(KVEmptyTest, CreateInstanceTest) {
     delete kv;
 }
 
+TEST_F(KVEmptyTest, RepeatedUpdatesReleaseOldValuesTest) {
+    KVTree *kv = new KVTree(PATH, PMEMOBJ_MIN_POOL, LAYOUT);
+    string value;
+    for (int i = 0; i < 20000; i++) {                      // would leak far more than pool size
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put("key1", string(1024, 'x') + istr) == OK) << pmemobj_errormsg();
+        ASSERT_TRUE(kv->Put("key2", istr) == OK) << pmemobj_errormsg();
+        ASSERT_TRUE(kv->Remove("key2") == OK);
+    }
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == string(1024, 'x') + "19999");
+    ASSERT_TRUE(kv->Get("key2", &value) == NOT_FOUND);
+    delete kv;
+}
+
 TEST_F(KVEmptyTest, FailsToCreateInstanceWithInvalidPath) {
     try {
-        new KVTree("/tmp/123/234/345/456/567/678/nope.nope", PMEMOBJ_MIN_POOL);
+        new KVTree("/tmp/123/234/345/456/567/678/nope.nope", PMEMOBJ_MIN_POOL, LAYOUT);
         FAIL();
     } catch (...) {
         // do nothing, expected to happen
@@ -101,7 +116,7 @@ TEST_F(KVEmptyTest, FailsToCreateInstanceWithInvalidPath) {
 
 TEST_F(KVEmptyTest, FailsToCreateInstanceWithHugeSize) {
     try {
-        new KVTree(PATH, 9223372036854775807);   // 9.22 exabytes
+        new KVTree(PATH, 9223372036854775807, LAYOUT);   // 9.22 exabytes
         FAIL();
     } catch (...) {
         // do nothing, expected to happen
@@ -110,13 +125,23 @@ TEST_F(KVEmptyTest, FailsToCreateInstanceWithHugeSize) {
 
 TEST_F(KVEmptyTest, FailsToCreateInstanceWithTinySize) {
     try {
-        new KVTree(PATH, PMEMOBJ_MIN_POOL - 1);  // too small
+        new KVTree(PATH, PMEMOBJ_MIN_POOL - 1, LAYOUT);  // too small
         FAIL();
     } catch (...) {
         // do nothing, expected to happen
     }
 }
 
+TEST_F(KVEmptyTest, RefusesPoolOfOtherLayoutTest) {
+    KVTree *kv = new KVTree(PATH, SIZE, LAYOUT);
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK);
+    KVRoot *root = (KVRoot*) pmemobj_direct(kv->GetRootOid());
+    root->layout = 0;                                    // as in roots of older pools
+    pmemobj_persist(kv->GetPool(), &root->layout, sizeof(root->layout));
+    delete kv;
+    ASSERT_THROW(new KVTree(PATH, SIZE, LAYOUT), std::invalid_argument);
+}
+
 // =============================================================================================
 // TEST SINGLE-LEAF TREE
 // =============================================================================================
@@ -247,6 +272,86 @@ TEST_F(KVTest, GetNonexistentTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }
 
+TEST_F(KVTest, MultiGetTest) {
+    for (int i = 1; i <= 500; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    vector<string> keys;
+    for (int i = 0; i <= 520; i += 5) keys.push_back(to_string(i));  // spans groups, some missing
+    vector<string> values;
+    vector<KVStatus> statuses;
+    kv->MultiGet(keys, &values, &statuses);
+    ASSERT_EQ(values.size(), keys.size());
+    ASSERT_EQ(statuses.size(), keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        const int k = std::stoi(keys[i]);
+        if (k >= 1 && k <= 500) {
+            ASSERT_TRUE(statuses[i] == OK && values[i] == keys[i] + "!");
+        } else {
+            ASSERT_TRUE(statuses[i] == NOT_FOUND && values[i].empty());
+        }
+    }
+}
+
+TEST_F(KVTest, PutAndRemoveFromBufferTest) {
+    const char key[] = "key\0tail";                        // key length is taken from keybytes
+    const char value[] = "value\0tail";
+    ASSERT_TRUE(kv->Put(3, 5, key, value) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put(8, 10, key, value) == OK) << pmemobj_errormsg();
+    string value1;
+    ASSERT_TRUE(kv->Get("key", &value1) == OK && value1 == "value");
+    string value2;
+    ASSERT_TRUE(kv->Get(string(key, 8), &value2) == OK && value2 == string(value, 10));
+    ASSERT_TRUE(kv->Remove(3, key) == OK);
+    ASSERT_TRUE(kv->Get("key", &value1) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get(string(key, 8), &value2) == OK);
+}
+
+TEST_F(KVTest, BatchedFFITest) {
+    using pmemkv::FFIRecordSize;
+    vector<uint64_t> writes(64);                           // 8-byte aligned, as bindings allocate
+    auto batch = (pmemkv::FFIBatch*) writes.data();
+    batch->kv = kv;
+    batch->count = 3;
+    auto record = (pmemkv::FFIRecord*) batch->data;
+    const char* puts[][2] = {{"key1", "value1"}, {"key2", "value2"}};
+    for (auto& put : puts) {
+        record->keybytes = 4;
+        record->valuebytes = 6;
+        memcpy(record->data, put[0], 4);
+        memcpy(record->data + 4, put[1], 6);
+        record = (pmemkv::FFIRecord*) ((char*) record + FFIRecordSize(4, 6));
+    }
+    record->keybytes = 4;
+    record->valuebytes = -1;                               // remove
+    memcpy(record->data, "key1", 4);
+    ASSERT_EQ(FFIRecordSize(4, 6), 28);                    // 26 bytes rounded up to alignment
+    ASSERT_EQ(pmemkv::kvengine_write_batch_ffi(batch), OK);
+    ASSERT_EQ(record->status, OK);
+
+    const int32_t limits[] = {16, 16, 2};
+    vector<uint64_t> reads(64);
+    batch = (pmemkv::FFIBatch*) reads.data();
+    batch->kv = kv;
+    batch->count = 3;
+    record = (pmemkv::FFIRecord*) batch->data;
+    for (int i = 0; i < 3; i++) {
+        record->limit = limits[i];
+        record->keybytes = 4;
+        memcpy(record->data, i == 0 ? "key1" : "key2", 4);
+        record = (pmemkv::FFIRecord*) ((char*) record + FFIRecordSize(4, limits[i]));
+    }
+    ASSERT_EQ(pmemkv::kvengine_multiget_ffi(batch), FAILED);
+    record = (pmemkv::FFIRecord*) batch->data;
+    ASSERT_EQ(record->status, NOT_FOUND);
+    record = (pmemkv::FFIRecord*) ((char*) record + FFIRecordSize(4, limits[0]));
+    ASSERT_TRUE(record->status == OK && record->valuebytes == 6);
+    ASSERT_EQ(string(record->data + 4, 6), "value2");
+    record = (pmemkv::FFIRecord*) ((char*) record + FFIRecordSize(4, limits[1]));
+    ASSERT_TRUE(record->status == FAILED && record->valuebytes == 6);  // buffer too small
+}
+
 TEST_F(KVTest, PutTest) {
     string value;
     ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
@@ -741,6 +846,198 @@ TEST_F(KVTest, UsePreallocAfterMultipleLeafRecoveryTest) {
     ASSERT_EQ(analysis.leaf_total, 2);
 }
 
+// =============================================================================================
+// TEST KEY PREFIX ELISION
+// =============================================================================================
+
+TEST_F(KVTest, HierarchicalKeysElidePrefixTest) {
+    for (int i = 1; i <= 1000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put("tenant/0042/user/" + istr, istr) == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    ASSERT_GT(analysis.prefix_bytes, 17 * 900);            // most slots elide tenant & user
+    Reopen();
+    for (int i = 1; i <= 1000; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get("tenant/0042/user/" + istr, &value) == OK && value == istr);
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("tenant/0042/user/", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("tenant/0042", &value) == NOT_FOUND);
+    vector<string> keys;
+    kv->ListAllKeys(keys);
+    ASSERT_EQ(keys.size(), 1000);
+    for (auto& key : keys) ASSERT_EQ(key.compare(0, 17, "tenant/0042/user/"), 0);
+}
+
+TEST_F(KVTest, KeysOutsideLeafPrefixTest) {
+    for (int i = 1; i <= LEAF_KEYS * 2; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put("prefix/" + istr, istr) == OK) << pmemobj_errormsg();
+    }
+    ASSERT_TRUE(kv->Remove("other") == OK);
+    ASSERT_TRUE(kv->Put("other", "1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("a", "2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("prefix", "3") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("zzz", "4") == OK) << pmemobj_errormsg();
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 1; i <= LEAF_KEYS * 2; i++) {
+            string istr = to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get("prefix/" + istr, &value) == OK && value == istr);
+        }
+        string value;
+        ASSERT_TRUE(kv->Get("other", &value) == OK && value == "1");
+        string value2;
+        ASSERT_TRUE(kv->Get("a", &value2) == OK && value2 == "2");
+        string value3;
+        ASSERT_TRUE(kv->Get("prefix", &value3) == OK && value3 == "3");
+        string value4;
+        ASSERT_TRUE(kv->Get("zzz", &value4) == OK && value4 == "4");
+        Reopen();
+    }
+    ASSERT_TRUE(kv->Remove("prefix/1") == OK);
+    string value;
+    ASSERT_TRUE(kv->Get("prefix/1", &value) == NOT_FOUND);
+    ASSERT_EQ(kv->TotalNumKeys(), LEAF_KEYS * 2 + 3);
+}
+
+TEST_F(KVTest, CompactLeavesWithPrefixesTest) {
+    for (int i = 1; i <= 2000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put("group/" + to_string(i % 7) + "/item/" + istr, istr) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= 2000; i++) {
+        if (i % 10 != 0) ASSERT_TRUE(kv->Remove("group/" + to_string(i % 7) + "/item/" + to_string(i)) == OK);
+    }
+    kv->Compact(0);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 10; i <= 2000; i += 10) {
+            string istr = to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get("group/" + to_string(i % 7) + "/item/" + istr, &value) == OK && value == istr);
+        }
+        Reopen();
+    }
+    ASSERT_EQ(kv->TotalNumKeys(), 200);
+}
+
+// =============================================================================================
+// TEST VALUE COMPRESSION
+// =============================================================================================
+
+TEST_F(KVTest, CompressedValuesTest) {
+    ASSERT_EQ(pmemkv::kvengine_compress_values(kv, 64), OK);
+    string noise;
+    for (int i = 0; i < 4096; i++) noise.push_back((char) ((i * 7919 + (i >> 3) * 104729) % 251));
+    const string large = string(4000, 'x') + "end";
+    const string small = string(63, 'y');
+    ASSERT_TRUE(kv->Put("large", large) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("noise", noise) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("small", small) == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("large", &value) == OK && value == large);
+    string value2;
+    ASSERT_TRUE(kv->Get("noise", &value2) == OK && value2 == noise);
+    string value3;
+    ASSERT_TRUE(kv->Get("small", &value3) == OK && value3 == small);
+
+    char buffer[4096];
+    int32_t valuebytes = 0;
+    ASSERT_TRUE(kv->Get(sizeof(buffer), 5, &valuebytes, "large", buffer) == OK);
+    ASSERT_EQ(string(buffer, (size_t) valuebytes), large);
+    ASSERT_TRUE(kv->Get(100, 5, &valuebytes, "large", buffer) == FAILED);
+    ASSERT_EQ(valuebytes, (int32_t) large.size());
+
+    vector<string> kv_pairs;
+    kv->ListAllKeyValuePairs(kv_pairs);
+    ASSERT_EQ(kv_pairs.size(), 6);
+    for (size_t i = 0; i < kv_pairs.size(); i += 2) {
+        if (kv_pairs[i] == "large") { ASSERT_EQ(kv_pairs[i + 1], large); }
+    }
+
+    ASSERT_TRUE(kv->Put("large", "replaced") == OK) << pmemobj_errormsg();
+    string value4;
+    ASSERT_TRUE(kv->Get("large", &value4) == OK && value4 == "replaced");
+    ASSERT_TRUE(kv->Remove("noise") == OK);
+    string value5;
+    ASSERT_TRUE(kv->Get("noise", &value5) == NOT_FOUND);
+}
+
+TEST_F(KVTest, CompressedValuesRecoveryTest) {
+    kv->CompressValues(1);
+    for (int i = 1; i <= LEAF_KEYS + 1; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, string(1000, 'a' + (i % 26)) + istr) == OK) << pmemobj_errormsg();
+    }
+    Reopen();                                              // compression is off after reopening
+    ASSERT_TRUE(kv->Put("plain", string(1000, 'p')) == OK) << pmemobj_errormsg();
+    for (int i = 1; i <= LEAF_KEYS + 1; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == string(1000, 'a' + (i % 26)) + istr);
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("plain", &value) == OK && value == string(1000, 'p'));
+}
+
+TEST_F(KVEmptyTest, CompressedValuesSaveSpaceTest) {
+    KVTree *kv = new KVTree(PATH, PMEMOBJ_MIN_POOL, LAYOUT);
+    kv->CompressValues(1024);
+    for (int i = 0; i < 2000; i++) {                       // 32 MB of values when uncompressed
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, string(16384, 'z') + istr) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 0; i < 2000; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == string(16384, 'z') + istr);
+    }
+    delete kv;
+}
+
+// =============================================================================================
+// TEST MEDIA LINE LAYOUT
+// =============================================================================================
+
+TEST_F(KVTest, LineClassesHoldLeafAndRecordsTest) {
+    ASSERT_TRUE(kv->Put("key1", string(300, 'v')) == OK) << pmemobj_errormsg();   // leaf & 2 lines
+    ASSERT_TRUE(kv->Put("key2", string(1000, 'w')) == OK) << pmemobj_errormsg();  // 4 lines
+    Analyze();
+    ASSERT_EQ(analysis.leaf_total, 1);
+    ASSERT_EQ(analysis.slot_lines, 6);                     // records start on a line
+    KVRoot* root = (KVRoot*) pmemobj_direct(kv->GetRootOid());
+    ASSERT_EQ((uintptr_t) root->head.get() % LINE_SIZE, 0);
+    Reopen();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == string(300, 'v'));
+    value.clear();
+    ASSERT_TRUE(kv->Get("key2", &value) == OK && value == string(1000, 'w'));
+}
+
+TEST_F(KVTest, SmallSlotsFitOneLineTest) {
+    for (int i = 1; i <= 1000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, string(100, 'v') + istr) == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    ASSERT_EQ(analysis.slot_lines, 1000);                  // no buffer straddles a line
+    Reopen();
+    for (int i = 1; i <= 1000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, string(300, 'w') + istr) == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    ASSERT_EQ(analysis.slot_lines, 2000);                  // updates still start on a line
+    for (int i = 1; i <= 1000; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == string(300, 'w') + istr);
+    }
+}
+
 // =============================================================================================
 // TEST LARGE TREE
 // =============================================================================================
@@ -821,6 +1118,155 @@ TEST_F(KVTest, LargeDescendingAfterRecoveryTest) {
     ASSERT_EQ(analysis.leaf_total, 150000);
 }
 
+TEST_F(KVEmptyTest, OpenWithOptionsTest) {
+    ASSERT_TRUE(pmemkv::KVEngine::Open("kvtree2:fill=0", PATH, SIZE) == nullptr);
+    ASSERT_TRUE(pmemkv::KVEngine::Open("kvtree2:stats=yes", PATH, SIZE) == nullptr);
+    ASSERT_TRUE(pmemkv::KVEngine::Open("kvtree2:fanout=8", PATH, SIZE) == nullptr);
+    auto kv = (KVTree*) pmemkv::KVEngine::Open("kvtree2:fill=90,stats=1,compress=64", PATH, SIZE);
+    ASSERT_TRUE(kv != nullptr);
+    char key[16];
+    for (int i = 1; i <= 4400; i++) {
+        snprintf(key, sizeof(key), "%06d", i);
+        ASSERT_TRUE(kv->Put(key, string(100, 'x')) == OK) << pmemobj_errormsg();
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("000001", &value) == OK && value == string(100, 'x'));
+    ASSERT_TRUE(kv->Get("999999", &value) == NOT_FOUND);
+    KVTreeAnalysis analysis = {};
+    kv->Analyze(analysis);
+    ASSERT_LE(analysis.leaf_total, 105);                   // ascending leaves keep 44 of 49 keys
+    KVTreeStats stats = {};
+    kv->Stats(stats);
+    ASSERT_EQ(stats.gets, 2);
+    ASSERT_EQ(stats.get_misses, 1);
+    ASSERT_EQ(stats.puts, 4400);
+    ASSERT_EQ(stats.removes, 0);
+    ASSERT_EQ(stats.splits, analysis.leaf_total - 1);
+    pmemkv::KVEngine::Close(kv);
+
+    kv = (KVTree*) pmemkv::KVEngine::Open("kvtree2:recovery_threads=100000", PATH, SIZE);  // capped
+    ASSERT_TRUE(kv != nullptr);
+    for (int i = 1; i <= 4400; i++) {
+        snprintf(key, sizeof(key), "%06d", i);
+        value.clear();
+        ASSERT_TRUE(kv->Get(key, &value) == OK && value == string(100, 'x'));
+    }
+    KVTreeAnalysis recovered = {};
+    kv->Analyze(recovered);
+    ASSERT_EQ(recovered.leaf_total, analysis.leaf_total);
+    kv->Stats(stats);
+    ASSERT_EQ(stats.gets, 0);                              // not counted unless enabled
+    pmemkv::KVEngine::Close(kv);
+}
+
+// =============================================================================================
+// TEST ONLINE COMPACTION
+// =============================================================================================
+
+TEST_F(KVTest, CompactEmptyTest) {
+    kv->Compact(0);
+    KVCompaction compaction;
+    kv->Compaction(compaction);
+    ASSERT_TRUE(compaction.complete);
+    ASSERT_EQ(compaction.leaves_relocated, 0);
+    ASSERT_EQ(compaction.leaves_freed, 0);
+}
+
+TEST_F(KVTest, CompactSparseLeavesTest) {
+    for (int i = 1; i <= 10000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= 10000; i++) {
+        if (i % 10 != 0) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    }
+    Analyze();
+    size_t leaf_total = analysis.leaf_total;
+    kv->Compact(0);
+    KVCompaction compaction;
+    kv->Compaction(compaction);
+    ASSERT_TRUE(compaction.complete);
+    ASSERT_GT(compaction.leaves_merged, 0);
+    ASSERT_EQ(compaction.slots_relocated, 1000);
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, 0);
+    ASSERT_EQ(analysis.leaf_prealloc, 0);
+    ASSERT_LT(analysis.leaf_total, leaf_total);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 1000);
+    for (int i = 1; i <= 10000; i++) {
+        string istr = to_string(i);
+        string value;
+        if (i % 10 == 0) {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND);
+        }
+    }
+}
+
+TEST_F(KVTest, CompactStepsInterleavedWithWritesTest) {
+    for (int i = 1; i <= 5000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= 5000; i += 2) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    int i = 5001;
+    while (kv->CompactStep()) {
+        string istr = to_string(i++);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+        ASSERT_TRUE(kv->Remove(to_string(i - 100)) == OK);
+    }
+    Reopen();
+    for (int j = 2; j < i; j++) {
+        string istr = to_string(j);
+        string value;
+        if ((j <= 5000 && j % 2 == 1) || (j >= 4902 && j < i - 99)) {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND);
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        }
+    }
+}
+
+// =============================================================================================
+// TEST FREEING TREE
+// =============================================================================================
+
+TEST_F(KVTest, FreeTest) {
+    for (int i = 1; i <= 10000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    kv->Free();
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    Analyze();
+    ASSERT_EQ(analysis.leaf_prealloc, 0);
+    ASSERT_EQ(analysis.leaf_total, 0);
+    string value;
+    ASSERT_TRUE(kv->Get("1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Put("1", "1!") == OK);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 1);
+    ASSERT_TRUE(kv->Get("1", &value) == OK && value == "1!");
+}
+
+TEST_F(KVTest, ResumeInterruptedFreeTest) {
+    for (int i = 1; i <= 10000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    persistent_ptr<KVRoot> root = kv->GetRootOid();
+    pool_base pop(kv->GetPool());
+    transaction::exec_tx(pop, [&] {
+        root->freeing = 1;                                 // as if crashed while freeing
+    });
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    Analyze();
+    ASSERT_EQ(analysis.leaf_total, 0);
+}
+
 // =============================================================================================
 // TEST RUNNING OUT OF SPACE
 // =============================================================================================
@@ -838,7 +1284,7 @@ public:
 
     void Reopen() {
         delete kv;
-        kv = new KVTree(PATH, SIZE);
+        kv = new KVTree(PATH, SIZE, LAYOUT);
     }
 
     void Validate() {
@@ -870,7 +1316,7 @@ private:
             ASSERT_TRUE(std::system(("cp -f " + PATH_CACHED + " " + PATH).c_str()) == 0);
         } else {
             std::cout << "!!! creating cached copy at " << PATH_CACHED << "\n";
-            KVTree *kvt = new KVTree(PATH, SIZE);
+            KVTree *kvt = new KVTree(PATH, SIZE, LAYOUT);
             for (int i = 1; i <= LARGE_LIMIT; i++) {
                 string istr = to_string(i);
                 ASSERT_TRUE(kvt->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
@@ -878,7 +1324,7 @@ private:
             delete kvt;
             ASSERT_TRUE(std::system(("cp -f " + PATH + " " + PATH_CACHED).c_str()) == 0);
         }
-        kv = new KVTree(PATH, SIZE);
+        kv = new KVTree(PATH, SIZE, LAYOUT);
     }
 };
 
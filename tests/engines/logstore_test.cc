@@ -0,0 +1,503 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <chrono>
+#include <future>
+#include <thread>
+#include "gtest/gtest.h"
+#include "../mock_tx_alloc.h"
+#include "../../src/engines/logstore.h"
+
+using namespace pmemkv::logstore;
+
+const string PATH = "/dev/shm/pmemkv";
+const string LAYOUT = "pmemkv";
+const size_t SIZE = ((size_t) (1024 * 1024 * 1104));
+
+class LogEmptyTest : public testing::Test {
+public:
+    LogEmptyTest() {
+        std::remove(PATH.c_str());
+    }
+};
+
+class LogTest : public testing::Test {
+public:
+    LogAnalysis analysis;
+    LogStore *kv;
+
+    LogTest() {
+        std::remove(PATH.c_str());
+        Open();
+    }
+
+    ~LogTest() { delete kv; }
+
+    void Analyze() {
+        analysis = {};
+        kv->Analyze(analysis);
+        ASSERT_TRUE(analysis.path == PATH);
+    }
+
+    void Reopen() {
+        delete kv;
+        Open();
+    }
+
+private:
+    void Open() {
+        kv = new LogStore(PATH, SIZE, LAYOUT);
+    }
+};
+
+// =============================================================================================
+// TEST EMPTY LOG
+// =============================================================================================
+
+TEST_F(LogEmptyTest, CreateInstanceTest) {
+    LogStore *kv = new LogStore(PATH, PMEMOBJ_MIN_POOL, LAYOUT);
+    LogAnalysis analysis = {};
+    kv->Analyze(analysis);
+    ASSERT_EQ(analysis.segments_free, 0);
+    ASSERT_EQ(analysis.segments_total, 0);
+    ASSERT_EQ(analysis.bytes_used, 0);
+    delete kv;
+}
+
+TEST_F(LogEmptyTest, FailsToCreateInstanceWithInvalidPath) {
+    try {
+        new LogStore("/tmp/123/234/345/456/567/678/nope.nope", PMEMOBJ_MIN_POOL, LAYOUT);
+        FAIL();
+    } catch (...) {
+        // do nothing, expected to happen
+    }
+}
+
+TEST_F(LogEmptyTest, FailsToCreateInstanceWithHugeSize) {
+    try {
+        new LogStore(PATH, 9223372036854775807, LAYOUT);  // 9.22 exabytes
+        FAIL();
+    } catch (...) {
+        // do nothing, expected to happen
+    }
+}
+
+TEST_F(LogEmptyTest, FailsToCreateInstanceWithTinySize) {
+    try {
+        new LogStore(PATH, PMEMOBJ_MIN_POOL - 1, LAYOUT);  // too small
+        FAIL();
+    } catch (...) {
+        // do nothing, expected to happen
+    }
+}
+
+TEST_F(LogEmptyTest, RefusesPoolOfOtherLayoutTest) {
+    LogStore *kv = new LogStore(PATH, SIZE, LAYOUT);
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK);
+    LogRoot *root = (LogRoot*) pmemobj_direct(kv->GetRootOid());
+    root->layout = 0;                                    // as in roots of older pools
+    pmemobj_persist(kv->GetPool(), &root->layout, sizeof(root->layout));
+    delete kv;
+    ASSERT_THROW(new LogStore(PATH, SIZE, LAYOUT), std::invalid_argument);
+}
+
+TEST_F(LogEmptyTest, ReusesSegmentsInSmallPoolTest) {
+    LogStore *kv = new LogStore(PATH, PMEMOBJ_MIN_POOL, LAYOUT);
+    for (int round = 0; round < 100; round++) {           // appends many times the pool size
+        for (int i = 0; i < 1000; i++) {
+            string istr = to_string(i);
+            ASSERT_TRUE(kv->Put(istr, istr + string(100, '!') + to_string(round)) == OK) << pmemobj_errormsg();
+        }
+    }
+    string value;
+    for (int i = 0; i < 1000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + string(100, '!') + "99");
+        value.clear();
+    }
+    LogAnalysis analysis = {};
+    kv->Analyze(analysis);
+    ASSERT_GT(analysis.cleanings, 0);
+    delete kv;
+}
+
+// =============================================================================================
+// TEST SINGLE SEGMENT
+// =============================================================================================
+
+TEST_F(LogTest, BinaryKeyTest) {
+    ASSERT_TRUE(kv->Put("a", "should_not_change") == OK) << pmemobj_errormsg();
+    string key1 = string("a\0b", 3);
+    ASSERT_TRUE(kv->Put(key1, "stuff") == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get(key1, &value) == OK && value == "stuff");
+    string value2;
+    ASSERT_TRUE(kv->Get("a", &value2) == OK && value2 == "should_not_change");
+    EXPECT_EQ(2, kv->TotalNumKeys()) << "TotalNumKeys";
+    ASSERT_TRUE(kv->Remove(key1) == OK);
+    string value3;
+    ASSERT_TRUE(kv->Get(key1, &value3) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("a", &value3) == OK && value3 == "should_not_change");
+}
+
+TEST_F(LogTest, BinaryValueTest) {
+    string value("A\0B\0\0C", 6);
+    ASSERT_TRUE(kv->Put("key1", value) == OK) << pmemobj_errormsg();
+    string value_out;
+    ASSERT_TRUE(kv->Get("key1", &value_out) == OK && (value_out.length() == 6) && (value_out == value));
+    Analyze();
+    ASSERT_EQ(analysis.segments_total, 1);
+}
+
+TEST_F(LogTest, EmptyKeyTest) {
+    ASSERT_TRUE(kv->Put("", "empty") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put(" ", "single-space") == OK) << pmemobj_errormsg();
+    string value1;
+    ASSERT_TRUE(kv->Get("", &value1) == OK && value1 == "empty");
+    string value2;
+    ASSERT_TRUE(kv->Get(" ", &value2) == OK && value2 == "single-space");
+}
+
+TEST_F(LogTest, EmptyValueTest) {
+    ASSERT_TRUE(kv->Put("empty", "") == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("empty", &value) == OK && value == "");
+}
+
+TEST_F(LogTest, GetFixedBufferTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    char buffer[6];
+    int32_t valuebytes = 0;
+    ASSERT_TRUE(kv->Get(6, 4, &valuebytes, "key1", buffer) == OK && valuebytes == 6);
+    ASSERT_TRUE(string(buffer, 6) == "value1");
+    ASSERT_TRUE(kv->Get(5, 4, &valuebytes, "key1", buffer) == FAILED && valuebytes == 6);
+    ASSERT_TRUE(kv->Get(6, 4, &valuebytes, "key2", buffer) == NOT_FOUND);
+}
+
+TEST_F(LogTest, GetHeadlessTest) {
+    string value;
+    ASSERT_TRUE(kv->Get("waldo", &value) == NOT_FOUND);
+}
+
+TEST_F(LogTest, PutTest) {
+    string value;
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
+
+    string new_value;
+    ASSERT_TRUE(kv->Put("key1", "VALUE1") == OK) << pmemobj_errormsg();           // same size
+    ASSERT_TRUE(kv->Get("key1", &new_value) == OK && new_value == "VALUE1");
+
+    string new_value2;
+    ASSERT_TRUE(kv->Put("key1", "new_value") == OK) << pmemobj_errormsg();        // longer size
+    ASSERT_TRUE(kv->Get("key1", &new_value2) == OK && new_value2 == "new_value");
+
+    string new_value3;
+    ASSERT_TRUE(kv->Put("key1", "?") == OK) << pmemobj_errormsg();                // shorter size
+    ASSERT_TRUE(kv->Get("key1", &new_value3) == OK && new_value3 == "?");
+    ASSERT_EQ(kv->TotalNumKeys(), 1);
+}
+
+TEST_F(LogTest, PutValueLargerThanSegmentTest) {
+    ASSERT_TRUE(kv->Put("key1", string(SEGMENT_SIZE, 'x')) == FAILED);
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+}
+
+TEST_F(LogTest, RemoveAllTest) {
+    ASSERT_TRUE(kv->Put("tmpkey", "tmpvalue1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Remove("tmpkey") == OK);
+    string value;
+    ASSERT_TRUE(kv->Get("tmpkey", &value) == NOT_FOUND);
+    Analyze();
+    ASSERT_EQ(analysis.bytes_live, 0);
+}
+
+TEST_F(LogTest, RemoveNonexistentTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    Analyze();
+    size_t used = analysis.bytes_used;
+    ASSERT_TRUE(kv->Remove("nada") == OK);
+    Analyze();
+    ASSERT_EQ(analysis.bytes_used, used);                 // nothing appended
+}
+
+// =============================================================================================
+// TEST RECOVERY
+// =============================================================================================
+
+TEST_F(LogTest, GetMultipleAfterRecoveryTest) {
+    ASSERT_TRUE(kv->Put("abc", "A1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("def", "B2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("hij", "C3") == OK) << pmemobj_errormsg();
+    Reopen();
+    ASSERT_TRUE(kv->Put("jkl", "D4") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("mno", "E5") == OK) << pmemobj_errormsg();
+    string value1;
+    ASSERT_TRUE(kv->Get("abc", &value1) == OK && value1 == "A1");
+    string value2;
+    ASSERT_TRUE(kv->Get("def", &value2) == OK && value2 == "B2");
+    string value3;
+    ASSERT_TRUE(kv->Get("hij", &value3) == OK && value3 == "C3");
+    string value4;
+    ASSERT_TRUE(kv->Get("jkl", &value4) == OK && value4 == "D4");
+    string value5;
+    ASSERT_TRUE(kv->Get("mno", &value5) == OK && value5 == "E5");
+}
+
+TEST_F(LogTest, RemoveAndUpdateAfterRecoveryTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "VALUE2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Remove("key1") == OK);
+    Analyze();
+    size_t used = analysis.bytes_used;
+    size_t live = analysis.bytes_live;
+    Reopen();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("key2", &value) == OK && value == "VALUE2");
+    Analyze();
+    ASSERT_EQ(analysis.bytes_used, used);
+    ASSERT_EQ(analysis.bytes_live, live);
+}
+
+TEST_F(LogTest, TornRecordIgnoredAfterRecoveryTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    Analyze();
+    size_t used = analysis.bytes_used;
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    persistent_ptr<LogRoot> root = kv->GetRootOid();
+    char* torn = root->head->data + used + sizeof(LogRecordHeader) + 4;
+    *torn = 'V';                                           // as if crashed while appending
+    Reopen();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
+    ASSERT_TRUE(kv->Get("key2", &value) == NOT_FOUND);
+    Analyze();
+    ASSERT_EQ(analysis.bytes_used, used);
+    ASSERT_TRUE(kv->Put("key3", "value3") == OK) << pmemobj_errormsg();
+    Reopen();
+    string value3;
+    ASSERT_TRUE(kv->Get("key3", &value3) == OK && value3 == "value3");
+}
+
+TEST_F(LogTest, LargeAfterRecoveryTest) {
+    for (int i = 1; i <= 20000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    Reopen();
+    for (int i = 1; i <= 20000; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+    }
+    ASSERT_EQ(kv->TotalNumKeys(), 20000);
+}
+
+// =============================================================================================
+// TEST SEGMENT CLEANING
+// =============================================================================================
+
+TEST_F(LogTest, CleanRelocatesLiveRecordsTest) {
+    for (int i = 1; i <= 20000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + string(100, '!')) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= 20000; i++) {
+        if (i % 4 != 0) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    }
+    ASSERT_TRUE(kv->Clean());
+    Analyze();
+    ASSERT_GE(analysis.cleanings, 1);
+    ASSERT_GE(analysis.segments_free, 1);
+    for (int i = 1; i <= 20000; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == (i % 4 == 0 ? OK : NOT_FOUND));
+        if (i % 4 == 0) ASSERT_TRUE(value == istr + string(100, '!'));
+    }
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 5000);
+    string value;
+    ASSERT_TRUE(kv->Get("4", &value) == OK && value == "4" + string(100, '!'));
+    ASSERT_TRUE(kv->Get("5", &value) == NOT_FOUND);
+}
+
+TEST_F(LogTest, CleanAfterUpdatesKeepsKeysTest) {
+    for (int round = 0; round < 3; round++) {              // each round outdates the last
+        for (int i = 1; i <= 5000; i++) {
+            string istr = to_string(i);
+            ASSERT_TRUE(kv->Put(istr, istr + string(100, 'a' + round)) == OK) << pmemobj_errormsg();
+        }
+    }
+    for (int i = 1; i <= 5000; i += 2) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Remove((int32_t) istr.size(), istr.data()) == OK);
+    }
+    Analyze();
+    for (size_t s = analysis.segments_total - analysis.segments_free; --s;) {
+        ASSERT_TRUE(kv->Clean());                          // recycle segments of outdated keys
+    }
+    for (int i = 1; i <= 5000; i++) {                      // reuse recycled segments
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put("x" + istr, istr) == OK) << pmemobj_errormsg();
+    }
+    vector<string> keys;
+    kv->ListAllKeys(keys);
+    ASSERT_EQ(keys.size(), 7500);
+    for (int i = 1; i <= 5000; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == (i % 2 == 0 ? OK : NOT_FOUND));
+        if (i % 2 == 0) ASSERT_TRUE(value == istr + string(100, 'c'));
+    }
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 7500);
+}
+
+TEST_F(LogTest, CleanInBackgroundTest) {
+    for (int i = 1; i <= 20000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + string(100, '!')) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= 20000; i++) {
+        if (i % 4 != 0) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    }
+    for (int wait = 0; wait < 100; wait++) {               // periodic check runs every 100 ms
+        Analyze();
+        if (analysis.cleanings > 0) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    ASSERT_GE(analysis.cleanings, 1);
+    for (int i = 4; i <= 20000; i += 4) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + string(100, '!'));
+    }
+}
+
+TEST_F(LogTest, CleanKeepsRemovedKeysRemovedTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    for (int i = 1; i <= 20000; i++) {                    // push key1 into oldest segment
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + string(100, '!')) == OK) << pmemobj_errormsg();
+    }
+    ASSERT_TRUE(kv->Remove("key1") == OK);
+    Analyze();
+    for (size_t s = analysis.segments_total - analysis.segments_free; --s;) {
+        ASSERT_TRUE(kv->Clean());                          // clean every sealed segment once
+    }
+    Reopen();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+    ASSERT_EQ(kv->TotalNumKeys(), 20000);
+}
+
+TEST_F(LogTest, CleanWhileReadingTest) {
+    for (int i = 1; i <= 20000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= 20000; i++) {
+        if (i % 8 != 0) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    }
+    Analyze();
+    size_t sealed = analysis.segments_total - analysis.segments_free - 1;
+    std::future<void> cleaner =
+        std::async(std::launch::async, [&]() { for (size_t s = 0; s < sealed; s++) kv->Clean(); });
+    for (int round = 0; round < 3; round++) {
+        for (int i = 8; i <= 20000; i += 8) {
+            string istr = to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        }
+    }
+    cleaner.wait();
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 2500);
+}
+
+TEST_F(LogTest, ConcurrentWritersTest) {
+    std::future<void> writers[4];
+    for (int t = 0; t < 4; t++) {
+        writers[t] = std::async(std::launch::async, [&, t]() {
+            for (int i = t; i < 20000; i += 4) {
+                string istr = to_string(i);
+                kv->Put(istr, (istr + "!"));
+            }
+        });
+    }
+    for (auto& writer : writers) writer.wait();
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 20000);
+    string value;
+    ASSERT_TRUE(kv->Get("19999", &value) == OK && value == "19999!");
+}
+
+// =============================================================================================
+// TEST FREEING LOG
+// =============================================================================================
+
+TEST_F(LogTest, FreeTest) {
+    for (int i = 1; i <= 10000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    kv->Free();
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    Analyze();
+    ASSERT_EQ(analysis.segments_total, 0);
+    string value;
+    ASSERT_TRUE(kv->Get("1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Put("1", "1!") == OK);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 1);
+    ASSERT_TRUE(kv->Get("1", &value) == OK && value == "1!");
+}
+
+TEST_F(LogTest, ResumeInterruptedFreeTest) {
+    for (int i = 1; i <= 10000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    persistent_ptr<LogRoot> root = kv->GetRootOid();
+    pmem::obj::pool_base pop(kv->GetPool());
+    transaction::exec_tx(pop, [&] {
+        root->freeing = 1;                                 // as if crashed while freeing
+    });
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    Analyze();
+    ASSERT_EQ(analysis.segments_total, 0);
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "gtest/gtest.h"
+#include "../../src/engines/maintenance/executor.h"
+
+using namespace pmemkv::maintenance;
+
+// =============================================================================================
+// TEST MAINTENANCE EXECUTOR
+// =============================================================================================
+
+TEST(ExecutorTest, RunsByPriorityTest) {
+    Executor executor(1);
+    int owner;
+    std::atomic<bool> release(false);
+    std::atomic<bool> started(false);
+    executor.Schedule(&owner, ROUTINE, [&] {               // holds the only worker
+        started = true;
+        while (!release) std::this_thread::yield();
+    });
+    while (!started) std::this_thread::yield();
+    std::mutex mutex;
+    std::vector<int> order;
+    auto record = [&](int task) { return [&, task] { std::lock_guard<std::mutex> lock(mutex); order.push_back(task); }; };
+    executor.Schedule(&owner, ROUTINE, record(4));
+    executor.Schedule(&owner, RESHAPE, record(2));
+    executor.Schedule(&owner, RECLAIM, record(1));
+    executor.Schedule(&owner, RESHAPE, record(3));
+    release = true;
+    executor.Drain(&owner);
+    ASSERT_EQ(order, std::vector<int>({1, 2, 3, 4}));
+}
+
+TEST(ExecutorTest, DelayedAndRescheduledTest) {
+    Executor executor(1);
+    int owner;
+    std::atomic<int> ticks(0);
+    std::function<void()> tick = [&] {
+        if (++ticks < 5) executor.Schedule(&owner, ROUTINE, tick, std::chrono::milliseconds(5));
+    };
+    auto start = std::chrono::steady_clock::now();
+    executor.Schedule(&owner, ROUTINE, tick, std::chrono::milliseconds(5));
+    while (ticks < 5) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(25));
+}
+
+TEST(ExecutorTest, SubMillisecondDelayTest) {
+    Executor executor(1);
+    int owner;
+    std::atomic<int> ticks(0);
+    std::function<void()> tick = [&] {
+        if (++ticks < 10) executor.Schedule(&owner, ROUTINE, tick, std::chrono::microseconds(500));
+    };
+    auto start = std::chrono::steady_clock::now();
+    executor.Schedule(&owner, ROUTINE, tick, std::chrono::microseconds(500));
+    while (ticks < 10) std::this_thread::sleep_for(std::chrono::microseconds(100));
+    ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(5));  // not rounded down
+}
+
+TEST(ExecutorTest, CancelDropsQueuedTasksTest) {
+    Executor executor(2);
+    int owner, other;
+    std::atomic<int> runs(0);
+    std::atomic<int> other_runs(0);
+    executor.Schedule(&owner, ROUTINE, [&] { runs++; }, std::chrono::milliseconds(50));
+    executor.Schedule(&other, ROUTINE, [&] { other_runs++; }, std::chrono::milliseconds(50));
+    executor.Cancel(&owner);
+    executor.Schedule(&owner, ROUTINE, [&] { runs++; });   // accepted again once cancelled
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(runs, 1);
+    ASSERT_EQ(other_runs, 1);
+}
+
+TEST(ExecutorTest, CancelWaitsForRunningTaskTest) {
+    Executor executor(1);
+    int owner;
+    std::atomic<bool> started(false);
+    std::atomic<bool> finished(false);
+    executor.Schedule(&owner, RESHAPE, [&] {
+        started = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        finished = true;
+        executor.Schedule(&owner, RESHAPE, [] {});         // dropped while cancelling
+    });
+    while (!started) std::this_thread::yield();
+    executor.Cancel(&owner);
+    ASSERT_TRUE(finished);
+}
+
+TEST(ExecutorTest, BoundsWorkersTest) {
+    Executor executor(3);
+    int owner;
+    std::atomic<int> active(0);
+    std::atomic<int> peak(0);
+    for (int i = 0; i < 30; i++) {
+        executor.Schedule(&owner, RESHAPE, [&] {
+            int now = ++active;
+            int seen = peak;
+            while (now > seen && !peak.compare_exchange_weak(seen, now));
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            active--;
+        });
+    }
+    executor.Drain(&owner);
+    ASSERT_LE(peak, 3);
+    ASSERT_GE(peak, 2);
+    executor.SetThreads(1);
+    ASSERT_EQ(executor.Threads(), 1);
+}
@@ -109,6 +109,23 @@ TEST_F(MVOidEmptyTest, CreateInstanceTestWithOid) {
     delete kv;
 }
 
+TEST_F(MVOidEmptyTest, OpenByNameWithOptionsTest) {
+    ASSERT_TRUE(pmemkv::KVEngine::Open("mvtree:fanout=8", pop, OID_NULL) == nullptr);
+    ASSERT_TRUE(pmemkv::KVEngine::Open("kvtree2", pop, OID_NULL) == nullptr);   // no pool factory
+    auto kv = pmemkv::KVEngine::Open("mvtree:concurrency=single", pop, OID_NULL);
+    ASSERT_TRUE(kv != nullptr);
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    const PMEMoid oid = kv->GetRootOid();
+    pmemkv::KVEngine::Close(kv);
+    kv = pmemkv::KVEngine::Open("mvtree:concurrency=shared", pop, oid);
+    string value;
+    ASSERT_TRUE(kv != nullptr && kv->Get("key1", &value) == OK && value == "value1");
+    pmemkv::KVEngine::Close(kv);
+    kv = pmemkv::KVEngine::Open("mvtree:concurrency=single", pop);          // at root object
+    ASSERT_TRUE(kv != nullptr);
+    pmemkv::KVEngine::Close(kv);
+}
+
 TEST_F(MVOidEmptyTest, FailsToCreateInstanceWithInvalidPathWithOid) {
     try {
         new MVTree(nullptr, OID_NULL);
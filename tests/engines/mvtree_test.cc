@@ -120,6 +120,16 @@ TEST_F(MVEmptyTest, FailsToCreateInstanceWithTinySize) {
     }
 }
 
+TEST_F(MVEmptyTest, RefusesPoolOfOtherLayoutTest) {
+    MVTree *kv = new MVTree(PATH, SIZE, LAYOUT);
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK);
+    MVRoot *root = (MVRoot*) pmemobj_direct(kv->GetRootOid());
+    root->layout = 0;                                    // as in roots of older pools
+    pmemobj_persist(kv->GetPool(), &root->layout, sizeof(root->layout));
+    delete kv;
+    ASSERT_THROW(new MVTree(PATH, SIZE, LAYOUT), std::invalid_argument);
+}
+
 // =============================================================================================
 // TEST SINGLE-LEAF TREE 
 // =============================================================================================
@@ -757,6 +767,158 @@ TEST_F(MVTest, UsePreallocAfterMultipleLeafRecoveryTest) {
     ASSERT_EQ(analysis.leaf_total, 2);
 }
 
+// =============================================================================================
+// TEST KEY PREFIX ELISION
+// =============================================================================================
+
+TEST_F(MVTest, HierarchicalKeysElidePrefixTest) {
+    for (int i = 1; i <= 1000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put("tenant/0042/user/" + istr, istr) == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    ASSERT_GT(analysis.prefix_bytes, 17 * 900);            // most slots elide tenant & user
+    Reopen();
+    for (int i = 1; i <= 1000; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get("tenant/0042/user/" + istr, &value) == OK && value == istr);
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("tenant/0042/user/", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("tenant/0042", &value) == NOT_FOUND);
+    vector<string> keys;
+    kv->ListAllKeys(keys);
+    ASSERT_EQ(keys.size(), 1000);
+    for (auto& key : keys) ASSERT_EQ(key.compare(0, 17, "tenant/0042/user/"), 0);
+}
+
+TEST_F(MVTest, KeysOutsideLeafPrefixTest) {
+    for (int i = 1; i <= LEAF_KEYS * 2; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put("prefix/" + istr, istr) == OK) << pmemobj_errormsg();
+    }
+    ASSERT_TRUE(kv->Remove("other") == OK);
+    ASSERT_TRUE(kv->Put("other", "1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("a", "2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("prefix", "3") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("zzz", "4") == OK) << pmemobj_errormsg();
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 1; i <= LEAF_KEYS * 2; i++) {
+            string istr = to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get("prefix/" + istr, &value) == OK && value == istr);
+        }
+        string value;
+        ASSERT_TRUE(kv->Get("other", &value) == OK && value == "1");
+        string value2;
+        ASSERT_TRUE(kv->Get("a", &value2) == OK && value2 == "2");
+        string value3;
+        ASSERT_TRUE(kv->Get("prefix", &value3) == OK && value3 == "3");
+        string value4;
+        ASSERT_TRUE(kv->Get("zzz", &value4) == OK && value4 == "4");
+        Reopen();
+    }
+    ASSERT_TRUE(kv->Remove("prefix/1") == OK);
+    string value;
+    ASSERT_TRUE(kv->Get("prefix/1", &value) == NOT_FOUND);
+    ASSERT_EQ(kv->TotalNumKeys(), LEAF_KEYS * 2 + 3);
+}
+
+TEST_F(MVTest, CompactLeavesWithPrefixesTest) {
+    for (int i = 1; i <= 2000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put("group/" + to_string(i % 7) + "/item/" + istr, istr) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= 2000; i++) {
+        if (i % 10 != 0) ASSERT_TRUE(kv->Remove("group/" + to_string(i % 7) + "/item/" + to_string(i)) == OK);
+    }
+    kv->Compact(0);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 10; i <= 2000; i += 10) {
+            string istr = to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get("group/" + to_string(i % 7) + "/item/" + istr, &value) == OK && value == istr);
+        }
+        Reopen();
+    }
+    ASSERT_EQ(kv->TotalNumKeys(), 200);
+}
+
+// =============================================================================================
+// TEST VALUE COMPRESSION
+// =============================================================================================
+
+TEST_F(MVTest, CompressedValuesTest) {
+    kv->CompressValues(64);
+    string noise;
+    for (int i = 0; i < 4096; i++) noise.push_back((char) ((i * 7919 + (i >> 3) * 104729) % 251));
+    const string large = string(4000, 'x') + "end";
+    const string small = string(63, 'y');
+    ASSERT_TRUE(kv->Put("large", large) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("noise", noise) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("small", small) == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("large", &value) == OK && value == large);
+    string value2;
+    ASSERT_TRUE(kv->Get("noise", &value2) == OK && value2 == noise);
+    string value3;
+    ASSERT_TRUE(kv->Get("small", &value3) == OK && value3 == small);
+
+    char buffer[4096];
+    int32_t valuebytes = 0;
+    ASSERT_TRUE(kv->Get(sizeof(buffer), 5, &valuebytes, "large", buffer) == OK);
+    ASSERT_EQ(string(buffer, (size_t) valuebytes), large);
+    ASSERT_TRUE(kv->Get(100, 5, &valuebytes, "large", buffer) == FAILED);
+    ASSERT_EQ(valuebytes, (int32_t) large.size());
+
+    vector<string> kv_pairs;
+    kv->ListAllKeyValuePairs(kv_pairs);
+    ASSERT_EQ(kv_pairs.size(), 6);
+    for (size_t i = 0; i < kv_pairs.size(); i += 2) {
+        if (kv_pairs[i] == "large") { ASSERT_EQ(kv_pairs[i + 1], large); }
+    }
+
+    ASSERT_TRUE(kv->Put("large", "replaced") == OK) << pmemobj_errormsg();
+    string value4;
+    ASSERT_TRUE(kv->Get("large", &value4) == OK && value4 == "replaced");
+    ASSERT_TRUE(kv->Remove("noise") == OK);
+    string value5;
+    ASSERT_TRUE(kv->Get("noise", &value5) == NOT_FOUND);
+}
+
+TEST_F(MVTest, CompressedValuesRecoveryTest) {
+    kv->CompressValues(1);
+    for (int i = 1; i <= LEAF_KEYS + 1; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, string(1000, 'a' + (i % 26)) + istr) == OK) << pmemobj_errormsg();
+    }
+    Reopen();                                              // compression is off after reopening
+    ASSERT_TRUE(kv->Put("plain", string(1000, 'p')) == OK) << pmemobj_errormsg();
+    for (int i = 1; i <= LEAF_KEYS + 1; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == string(1000, 'a' + (i % 26)) + istr);
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("plain", &value) == OK && value == string(1000, 'p'));
+}
+
+TEST_F(MVEmptyTest, CompressedValuesSaveSpaceTest) {
+    MVTree *kv = new MVTree(PATH, PMEMOBJ_MIN_POOL, LAYOUT);
+    kv->CompressValues(1024);
+    for (int i = 0; i < 2000; i++) {                       // 32 MB of values when uncompressed
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, string(16384, 'z') + istr) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 0; i < 2000; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == string(16384, 'z') + istr);
+    }
+    delete kv;
+}
+
 // =============================================================================================
 // TEST LARGE TREE
 // =============================================================================================
@@ -944,6 +1106,141 @@ TEST_F(MVTest, LargeDescendingAfterRecoveryTest) {
 }
 
 
+// =============================================================================================
+// TEST ONLINE COMPACTION
+// =============================================================================================
+
+TEST_F(MVTest, CompactWhileReadingTest) {
+    for (int i = 1; i <= 20000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= 20000; i++) {
+        if (i % 8 != 0) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    }
+    Analyze();
+    size_t leaf_total = analysis.leaf_total;
+
+    std::future<void> compactor =
+        std::async(std::launch::async, [&]() { kv->Compact(0); });
+    for (int round = 0; round < 3; round++) {
+        for (int i = 8; i <= 20000; i += 8) {
+            string istr = to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        }
+    }
+    compactor.wait();
+
+    MVCompaction compaction;
+    kv->Compaction(compaction);
+    ASSERT_TRUE(compaction.complete);
+    ASSERT_GT(compaction.leaves_freed, 0);
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, 0);
+    ASSERT_EQ(analysis.leaf_prealloc, 0);
+    ASSERT_LT(analysis.leaf_total, leaf_total);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 2500);
+}
+
+TEST_F(MVTest, CompactInBackgroundTest) {
+    for (int i = 1; i <= 20000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= 20000; i++) {
+        if (i % 8 != 0) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    }
+    Analyze();
+    size_t leaf_total = analysis.leaf_total;
+
+    kv->CompactInBackground(0);
+    for (int i = 8; i <= 20000; i += 8) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+    }
+    pmemkv::maintenance::Executor::Shared().Drain(kv);
+
+    MVCompaction compaction;
+    kv->Compaction(compaction);
+    ASSERT_TRUE(compaction.complete);
+    Analyze();
+    ASSERT_LT(analysis.leaf_total, leaf_total);
+    kv->CompactInBackground(1);                            // closing cancels the queued steps
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 2500);
+}
+
+TEST_F(MVEmptyTest, CompactInBackgroundSingleThreadedTest) {
+    auto kv = (MVTree*) pmemkv::KVEngine::Open("mvtree:concurrency=single", PATH, SIZE, LAYOUT);
+    ASSERT_TRUE(kv != nullptr);
+    for (int i = 1; i <= 20000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= 20000; i++) {
+        if (i % 8 != 0) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    }
+    MVTreeAnalysis analysis = {};
+    kv->Analyze(analysis);
+    const size_t leaf_total = analysis.leaf_total;
+
+    kv->CompactInBackground(1);                            // runs inline, without locks
+    MVCompaction compaction;
+    kv->Compaction(compaction);
+    ASSERT_TRUE(compaction.complete);
+    for (int i = 8; i <= 20000; i += 8) {                  // caller may use tree right away
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+    }
+    analysis = {};
+    kv->Analyze(analysis);
+    ASSERT_LT(analysis.leaf_total, leaf_total);
+    pmemkv::KVEngine::Close(kv);
+}
+
+// =============================================================================================
+// TEST FREEING TREE
+// =============================================================================================
+
+TEST_F(MVTest, FreeTest) {
+    for (int i = 1; i <= 10000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    kv->Free();
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    Analyze();
+    ASSERT_EQ(analysis.leaf_prealloc, 0);
+    ASSERT_EQ(analysis.leaf_total, 0);
+    string value;
+    ASSERT_TRUE(kv->Get("1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Put("1", "1!") == OK);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 1);
+    ASSERT_TRUE(kv->Get("1", &value) == OK && value == "1!");
+}
+
+TEST_F(MVTest, ResumeInterruptedFreeTest) {
+    for (int i = 1; i <= 10000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    persistent_ptr<MVRoot> root = kv->GetRootOid();
+    pool_base pop(kv->GetPool());
+    transaction::exec_tx(pop, [&] {
+        root->freeing = 1;                                 // as if crashed while freeing
+    });
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    Analyze();
+    ASSERT_EQ(analysis.leaf_total, 0);
+}
+
 // =============================================================================================
 // TEST RUNNING OUT OF SPACE
 // =============================================================================================
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include "gtest/gtest.h"
+#include "../../src/engines/sharded.h"
+
+using namespace pmemkv::sharded;
+
+const string PATH = "/dev/shm/pmemkv";
+const string LAYOUT = "pmemkv";
+const size_t SIZE = ((size_t) (1024 * 1024 * 64));
+
+static void RemoveShards() {
+    for (int i = 0; access((PATH + "." + to_string(i)).c_str(), F_OK) == 0; i++) {
+        std::remove((PATH + "." + to_string(i)).c_str());
+    }
+    std::remove((PATH + "_a").c_str());
+    std::remove((PATH + "_b").c_str());
+}
+
+class ShardedTest : public testing::Test {
+public:
+    Sharded* kv;
+
+    ShardedTest() {
+        RemoveShards();
+        Open();
+    }
+
+    ~ShardedTest() {
+        delete kv;
+        RemoveShards();
+    }
+
+    void Reopen() {
+        delete kv;
+        Open();
+    }
+
+private:
+    void Open() {
+        kv = new Sharded(PATH, SIZE * Sharded::NodeCount(), LAYOUT);
+    }
+};
+
+TEST_F(ShardedTest, CreatesOneShardPerNodeTest) {
+    ASSERT_EQ(kv->ShardCount(), (size_t) Sharded::NodeCount());
+    for (size_t i = 0; i < kv->ShardCount(); i++) {
+        ASSERT_TRUE(access((PATH + "." + to_string(i)).c_str(), F_OK) == 0);
+        ASSERT_EQ(kv->ShardNode(i), (int) i);
+    }
+}
+
+TEST_F(ShardedTest, SimpleTest) {
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK);
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
+    ASSERT_TRUE(kv->Remove("key1") == OK);
+    string value2;
+    ASSERT_TRUE(kv->Get("key1", &value2) == NOT_FOUND);
+}
+
+TEST_F(ShardedTest, GetFixedSizeBufferTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK);
+    char buffer[16];
+    int32_t valuebytes = 0;
+    ASSERT_TRUE(kv->Get(sizeof(buffer), 4, &valuebytes, "key1", buffer) == OK);
+    ASSERT_EQ(string(buffer, (size_t) valuebytes), "value1");
+}
+
+TEST_F(ShardedTest, ShardForIsStableTest) {
+    for (int i = 0; i < 100; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->ShardFor(istr) < kv->ShardCount());
+        ASSERT_EQ(kv->ShardFor(istr), kv->ShardFor(istr.data(), istr.size()));
+    }
+}
+
+TEST_F(ShardedTest, PutMultipleAfterRecoveryTest) {
+    for (int i = 1; i <= 1000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK);
+    }
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 1000);
+    for (int i = 1; i <= 1000; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+    }
+    vector<string> keys;
+    kv->ListAllKeys(keys);
+    ASSERT_EQ(keys.size(), 1000);
+}
+
+TEST_F(ShardedTest, PrefaultKeepsDataTest) {
+    for (int i = 1; i <= 100; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK);
+    }
+    kv->Prefault(4, true);
+    for (int i = 1; i <= 100; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+    }
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK);
+}
+
+TEST(ShardedPathListTest, OpensExplicitPathListTest) {
+    RemoveShards();
+    Sharded* kv = new Sharded(PATH + "_a," + PATH + "_b", SIZE * 2, LAYOUT);
+    ASSERT_EQ(kv->ShardCount(), 2);
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK);
+    delete kv;
+    kv = new Sharded(PATH + "_a," + PATH + "_b", SIZE * 2, LAYOUT);
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
+    delete kv;
+    RemoveShards();
+}